@@ -203,7 +203,7 @@ u8 radio_output_send_msg(u8 a, u8 b, u8 c, u8 d, u8 e, u8 f, u8 g)
     radio_state_machine();
   
 // avrtalk display mirror
-//    send_msg(BROADCAST_NODE_ID, 0xDD, 7, radio_context.msg.octets, 0);
+//    send_msg(&uart_link, BROADCAST_NODE_ID, 0xDD, 7, radio_context.msg.octets, 0);
     
     return 0;
 }
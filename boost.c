@@ -466,9 +466,9 @@ void output_boost(u16 avg_adc10q6, u8 mode, u8 is_peak, u8 ignore_radio)
 
         value = adc_to_mbar(avg_adc10q6);
 #if 0
-        send_msg(BROADCAST_NODE_ID, 0xCC, 4, &mbar, 0); 
-        send_msg(BROADCAST_NODE_ID, 0xCD, 2, &avg_adc10q6, 0); 
-        send_msg(BROADCAST_NODE_ID, 0xCE, 2, &DIV_1BAR_16Q0, 0); 
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xCC, 4, &mbar, 0); 
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xCD, 2, &avg_adc10q6, 0); 
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xCE, 2, &DIV_1BAR_16Q0, 0); 
 #endif
     }
     else
@@ -31,6 +31,16 @@ void bufferpool_init();
 void	brel	    (void *buf);
 void   *bget	    (u8 size);
 
+#ifdef EMBEDDED
+typedef u8  bufsize_t;
+#else
+/* Host payloads may be big packets */
+typedef u16 bufsize_t;
+#endif
+
+u8 *bufferpool_request(bufsize_t size);
+void bufferpool_release(u8 *buf);
+
 #ifdef EMBEDDED
 
 #define BUFSZ   9
@@ -40,10 +50,23 @@ typedef struct {
     u8  buf[BUFSZ];
     u8  flags;
 } buff_t;
+#else
 
-void bufferpool_release(u8 *buf);
+/* Host pool: power of two size classes from 16 bytes to 64kB.
+ * Buffers are carved out of large slabs and recycled through per-class
+ * free lists, so the receive path never calls malloc once warm. */
+#define POOL_MIN_SHIFT      4
+#define POOL_MAX_SHIFT      16
+#define POOL_CLASSES        (POOL_MAX_SHIFT-POOL_MIN_SHIFT+1)
+#define POOL_SLAB_SIZE      (64*1024L)
+
+typedef struct {
+    unsigned long   requests;
+    unsigned long   slabs;
+    unsigned long   in_use;
+} bufferpool_stats_t;
 
-u8 *bufferpool_request(u8 size);
+extern bufferpool_stats_t bufferpool_stats;
 #endif
 
 
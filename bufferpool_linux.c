@@ -0,0 +1,121 @@
+/******************************************************************************
+* File:              bufferpool_linux.c
+* Author:            Kevin Day
+* Date:              December, 2004
+* Description:       Receive buffer pool, host side
+*
+*
+* Copyright (c) 2004 Kevin Day
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+#include <stdlib.h>
+#include "types.h"
+#include "bufferpool.h"
+
+/* Every buffer is preceded by this header.  While free it links the
+ * buffer into its class's free list; while in use it only remembers
+ * the class so release doesn't need to be told the size. */
+typedef union pool_hdr {
+    union pool_hdr  *next;
+    unsigned        cls;
+    long double     align;
+} pool_hdr_t;
+
+static pool_hdr_t *free_list[POOL_CLASSES];
+
+bufferpool_stats_t bufferpool_stats;
+
+static unsigned size_to_class(bufsize_t size)
+{
+    unsigned cls = 0;
+    unsigned long csz = 1<<POOL_MIN_SHIFT;
+
+    while (csz < size && cls < POOL_CLASSES-1)
+    {
+        csz <<= 1;
+        ++cls;
+    }
+    return cls;
+}
+
+/******************************************************************************
+* pool_grow
+*        Carve a new slab into buffers of class cls.  The largest classes
+*        get one buffer per slab.
+*******************************************************************************/
+static int pool_grow(unsigned cls)
+{
+    size_t bufsz = sizeof(pool_hdr_t) + (1L<<(cls+POOL_MIN_SHIFT));
+    size_t count = POOL_SLAB_SIZE / bufsz;
+    u8 *slab;
+    size_t i;
+
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    slab = malloc(bufsz * count);
+    if (!slab)
+    {
+        return -1;
+    }
+    ++bufferpool_stats.slabs;
+
+    for(i=0; i<count; i++)
+    {
+        pool_hdr_t *h = (pool_hdr_t *)(slab + i*bufsz);
+        h->next = free_list[cls];
+        free_list[cls] = h;
+    }
+    return 0;
+}
+
+void bufferpool_init()
+{
+}
+
+u8 *bufferpool_request(bufsize_t size)
+{
+    unsigned cls = size_to_class(size);
+    pool_hdr_t *h;
+
+    if (!free_list[cls] && pool_grow(cls))
+    {
+        return NULL;
+    }
+
+    h = free_list[cls];
+    free_list[cls] = h->next;
+    h->cls = cls;
+
+    ++bufferpool_stats.requests;
+    ++bufferpool_stats.in_use;
+
+    return (u8 *)(h+1);
+}
+
+void bufferpool_release(u8 *buf)
+{
+    pool_hdr_t *h = ((pool_hdr_t *)buf) - 1;
+    unsigned cls = h->cls;
+
+    h->next = free_list[cls];
+    free_list[cls] = h;
+
+    --bufferpool_stats.in_use;
+}
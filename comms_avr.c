@@ -37,6 +37,9 @@ u8 get_node_id()
     return 1;
 }
 
+/* The one and only serial link on this board. */
+comms_link_t uart_link;
+
 static task_t   comms_taskinfo;
 #ifdef COMMS_MAILBOX
 static u8       comms_mailbox_buf[20];
@@ -61,8 +64,14 @@ task_t* comms_task_create()
 }
 
 u8 rxfifo_head, rxfifo_tail;
-#define RXFIFO_MASK 0xF
+#define RXFIFO_MASK 0x1F
 u8 rxfifo[RXFIFO_MASK+1];
+
+/* Credit for the host (COMMS_MSG_CREDIT): octets taken from rxfifo, and
+ * how many of those it has been told about.  A full FIFO is one short of
+ * its size. */
+#define RX_CREDIT_WINDOW    RXFIFO_MASK
+static u8 rx_taken, rx_advertised, rx_credit_on;
 #if 0
 u16 bytes_received;
 u8 rx_errors, latch_error;
@@ -93,13 +102,25 @@ u8 comms_task()
 #ifdef PACKET_RECEIVE_SUPPORT
     u8 ret = 0;
     u8 code, payload_len;
+    u8 frames = 0;
 
     while(rxfifo_head != rxfifo_tail)
     {
-        rx_notify(rxfifo[rxfifo_head], 0);
+        /* counted first, so a CREDIT request sees itself taken */
+        ++rx_taken;
+        frames |= rx_notify(&uart_link, rxfifo[rxfifo_head], 0);
         rxfifo_head = ((rxfifo_head+1)&RXFIFO_MASK);
     }
 
+    /* After each frame, or half a window into one that's long */
+    if (rx_credit_on && rx_taken != rx_advertised &&
+        (frames || (u8)(rx_taken - rx_advertised) >= RX_CREDIT_WINDOW/2))
+    {
+        rx_advertised = rx_taken;
+        send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_COMMS<<4|COMMS_MSG_CREDIT,
+                1, &rx_advertised);
+    }
+
 #ifdef COMMS_MAILBOX
     if (mailbox_head(&comms_taskinfo.mailbox, &code, &payload_len))
     {
@@ -121,7 +142,7 @@ u8 comms_task()
                 u8 sz;
                 sz = mailbox_copy_payload(&comms_taskinfo.mailbox,
                     msgbuf, MAX_BUFFERED_MSG_SIZE, 0);
-                send_msg(saved_to, saved_code, sz, msgbuf);
+                send_msg(&uart_link, saved_to, saved_code, sz, msgbuf);
                 break;
             }
         }
@@ -139,7 +160,7 @@ u8 comms_task()
 //u8 packet_drops_overflow;
 //u8 packet_drops_badcode;
 
-void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
+void packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload)
 {
     /* code is divided into two nibbles.
      * the first nibble indicates the task mailbox for the
@@ -150,14 +171,14 @@ void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
 
 #if 0
     u8 dbg[] = {bytes_received>>8, bytes_received, rx_errors, latch_error};
-    send_msg(0xF, 0xF3, sizeof(dbg), dbg);
+    send_msg(&uart_link, 0xF, 0xF3, sizeof(dbg), dbg);
 #endif
 
     if (taskid == TASK_ID_COMMS)
     {
         if (code == COMMS_MSG_ECHO_REQUEST)
         {
-            send_msg(addr.from, 
+            send_msg(link, addr.from, 
                     TASK_ID_COMMS<<4|COMMS_MSG_ECHO_REPLY, 
                     length, payload);
 
@@ -175,6 +196,27 @@ void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
 			}
 #endif
         }
+        else if (code == COMMS_MSG_FRAMING && length == 1 &&
+                payload[0] <= COMMS_FRAMING_COBS)
+        {
+            /* answered in the framing the host asked in */
+            send_msg(link, addr.from,
+                    TASK_ID_COMMS<<4|COMMS_MSG_FRAMING,
+                    length, payload);
+            link->framing = payload[0];
+        }
+        else if (code == COMMS_MSG_CREDIT && length == 1)
+        {
+            u8 credit[2];
+
+            rx_credit_on = payload[0];
+            rx_advertised = rx_taken;
+            credit[0] = rx_taken;
+            credit[1] = rx_credit_on ? RX_CREDIT_WINDOW : 0;
+            send_msg(link, addr.from,
+                    TASK_ID_COMMS<<4|COMMS_MSG_CREDIT,
+                    2, credit);
+        }
 #if 0
         else if (code == COMMS_MSG_RESET_BOARD)
         {
@@ -197,7 +239,7 @@ void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
     else if (task == NULL)
     {
         DEBUG("invalid message code");
-//        send_msg(addr.from, 
+//        send_msg(&uart_link, addr.from, 
 //                TASK_ID_COMMS<<4|COMMS_MSG_BADTASK, 
 //                1, &taskid);
 //        ++packet_drops_badcode;
@@ -213,15 +255,23 @@ void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
     }    
     if(payload)
     {
-        bufferpool_release(payload);
+        rx_payload_release(link, payload);
     }
 }
+
+/* A frame failed its checksum.  Whatever it was, it never reaches a
+ * mailbox; the NAK lets the host send it again at once.  The payload
+ * is released by rx_notify. */
+void bad_packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload)
+{
+    send_msg(link, BROADCAST_NODE_ID, TASK_ID_COMMS<<4|COMMS_MSG_NAK, 1, &code);
+}
 #endif // PACKET_RECEIVE_SUPPORT
 
 /* This should be changed to be interrupt-driven.
  * A simple Tx ring queue using the TX done interrupt
  * would suffice... */
-void tx_enqueue(u8 data)
+void tx_enqueue(comms_link_t *link, u8 data)
 {
     while (!(UCSR0A & _BV(UDRE0)))
         ;
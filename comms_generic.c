@@ -23,12 +23,16 @@
 *******************************************************************************/
 #include "comms_generic.h"
 #include "bufferpool.h"
+#ifndef EMBEDDED
+#include <stdlib.h>
+#include <string.h>
+#endif
 
 
 /* External byte transmit routine.
  * Will block on full buffer.
  */
-void tx_enqueue(u8 data);
+void tx_enqueue(comms_link_t *link, u8 data);
 
 /* External node ID routine 
  * Return unique 4 bit value
@@ -36,286 +40,500 @@ void tx_enqueue(u8 data);
 u8 get_node_id();
 
 
-static void tx_enqueue_with_escape(u8 octet)
+#ifndef EMBEDDED
+/* The block so far, behind its code */
+static void tx_cobs_block(comms_link_t *link, u8 code)
+{
+    u8 i;
+
+    tx_enqueue(link, code);
+    for(i=0; i<link->tx_run; i++)
+    {
+        tx_enqueue(link, link->tx_block[i]);
+    }
+    link->tx_run = 0;
+}
+#endif
+
+static void tx_enqueue_with_escape(comms_link_t *link, u8 octet)
 {
-    if (octet == 0x7D || octet == 0x7E)
+    if (link->framing == COMMS_FRAMING_COBS)
+    {
+#ifdef EMBEDDED
+        /* The code follows its octets; see comms_generic.h */
+        if (octet == 0)
+        {
+            tx_enqueue(link, link->tx_run + 1);
+            link->tx_run = 0;
+            return;
+        }
+        tx_enqueue(link, octet);
+        if (++link->tx_run == COBS_BLOCK_MAX)
+        {
+            tx_enqueue(link, 0xFF);
+            link->tx_run = 0;
+        }
+#else
+        if (octet == 0)
+        {
+            tx_cobs_block(link, link->tx_run + 1);
+            return;
+        }
+        link->tx_block[link->tx_run] = octet;
+        if (++link->tx_run == COBS_BLOCK_MAX)
+        {
+            tx_cobs_block(link, 0xFF);
+        }
+#endif
+    }
+    else if (octet == 0x7D || octet == 0x7E)
     {
-        tx_enqueue(0x7D);
-        tx_enqueue(octet ^ 0x20);
+        tx_enqueue(link, 0x7D);
+        tx_enqueue(link, octet ^ 0x20);
     }
     else
     {
-        tx_enqueue(octet);
+        tx_enqueue(link, octet);
     }
 }
 
-void tx_csum_and_escape(u8 octet, fcsum_t *cs)
+void tx_csum_and_escape(comms_link_t *link, u8 octet, fcsum_t *cs)
 {
-    tx_enqueue_with_escape(octet);
+    tx_enqueue_with_escape(link, octet);
     cs->A += octet;
     cs->B += cs->A;
 }
 
+static void tx_frame_start(comms_link_t *link)
+{
+    if (link->framing == COMMS_FRAMING_COBS)
+    {
+        tx_enqueue(link, COBS_DELIMITER);
+        link->tx_run = 0;
+    }
+    else
+    {
+        tx_enqueue(link, COMM_PREAMBLE);
+    }
+}
+
 #define ETOOBIG 2
 #define EBADADDR 3
 
-fcsum_t send_msghdr(u8 to, u8 code, u16 payload_len)
+fcsum_t send_msghdr(comms_link_t *link, u8 to, u8 code, u16 payload_len)
 {
     fcsum_t fcsum = {0,0};
     
     /* Build the message up one byte at a time rather than
      * using the structure, to save some RAM. */
 
-    tx_enqueue(COMM_PREAMBLE);
+    tx_frame_start(link);
 
     if (payload_len >= 16)
     {
         /* Set "payload" length to 2 indicating there
          * are two octets of payload size preceeding the
          * payload itself. */
-        tx_csum_and_escape(((1<<4) | MSG_FLAGS_BIGPACKET), &fcsum);
+        tx_csum_and_escape(link, ((2<<4) | MSG_FLAGS_BIGPACKET), &fcsum);
     }
     else
     {
         /* flags . payload_length -- flags are 0 */
-        tx_csum_and_escape(payload_len<<4, &fcsum);
+        tx_csum_and_escape(link, payload_len<<4, &fcsum);
     }
     
-    tx_csum_and_escape(to<<4 | get_node_id(), &fcsum);
+    tx_csum_and_escape(link, to<<4 | get_node_id(), &fcsum);
     
-    tx_csum_and_escape(code, &fcsum);
+    tx_csum_and_escape(link, code, &fcsum);
 
     if (payload_len >= 16)
     {
-        tx_csum_and_escape(payload_len>>8, &fcsum);
-        tx_csum_and_escape(payload_len, &fcsum);
+        /* little endian, as the receiver expects */
+        tx_csum_and_escape(link, payload_len, &fcsum);
+        tx_csum_and_escape(link, payload_len>>8, &fcsum);
     }
 
     return fcsum;
 }
 
 #define SANITY_CHECK
-int send_msg(u8 to, u8 code, u8 payload_len, u8 *payload)
+int send_msg(comms_link_t *link, u8 to, u8 code, u8 payload_len, u8 *payload)
 {
     s8 i;
 
-    fcsum_t fcsum = send_msghdr(to, code, payload_len);
+    fcsum_t fcsum = send_msghdr(link, to, code, payload_len);
 
     for(i=0; i<payload_len; i++)
     {
         u8 v = payload[i];
-        tx_csum_and_escape(v, &fcsum);
+        tx_csum_and_escape(link, v, &fcsum);
     }
     
-    send_msgfcs(fcsum);
+    send_msgfcs(link, fcsum);
 
     return 0;
 }
 
-void send_msgfcs(fcsum_t fcsum)
+void send_msgfcs(comms_link_t *link, fcsum_t fcsum)
 {
-    tx_enqueue_with_escape(fcsum.A);
-    tx_enqueue_with_escape(fcsum.B);
+    tx_enqueue_with_escape(link, fcsum.A);
+    tx_enqueue_with_escape(link, fcsum.B);
+
+    if (link->framing == COMMS_FRAMING_COBS)
+    {
+        /* the last block, with no 0 after it */
+#ifdef EMBEDDED
+        tx_enqueue(link, link->tx_run + 1);
+        link->tx_run = 0;
+#else
+        tx_cobs_block(link, link->tx_run + 1);
+#endif
+        tx_enqueue(link, COBS_DELIMITER);
+    }
 }    
 
 #ifdef PACKET_RECEIVE_SUPPORT 
 /* External packet dispatcher.
  * Called when a packet is successfully received. */
-void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload);
-void bad_packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload);
-
-/* Buffer allocator */
-u8 *bufferpool_request(u8 size);
-void bufferpool_release(u8 *ptr);
-
-/* Asynchronous notification of byte reception. 
- * Called by serial driver. 
- * On error case (i.e. bad async frame), the current
- * packet (if any) is aborted and hunt mode is entered. */
-typedef enum {
-    PREAMBLE_HUNT=0,
-    IN_HEADER=1,
-    IN_PAYLOAD=2,
-    IN_TRAILER=3
-} rx_state_t;
-
-typedef struct {
-    rx_state_t  state;
-    u8          esc;
-} rx_status_t;
-
-rx_status_t     rx_stat = {PREAMBLE_HUNT, 0};
-msghdr_t        rx_hdr_buf;
-msgtrlr_t       rx_trlr_buf;
-u8              *rx_buf_ptr;
-u8              *rx_payload_ptr;
-u16             rx_payload_len;
+void packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload);
+void bad_packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload);
 
 #ifndef EMBEDDED
-#define DO_CSUM
-#endif
-
-#ifdef DO_CSUM
-fcsum_t fcsum_rcv;
+void comms_link_set_rx_ring(comms_link_t *link, u8 *ring, u32 size)
+{
+    link->rx_ring = ring;
+    link->rx_ring_size = size;
+    link->rx_ring_head = 0;
+}
 #endif
 
-u8  rx_notify(u8 data, u8 error_detected)
+/* Get somewhere to put a payload of size bytes. */
+static inline u8 *rx_payload_request(comms_link_t *link, u16 size)
 {
-    u8 ret = 0;
-    
-    COMMS_DEBUG(" rx_notif(%02X) : state %d esc %d hdr %X payload %X trlr %X ptr %X\n", 
-            data,
-            rx_stat.state, rx_stat.esc,
-            &rx_hdr_buf, rx_payload_ptr, &rx_trlr_buf, rx_buf_ptr);
-                
-    if (data == COMM_PREAMBLE)
+#ifndef EMBEDDED
+    if (link->rx_ring && size <= link->rx_ring_size)
     {
-        if (rx_stat.state != PREAMBLE_HUNT)
+        u8 *p;
+        if (link->rx_ring_head + size > link->rx_ring_size)
         {
-            COMMS_DEBUG("Unexpected preamble in state %d\n", rx_stat.state);
+            link->rx_ring_head = 0;
         }
-        if (rx_payload_ptr)
-        {
-            bufferpool_release(rx_payload_ptr);
-        }
-        
-#ifdef DO_CSUM
-        fcsum_rcv.A = fcsum_rcv.B = 0;
+        p = link->rx_ring + link->rx_ring_head;
+        link->rx_ring_head += size;
+        return p;
+    }
 #endif
-        
-        rx_stat.state = IN_HEADER;
-        rx_stat.esc = 0;
-        rx_buf_ptr = (u8*)&rx_hdr_buf;
-        return 0;
+    return bufferpool_request(size);
+}
+
+void rx_payload_release(comms_link_t *link, u8 *payload)
+{
+#ifndef EMBEDDED
+    if (link->rx_ring && payload >= link->rx_ring && 
+            payload < link->rx_ring + link->rx_ring_size)
+    {
+        /* ring space is reclaimed as the ring wraps */
+        return;
     }
+#endif
+    bufferpool_release(payload);
+}
 
-    if (rx_stat.esc)
+/* Header (and length prefix, if any) is in.  Get a buffer for the 
+ * payload, or go straight to the trailer if there isn't one. */
+static void rx_start_payload(comms_link_t *link)
+{
+    if (link->rx_payload_len == 0)
     {
-        /* Last character was 0x7D */
-        data ^= COMM_ESCXOR;
-        rx_stat.esc = 0;
+        link->rx_stat.state = IN_TRAILER;
+        link->rx_buf_ptr = (u8*) &link->rx_trlr_buf;
+        return;
     }
-    else if (data == COMM_ESCAPE)
+
+    link->rx_payload_ptr = rx_payload_request(link, link->rx_payload_len);
+    if (link->rx_payload_ptr == 0)
     {
-        /* No character available yet */
-        rx_stat.esc = 1;
-        return 0;
+        COMMS_DEBUG("Failed to allocate buffer of %d bytes\n",
+                link->rx_payload_len);
+        link->rx_stat.state = PREAMBLE_HUNT;
+        return;
+    }
+    link->rx_stat.state = IN_PAYLOAD;                    
+    link->rx_buf_ptr = link->rx_payload_ptr;
+}
+
+/* A frame starts; whatever was being received is dropped. */
+static void rx_frame_start(comms_link_t *link)
+{
+    if (link->rx_payload_ptr)
+    {
+        rx_payload_release(link, link->rx_payload_ptr);
+        link->rx_payload_ptr = 0;
     }
 
 #ifdef DO_CSUM
-    if (rx_stat.state != IN_TRAILER)
+    link->fcsum_rcv.A = link->fcsum_rcv.B = 0;
+#endif
+
+    link->rx_stat.state = IN_HEADER;
+    link->rx_stat.esc = 0;
+    link->rx_stat.cobs_left = 0;
+    link->rx_buf_ptr = (u8*)&link->rx_hdr_buf;
+}
+
+/* One octet of the frame, unescaped or unstuffed */
+static u8 rx_octet(comms_link_t *link, u8 data)
+{
+    u8 ret = 0;
+
+#ifdef DO_CSUM
+    if (link->rx_stat.state != IN_TRAILER)
     {
-        fcsum_rcv.A += data;
-        fcsum_rcv.B += fcsum_rcv.A;
-        COMMS_DEBUG("CSUM %02X: %02X %02X\n", data, fcsum_rcv.A, fcsum_rcv.B);
+        link->fcsum_rcv.A += data;
+        link->fcsum_rcv.B += link->fcsum_rcv.A;
+        COMMS_DEBUG("CSUM %02X: %02X %02X\n", data, link->fcsum_rcv.A, link->fcsum_rcv.B);
     }
 #endif
     
-    switch(rx_stat.state)
+    switch(link->rx_stat.state)
     {
         case PREAMBLE_HUNT:
             COMMS_DEBUG("Junk in hunt state: %02X\n", data);
             break;
         case IN_HEADER:
-            *rx_buf_ptr++ = data;
-            if (rx_buf_ptr == (u8*)&rx_hdr_buf + sizeof(msghdr_t))
+            *link->rx_buf_ptr++ = data;
+            if (link->rx_buf_ptr == (u8*)&link->rx_hdr_buf + sizeof(msghdr_t))
             {
-                if (rx_hdr_buf.payload_length > 0)
+                link->rx_payload_len = link->rx_hdr_buf.payload_length;
+#ifndef EMBEDDED
+                /* big packet receive not supported on AVR. 
+                 * The length prefix is collected in place, so the 
+                 * payload buffer is only allocated once. */
+                if ((link->rx_hdr_buf.flags & MSG_FLAGS_BIGPACKET) && 
+                        link->rx_payload_len)
                 {
-                    /* Payload size is known.  Get a buffer. */
-                    rx_payload_ptr = bufferpool_request(rx_hdr_buf.payload_length);
-                    if (rx_payload_ptr == 0)
-                    {
-                        COMMS_DEBUG("Failed to allocate buffer of %d bytes\n",
-                                rx_hdr_buf.payload_length);
-                        rx_stat.state = PREAMBLE_HUNT;
-                        return 0;
-                    }
-                    rx_stat.state = IN_PAYLOAD;                    
-                    rx_buf_ptr = rx_payload_ptr;
-                    rx_payload_len = rx_hdr_buf.payload_length;
+                    link->rx_stat.state = IN_LENGTH;
+                    link->rx_len_octets = 0;
+                    link->rx_payload_len = 0;
                 }
                 else
-                {                    
-                    rx_stat.state = IN_TRAILER;
-                    rx_buf_ptr = (u8*) &rx_trlr_buf;
-                }                    
+#endif
+                {
+                    rx_start_payload(link);
+                }
             }
             break;
-        case IN_PAYLOAD:
-            *rx_buf_ptr++ = data;
-            if ((rx_buf_ptr - rx_payload_ptr) == rx_payload_len)
-            {
 #ifndef EMBEDDED
-                /* big packet receive not supported on AVR. */
-                if (rx_hdr_buf.flags & MSG_FLAGS_BIGPACKET)
-                {
-                    u8 i;
-                    u32 real_payload_length = 0;
-                    for(i=0; i<rx_hdr_buf.payload_length; i++)
-                    {
-                        real_payload_length += rx_payload_ptr[i]<<(8*i);
-                    }
-                    bufferpool_release(rx_payload_ptr);
-                    rx_payload_ptr = bufferpool_request(real_payload_length);
-                    rx_hdr_buf.flags &= ~(MSG_FLAGS_BIGPACKET);
-                }
-                else
+        case IN_LENGTH:
+            link->rx_payload_len |= (u16)data << (8*link->rx_len_octets);
+            if (++link->rx_len_octets == link->rx_hdr_buf.payload_length)
+            {
+                link->rx_hdr_buf.flags &= ~(MSG_FLAGS_BIGPACKET);
+                rx_start_payload(link);
+            }
+            break;
 #endif
-                {                
-                    /* Payload done. */
-                    rx_stat.state = IN_TRAILER;
-                    rx_buf_ptr = (u8*)&rx_trlr_buf;
-                }
+        case IN_PAYLOAD:
+            *link->rx_buf_ptr++ = data;
+            if ((link->rx_buf_ptr - link->rx_payload_ptr) == link->rx_payload_len)
+            {
+                /* Payload done. */
+                link->rx_stat.state = IN_TRAILER;
+                link->rx_buf_ptr = (u8*)&link->rx_trlr_buf;
             }
             break;
         case IN_TRAILER:
-            *rx_buf_ptr++ = data;
+            *link->rx_buf_ptr++ = data;
 
-            if (rx_buf_ptr == (u8*)&rx_trlr_buf + sizeof(msgtrlr_t))
+            if (link->rx_buf_ptr == (u8*)&link->rx_trlr_buf + sizeof(msgtrlr_t))
             {
 #ifndef DO_CSUM
                 /* Accept packet. 
                  * packet_received must return the buffer
                  * in rx_payload_ptr if it is non-zero length. */
-                packet_received(rx_hdr_buf.address, rx_hdr_buf.message_code,
-                                rx_hdr_buf.payload_length,
-                                rx_hdr_buf.flags,
-                                rx_payload_ptr);
+                packet_received(link, link->rx_hdr_buf.address, link->rx_hdr_buf.message_code,
+                                link->rx_payload_len,
+                                link->rx_hdr_buf.flags,
+                                link->rx_payload_ptr);
                 ret = 1;
 #else
 
-                if (fcsum_rcv.A != rx_trlr_buf.fcsum_A ||
-                    fcsum_rcv.B != rx_trlr_buf.fcsum_B)
+                if (link->fcsum_rcv.A != link->rx_trlr_buf.fcsum_A ||
+                    link->fcsum_rcv.B != link->rx_trlr_buf.fcsum_B)
                 {                        
+#ifndef EMBEDDED
                     printf("Checksum field %02X %02X - Calculated %02X %02X\n",
-                        rx_trlr_buf.fcsum_A, rx_trlr_buf.fcsum_B,
-                        fcsum_rcv.A, fcsum_rcv.B);
-
-                    bad_packet_received(rx_hdr_buf.address, rx_hdr_buf.message_code,
-                                rx_hdr_buf.payload_length,
-                                rx_hdr_buf.flags,
-                                rx_payload_ptr);
-                    
+                        link->rx_trlr_buf.fcsum_A, link->rx_trlr_buf.fcsum_B,
+                        link->fcsum_rcv.A, link->fcsum_rcv.B);
+#endif
+
+                    bad_packet_received(link, link->rx_hdr_buf.address, link->rx_hdr_buf.message_code,
+                                link->rx_payload_len,
+                                link->rx_hdr_buf.flags,
+                                link->rx_payload_ptr);
+                    if (link->rx_payload_ptr)
+                    {
+                        rx_payload_release(link, link->rx_payload_ptr);
+                    }
                 }
                 else
                 {
-                    packet_received(rx_hdr_buf.address, rx_hdr_buf.message_code,
-                                rx_hdr_buf.payload_length,
-                                rx_hdr_buf.flags,
-                                rx_payload_ptr);
+                    packet_received(link, link->rx_hdr_buf.address, link->rx_hdr_buf.message_code,
+                                link->rx_payload_len,
+                                link->rx_hdr_buf.flags,
+                                link->rx_payload_ptr);
                     ret = 1;
                 }
 #endif
-                rx_stat.state = PREAMBLE_HUNT;
-                rx_payload_ptr = 0;
+                link->rx_stat.state = PREAMBLE_HUNT;
+                link->rx_payload_ptr = 0;
             }
             break;
         default:
-            COMMS_DEBUG("Bad state %d\n", rx_stat.state);
+            COMMS_DEBUG("Bad state %d\n", link->rx_stat.state);
     }
     return ret;
 }
 
+#ifdef EMBEDDED
+/* Octets as they come; see comms_generic.h */
+static u8 rx_cobs(comms_link_t *link, u8 data)
+{
+    u8 ret = 0;
+
+    if (data == COBS_DELIMITER)
+    {
+        rx_frame_start(link);
+        return 0;
+    }
+    if (link->rx_stat.cobs_left)
+    {
+        link->rx_stat.cobs_left--;
+        return rx_octet(link, data);
+    }
+
+    /* a code */
+    if (link->rx_stat.esc)
+    {
+        ret = rx_octet(link, 0);
+    }
+    link->rx_stat.esc = (data != 0xFF);
+    link->rx_stat.cobs_left = data - 1;
+    return ret;
+}
+#else
+#define COBS_FRAME_MAX  0x11000     /* a big packet, stuffed */
+
+/* A frame at a time, its codes read from the end back; see
+ * comms_generic.h.  The octets unstuff in place. */
+static u8 rx_cobs(comms_link_t *link, u8 data)
+{
+    u8 *f;
+    u32 n, o, k, end;
+    u8 ret = 0;
+
+    if (data != COBS_DELIMITER)
+    {
+        if (link->rx_frame_len == link->rx_frame_alloc &&
+            link->rx_frame_alloc < COBS_FRAME_MAX)
+        {
+            u32 alloc = link->rx_frame_alloc ? 2*link->rx_frame_alloc : 256;
+            u8 *p = realloc(link->rx_frame, alloc);
+            if (p)
+            {
+                link->rx_frame = p;
+                link->rx_frame_alloc = alloc;
+            }
+        }
+        /* counted past the end of the buffer to mark an overrun */
+        if (link->rx_frame_len < link->rx_frame_alloc)
+        {
+            link->rx_frame[link->rx_frame_len] = data;
+        }
+        link->rx_frame_len++;
+        return 0;
+    }
+
+    f = link->rx_frame;
+    n = o = end = link->rx_frame_len;
+    link->rx_frame_len = 0;
+    if (!n || n > link->rx_frame_alloc)
+    {
+        return 0;
+    }
+    k = f[--n] - 1;
+    for(;;)
+    {
+        if (k > n)
+        {
+            COMMS_DEBUG("Bad COBS frame\n");
+            return 0;
+        }
+        n -= k;
+        o -= k;
+        memmove(f + o, f + n, k);
+        if (!n)
+        {
+            break;
+        }
+        k = f[--n];
+        if (k != 0xFF)
+        {
+            f[--o] = 0;
+        }
+        k--;
+    }
+
+    rx_frame_start(link);
+    for(; o<end; o++)
+    {
+        ret |= rx_octet(link, f[o]);
+    }
+    return ret;
+}
+#endif
+
+/* Asynchronous notification of byte reception. 
+ * Called by serial driver. 
+ * On error case (i.e. bad async frame), the current
+ * packet (if any) is aborted and hunt mode is entered. */
+u8  rx_notify(comms_link_t *link, u8 data, u8 error_detected)
+{
+    COMMS_DEBUG(" rx_notif(%02X) : state %d esc %d hdr %X payload %X trlr %X ptr %X\n", 
+            data,
+            link->rx_stat.state, link->rx_stat.esc,
+            &link->rx_hdr_buf, link->rx_payload_ptr, &link->rx_trlr_buf, link->rx_buf_ptr);
+                
+    if (link->framing == COMMS_FRAMING_COBS)
+    {
+        return rx_cobs(link, data);
+    }
+
+    if (data == COMM_PREAMBLE)
+    {
+        if (link->rx_stat.state != PREAMBLE_HUNT)
+        {
+            COMMS_DEBUG("Unexpected preamble in state %d\n", link->rx_stat.state);
+        }
+        rx_frame_start(link);
+        return 0;
+    }
+
+    if (link->rx_stat.esc)
+    {
+        /* Last character was 0x7D */
+        data ^= COMM_ESCXOR;
+        link->rx_stat.esc = 0;
+    }
+    else if (data == COMM_ESCAPE)
+    {
+        /* No character available yet */
+        link->rx_stat.esc = 1;
+        return 0;
+    }
+
+    return rx_octet(link, data);
+}
+
 #endif // PACKET_RECEIVE_SUPPORT
 
@@ -29,6 +29,13 @@
 
 #define COMMS_MSG_ECHO_REQUEST 0x1
 #define COMMS_MSG_ECHO_REPLY   0x2
+#define COMMS_MSG_FRAMING      0x3  /* comms_framing_t; echoed in the old
+                                     * framing, then both ends switch */
+#define COMMS_MSG_NAK          0x4  /* device: a frame failed its checksum;
+                                     * payload is the code it seemed to have */
+#define COMMS_MSG_CREDIT       0x5  /* host: u8 on.  device: u8 octets taken
+                                     * from its receive FIFO, mod 256; then
+                                     * u8 window in answer to the host */
 #define COMMS_MSG_RESET_BOARD  0xB
 #define COMMS_MSG_HELLO        0xF
 #define COMMS_MSG_BADTASK      0xE
@@ -37,6 +44,7 @@
 
 
 #ifndef EMBEDDED
+  #include <stdio.h>
   #define COMMS_DEBUG 1?:printf
 #else
   void xxx(char *, ...);
@@ -47,6 +55,22 @@
 #define COMM_ESCAPE     0x7D
 #define COMM_ESCXOR     0x20
 
+/* HDLC framing starts a frame with 0x7E and escapes 0x7D and 0x7E inside
+ * it, so a frame of them doubles.  COBS framing puts 0x00 before and after
+ * a frame and stuffs it so no 0x00 is left inside, costing one octet in
+ * COBS_BLOCK_MAX at worst.  Host to device it is Consistent Overhead Byte
+ * Stuffing: a code n, n-1 octets, then a 0 unless n is 0xFF or the frame
+ * ends.  Device to host each code comes after its octets instead, so the
+ * AVR stuffs as it sends with no block buffer; the host holds the frame
+ * and unstuffs it from the end.  A link starts out HDLC. */
+typedef enum {
+    COMMS_FRAMING_HDLC = 0,
+    COMMS_FRAMING_COBS = 1,
+} comms_framing_t;
+
+#define COBS_DELIMITER  0x00
+#define COBS_BLOCK_MAX  254
+
 /* preamble
  * 0x7E ala HDLC 
  * Not part of structure, but required to begin message on line */
@@ -101,15 +125,80 @@ typedef struct {
     u8      fcsum_B;  
 } msgtrlr_t;
 
-int send_msg(u8 to, u8 code, u8 payload_len, u8 *payload);
-
 typedef struct {
     u8 A;
     u8 B;
 } fcsum_t;
 
-fcsum_t send_msghdr(u8 to, u8 code, u16 payload_len);
-void send_msgfcs(fcsum_t fcs);
+/* Frames that fail the checksum go to bad_packet_received() instead.
+ * The AVR answers those with COMMS_MSG_NAK so the host can send again
+ * without waiting out its timeout. */
+#define DO_CSUM
+
+/* Receive decoder state machine */
+typedef enum {
+    PREAMBLE_HUNT=0,
+    IN_HEADER=1,
+    IN_PAYLOAD=2,
+    IN_TRAILER=3,
+    IN_LENGTH=4         /* big packet length prefix (host only) */
+} rx_state_t;
+
+typedef struct {
+    rx_state_t  state;
+    u8          esc;            /* COBS: a 0 is owed before the next block */
+    u8          cobs_left;      /* COBS: octets left in the block */
+} rx_status_t;
+
+/* One serial link.
+ * Holds everything the framing layer needs for a single port, so that
+ * rx_notify and send_msg are reentrant across links.  The AVR has exactly
+ * one (uart_link); the host may open as many as it likes. */
+typedef struct {
+    u8              framing;    /* comms_framing_t */
+    u8              tx_run;     /* COBS: octets since the last code */
+    rx_status_t     rx_stat;
+    msghdr_t        rx_hdr_buf;
+    msgtrlr_t       rx_trlr_buf;
+    u8              *rx_buf_ptr;
+    u8              *rx_payload_ptr;
+    u16             rx_payload_len;
+#ifdef DO_CSUM
+    fcsum_t         fcsum_rcv;
+#endif
+#ifndef EMBEDDED
+    int             fd;         /* serial port file descriptor */
+    void            *priv;      /* owner's per-link state */
+    u8              rx_len_octets;
+    u8              *rx_ring;   /* optional caller-supplied payload ring */
+    u32             rx_ring_size;
+    u32             rx_ring_head;
+    u8              *rx_frame;  /* COBS frame being received */
+    u32             rx_frame_len;
+    u32             rx_frame_alloc;
+    u8              tx_block[COBS_BLOCK_MAX];
+    /* Credit: no more than tx_window octets go out that the device hasn't
+     * taken from its FIFO.  Counts are mod 256; the device's taken count
+     * plus tx_delta is in tx_sent terms. */
+    u8              tx_window;  /* 0: no flow control */
+    u8              tx_sent;
+    u8              tx_acked;
+    u8              tx_delta;
+    u8              tx_credit_mark; /* tx_sent when the device answers */
+    u8              *tx_queue;  /* waiting for credit */
+    u32             tx_queue_len;
+    u32             tx_queue_alloc;
+#endif
+} comms_link_t;
+
+#ifdef EMBEDDED
+extern comms_link_t uart_link;
+#endif
+
+int send_msg(comms_link_t *link, u8 to, u8 code, u8 payload_len, u8 *payload);
+
+fcsum_t send_msghdr(comms_link_t *link, u8 to, u8 code, u16 payload_len);
+void send_msgfcs(comms_link_t *link, fcsum_t fcs);
 
 
 /* Note: must use _buffered version when interrupts are disabled.
@@ -120,8 +209,19 @@ void send_msgfcs(fcsum_t fcs);
 #define MAX_BUFFERED_MSG_SIZE 16
 int send_msg_buffered(u8 to, u8 code, u8 payload_len, u8 *payload, u8 do_crc);
 
-u8 rx_notify(u8 data, u8 error_detected);
+u8 rx_notify(comms_link_t *link, u8 data, u8 error_detected);
+
+/* packet_received must hand the payload back through here. */
+void rx_payload_release(comms_link_t *link, u8 *payload);
+
+#ifndef EMBEDDED
+/* Decode payloads straight into ring instead of pool buffers.
+ * Each payload is contiguous; the ring wraps between payloads, so a
+ * payload is only valid until size more bytes have been received.
+ * Payloads larger than the ring still come from the pool. */
+void comms_link_set_rx_ring(comms_link_t *link, u8 *ring, u32 size);
+#endif
 
-void tx_csum_and_escape(u8 octet, fcsum_t *cs);
+void tx_csum_and_escape(comms_link_t *link, u8 octet, fcsum_t *cs);
 
 #endif /* !COMMS_GENERIC_H */
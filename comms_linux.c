@@ -23,6 +23,7 @@
 *******************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <ctype.h>
@@ -30,32 +31,151 @@
 #include <unistd.h>  /* UNIX standard function definitions */
 #include <fcntl.h>   /* File control definitions */
 #include <termios.h> /* POSIX terminal control definitions */
+#include <sys/epoll.h>
+#include <time.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "comms_generic.h"
+#include "tasks.h"
+#include "datalogger.h"
+#include "logdecode.h"
 
-char *serial_device = "/dev/ttyUSB0";
 int port_speed = B115200;
 
+u32 rx_ring_size = 0;
+
 int voltage_log = 0;
 
-int serial_fd = -1;
-int open_serial()
+typedef enum {
+        CMD_READ_HEADERS_BEGIN,
+        CMD_READ_HEADERS_CONTINUE,
+        CMD_READ_SAMPLES_BEGIN,
+        CMD_READ_SAMPLES_CONTINUE,
+        CMD_READ_SAMPLES_ALL,
+        CMD_READ_STATS_BEGIN,
+        CMD_READ_STATS_NEXT,
+        CMD_READ_STATS_CONTINUE,
+        CMD_SYNC_BEGIN,
+        CMD_SYNC_BLOCKS,
+        CMD_SYNC_PAGES,
+        CMD_SYNC_READ,
+        EVT_FLASH_PACKET_RECEIVED,
+        EVT_FLASH_INFO_RECEIVED,
+        EVT_FLASH_HASH_RECEIVED,
+        EVT_PACKET_ERROR,
+} cmd_or_event_t;    
+
+typedef enum {
+        NONE,
+        STATE_READ_HEADERS_WAIT,
+        STATE_READ_HEADERS_DONE,
+        STATE_READ_SAMPLES_WAIT,
+        STATE_READ_SAMPLES_DONE,
+        STATE_READ_STATS_WAIT,
+        STATE_READ_STATS_DONE,
+        STATE_SYNC_INFO_WAIT,
+        STATE_SYNC_BLOCKS_WAIT,
+        STATE_SYNC_PAGES_WAIT,
+        STATE_SYNC_READ_WAIT,
+        STATE_SYNC_DONE,
+        STATE_BAD_PACKET
+} flash_sm_state_t;
+
+/* Flash download state for one device. */
+typedef struct {
+    u32                         addr;
+    unsigned                    descriptor_index;
+    flash_sm_state_t            state;
+    int                         read_all;
+    cmd_or_event_t              last_cmd;
+    unsigned                    last_length;
+    unsigned                    last_arg;
+    logged_data_descriptor_t    descriptors[MAX_DESCRIPTORS];
+    u8                          *sample_buffers[MAX_DESCRIPTORS];
+    unsigned                    descriptor_count;
+    int                         list_stats;     /* after the headers */
+    u8                          stats[LOG_STATS_MAX];
+    unsigned                    stats_have;
+    /* sync: blocks whose hash differs from the mirror's have their pages
+     * hashed, and pages that differ are read */
+    char                        *mirror_name;
+    u8                          *mirror;
+    u32                         mirror_size;
+    u8                          page_shift;
+    u8                          *page_state;    /* SYNC_PAGE_ */
+    u32                         sync_pos;       /* block or page */
+    unsigned                    sync_count;     /* hashes asked for */
+    unsigned                    sync_pages;     /* read */
+    int                         rle_sent;       /* the last read was READ_RLE */
+    int                         rle_next;       /* see log_read_rle_next() */
+    int                         rle_unsupported; /* firmware older than READ_RLE */
+} flash_reader_t;
+
+enum {
+    SYNC_PAGE_SAME,
+    SYNC_PAGE_MAYBE,            /* in a block that differs */
+    SYNC_PAGE_DIFFERS,
+};
+
+/* A device attached to one serial port.
+ * link must be first; the framing layer only knows about comms_link_t
+ * and packet_received casts back to the host_link_t. */
+typedef struct {
+    comms_link_t    link;
+    char            *device;
+    unsigned        index;
+    flash_reader_t  reader;
+    u8              last_to;    /* the last frame sent, for a NAK */
+    u8              last_code;
+    u8              last_length;
+    u8              last_payload[255];
+    u8              credit_acked;   /* tx_acked as of credit_since */
+    long            credit_since;   /* ms; 0 while nothing waits on credit */
+    int             credit_asked;   /* asked again since the last credit */
+} host_link_t;
+
+#define MAX_LINKS 16
+#define UNKNOWN_LENGTH_MAX  (512*1024)  /* room for a session with no length */
+host_link_t links[MAX_LINKS];
+unsigned num_links;
+
+/* Every frame to a device goes through here, so that a NAK for it can be
+ * answered by sending it again. */
+static int link_send(comms_link_t *link, u8 to, u8 code, u8 payload_len, u8 *payload)
 {
-    serial_fd = open(serial_device, O_RDWR|O_NOCTTY|O_NDELAY);
-    if (serial_fd == -1)
+    host_link_t *hl = (host_link_t *)link;
+
+    hl->last_to = to;
+    hl->last_code = code;
+    hl->last_length = payload_len;
+    if (payload_len)
     {
-        perror("open_serial(): failed to open -");
+        memmove(hl->last_payload, payload, payload_len);
+    }
+    return send_msg(link, to, code, payload_len, payload);
+}
+
+/* Link the console commands go to.  -1 is all of them. */
+int target_link = 0;
+
+int open_serial(host_link_t *hl)
+{
+    hl->link.fd = open(hl->device, O_RDWR|O_NOCTTY|O_NDELAY);
+    if (hl->link.fd == -1)
+    {
+        fprintf(stderr, "open_serial(%s): failed to open - %s\n", 
+                hl->device, strerror(errno));
     }
     else
     {
 //        fcntl(serial_fd, F_SETFL, FNDELAY);
     }
-    return serial_fd;
+    return hl->link.fd;
 }
     
-void config_port()
+void config_port(host_link_t *hl)
 {
+    int serial_fd = hl->link.fd;
     struct termios options;
     tcgetattr(serial_fd, &options);
     cfsetispeed(&options, port_speed);
@@ -85,11 +205,15 @@ u8 get_node_id()
     return node_id;
 }
 
-void tx_enqueue(u8 data)
+unsigned long tx_octets;
+
+static void tx_write(comms_link_t *link, u8 data)
 {
     int ret;
+
+    link->tx_sent++;
   again:
-    ret = write(serial_fd, &data, 1);
+    ret = write(link->fd, &data, 1);
     
     if (ret == 0)
     {
@@ -104,6 +228,90 @@ void tx_enqueue(u8 data)
 //    fprintf(stderr, "TX: %02X\n", data);
 }
 
+/* Writes what the device has room for; the rest waits for its credit.
+ * With credit off, everything goes. */
+static void tx_flush(comms_link_t *link)
+{
+    u32 i = 0;
+
+    while(i < link->tx_queue_len &&
+          (!link->tx_window || (u8)(link->tx_sent - link->tx_acked) < link->tx_window))
+    {
+        tx_write(link, link->tx_queue[i++]);
+    }
+    memmove(link->tx_queue, link->tx_queue + i, link->tx_queue_len - i);
+    link->tx_queue_len -= i;
+}
+
+void tx_enqueue(comms_link_t *link, u8 data)
+{
+    ++tx_octets;
+    if (!link->tx_window)
+    {
+        tx_write(link, data);
+        return;
+    }
+    if (link->tx_queue_len == link->tx_queue_alloc)
+    {
+        u32 alloc = link->tx_queue_alloc ? 2*link->tx_queue_alloc : 256;
+        u8 *p = realloc(link->tx_queue, alloc);
+        if (!p)
+        {
+            fprintf(stderr, "tx_enqueue: out of memory\n");
+            return;
+        }
+        link->tx_queue = p;
+        link->tx_queue_alloc = alloc;
+    }
+    link->tx_queue[link->tx_queue_len++] = data;
+    tx_flush(link);
+}
+
+/* Asks the device for credits (COMMS_MSG_CREDIT), or stops using them.
+ * Its answer says how much of what we've written it had taken when it
+ * read the request; in COBS that's all but the closing delimiter.  Asking
+ * again with octets waiting on credit, the request goes ahead of them at
+ * the first frame boundary, so a device that has reset (and sends no
+ * credit) gets it soon. */
+static void credit_request(comms_link_t *link, u8 on)
+{
+    u8 start = link->framing == COMMS_FRAMING_COBS ? COBS_DELIMITER : COMM_PREAMBLE;
+    u8 acked = link->tx_acked;
+    u32 at = 0, end, n;
+
+    if (!on || !link->tx_queue_len)
+    {
+        link->tx_window = 0;
+        tx_flush(link);
+    }
+    else
+    {
+        while (at < link->tx_queue_len && link->tx_queue[at] != start)
+        {
+            at++;
+        }
+        /* so it's all queued, to be moved */
+        link->tx_acked = link->tx_sent - link->tx_window;
+    }
+    end = link->tx_queue_len;
+    link_send(link, 0xF, TASK_ID_COMMS<<4|COMMS_MSG_CREDIT, 1, &on);
+    n = link->tx_queue_len - end;
+    if (n && at < end)
+    {
+        u8 frame[32];
+
+        memcpy(frame, link->tx_queue + end, n);
+        memmove(link->tx_queue + at + n, link->tx_queue + at, end - at);
+        memcpy(link->tx_queue + at, frame, n);
+    }
+    link->tx_credit_mark = link->tx_sent + at + n - (link->framing == COMMS_FRAMING_COBS);
+    if (link->tx_window)
+    {
+        link->tx_acked = acked;
+        tx_flush(link);
+    }
+}
+
 int ui_fd = 0;
 int ui_quit = 0;
 
@@ -116,7 +324,16 @@ typedef enum {
     MUTE,
     SAMPLES,
     DESCRIPTORS,
+    SESSIONS,
     PSAMP,
+    LINK,
+    TRIGGER,
+    POLICY,
+    INFO,
+    STATS,
+    SYNC,
+    FRAMING,
+    CREDIT,
 } command_id_t;
 
 typedef struct {
@@ -133,7 +350,16 @@ command_def_t commands[] = {
     { "setid",  SETID,  "<new id>"},
     { "samples", SAMPLES, "<descriptor #>"},
     { "descriptors", DESCRIPTORS, "" },
-    { "psamp",   PSAMP, "<descriptor> [file] [bin]" }
+    { "sessions", SESSIONS, "" },
+    { "psamp",   PSAMP, "<descriptor> [file] [bin|col|csv]" },
+    { "link",    LINK,  "[index|all]" },
+    { "trigger", TRIGGER, "<boost|egt|fp> <above|below|off> [level]" },
+    { "policy",  POLICY, "<data type> <decimate> <interval ms> <deadband>" },
+    { "info",    INFO,  "" },
+    { "stats",   STATS, "" },
+    { "sync",    SYNC,  "<image file>" },
+    { "framing", FRAMING, "<hdlc|cobs|bench|hdlc!>" },
+    { "credit",  CREDIT, "<on|off>" }
 };
 
 void ui_usage(command_id_t cmd)
@@ -162,31 +388,7 @@ void ui_usage(command_id_t cmd)
 }
 
 
-#include "datalogger.h"
-typedef enum {
-        CMD_READ_HEADERS_BEGIN,
-        CMD_READ_HEADERS_CONTINUE,
-        CMD_READ_SAMPLES_BEGIN,
-        CMD_READ_SAMPLES_CONTINUE,
-        CMD_READ_SAMPLES_ALL,
-        EVT_FLASH_PACKET_RECEIVED,
-        EVT_PACKET_ERROR,
-} cmd_or_event_t;    
-
-typedef enum {
-        NONE,
-        STATE_READ_HEADERS_WAIT,
-        STATE_READ_HEADERS_DONE,
-        STATE_READ_SAMPLES_WAIT,
-        STATE_READ_SAMPLES_DONE,
-        STATE_BAD_PACKET
-} flash_sm_state_t;
-
-flash_sm_state_t read_flash_sm(cmd_or_event_t event, unsigned length, u8 *data);
-
-logged_data_descriptor_t descriptors[MAX_DESCRIPTORS];
-u8 *sample_buffers[MAX_DESCRIPTORS];
-
+flash_sm_state_t read_flash_sm(host_link_t *hl, cmd_or_event_t event, unsigned length, u8 *data);
 
 
 command_id_t parse_command(char *cmdstr)
@@ -220,30 +422,86 @@ command_id_t parse_command(char *cmdstr)
 
 unsigned packet_count;
 
-void write_samples_to_file(unsigned index, char *filename, int binary);
-unsigned descriptor_count;
+typedef enum {
+    PSAMP_TEXT,
+    PSAMP_BIN,
+    PSAMP_COL,
+    PSAMP_CSV,
+} psamp_format_t;
 
-void ui_callback(char *str)
+static const char *psamp_suffix[] = { "psamp", "psamp", "col", "csv" };
+
+void write_samples_to_file(host_link_t *hl, unsigned index, char *filename, psamp_format_t format);
+
+/* With more than one device attached, keep their output files apart
+ * by appending the link index. */
+char *link_filename(host_link_t *hl, char *filename)
 {
-    char *p, *q = str;
-    char *argv[20];
-    int argc=0;
-    int isvalid = 1;
-    command_id_t cmd;
-    char *str_for_hist = strdup(str);
- 
-    if (!str || *str == 0)
+    static char buf[256];
+
+    if (num_links <= 1 || !filename)
+    {
+        return filename;
+    }
+    snprintf(buf, sizeof(buf), "%s.%d", filename, hl->index);
+    return buf;
+}
+
+/* Octets on the wire for a READ_PAGE sized frame in each framing, with
+ * payloads at the worst case for each and two more usual ones, and the
+ * payload rate that leaves at the port speed. */
+static void framing_bench()
+{
+    static const char *names[] = { "all 7E", "no 00", "erased", "random" };
+    comms_link_t bench;
+    u8 payload[FLASH_PAGE_SIZE + 8];
+    unsigned baud = port_speed == B38400 ? 38400 : 115200;
+    int kind, framing;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.fd = open("/dev/null", O_WRONLY);
+    if (bench.fd < 0)
     {
+        perror("/dev/null");
         return;
     }
-    
-    while ((p=strtok(q, " ")))
+    fprintf(stderr, "%u octet payload at %u bps:\n", (unsigned)sizeof(payload), baud);
+    for(kind=0; kind<4; kind++)
     {
-        argv[argc++] = p;
-        q = NULL;
+        unsigned i;
+
+        for(i=0; i<sizeof(payload); i++)
+        {
+            payload[i] = kind == 0 ? 0x7E : kind == 1 ? 0x01 : kind == 2 ? 0xFF : rand();
+        }
+        fprintf(stderr, "  %-8s", names[kind]);
+        for(framing=COMMS_FRAMING_HDLC; framing<=COMMS_FRAMING_COBS; framing++)
+        {
+            fcsum_t fcs;
+
+            bench.framing = framing;
+            tx_octets = 0;
+            fcs = send_msghdr(&bench, 0xF, 0, sizeof(payload));
+            for(i=0; i<sizeof(payload); i++)
+            {
+                tx_csum_and_escape(&bench, payload[i], &fcs);
+            }
+            send_msgfcs(&bench, fcs);
+            fprintf(stderr, "  %s %4lu octets %5.0f B/s", framing == COMMS_FRAMING_COBS ? "COBS" : "HDLC",
+                    tx_octets, (double)baud / 10 * sizeof(payload) / tx_octets);
+        }
+        fprintf(stderr, "\n");
     }
-    cmd = parse_command(argv[0]);
-    
+    close(bench.fd);
+}
+
+/* Run one console command against one link. */
+int ui_command(host_link_t *hl, command_id_t cmd, int argc, char **argv)
+{
+    comms_link_t *link = &hl->link;
+    flash_reader_t *rd = &hl->reader;
+    int isvalid = 1;
+
     switch(cmd)
     {
         case SEND:
@@ -268,7 +526,7 @@ void ui_callback(char *str)
                 }
                 fprintf(stderr, "send_msg(%X, %X, %X, ...)\n",
                         to, code, plen);
-                send_msg(to, code, plen, payload);
+                link_send(link, to, code, plen, payload);
                 
             }
             break;
@@ -287,30 +545,126 @@ void ui_callback(char *str)
                 {
                     radio_msg[i] = strtoul(argv[i+1], NULL, 16);
                 }
-                send_msg(0, 0x22, 7, radio_msg);
+                link_send(link, 0, 0x22, 7, radio_msg);
             }
             break;
         }
         case MUTE:
         {
-            send_msg(0, 0x30, 0, 0);
+            link_send(link, 0, 0x30, 0, 0);
             break;
         }
-        case SETID:
-            if (argc < 2)
+        case TRIGGER:
+        {
+            static const char *sources[] = { "boost", "egt", "fp" };
+            static const char *ops[] = { "off", "above", "below" };
+            u8 rule[4];
+            s16 level = 0;
+            int i;
+
+            if (argc < 3)
             {
-                ui_usage(SETID);
+                ui_usage(TRIGGER);
+                break;
+            }
+            for(i=0; i<LOG_TRIG_SOURCES && strcmp(argv[1], sources[i]); i++)
+                ;
+            rule[0] = i;
+            for(i=0; i<=LOG_TRIG_BELOW && strcmp(argv[2], ops[i]); i++)
+                ;
+            rule[1] = i;
+            if (rule[0] >= LOG_TRIG_SOURCES || rule[1] > LOG_TRIG_BELOW ||
+                (rule[1] != LOG_TRIG_OFF && argc != 4))
+            {
+                ui_usage(TRIGGER);
+                break;
+            }
+            if (argc == 4)
+            {
+                level = strtol(argv[3], NULL, 0);
+            }
+            /* psig, degrees C, or mbar over boost */
+            rule[2] = level;
+            rule[3] = (u16)level >> 8;
+            link_send(link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_SET_TRIGGER, 4, rule);
+            break;
+        }
+        case INFO:
+            link_send(link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_INFO, 0, 0);
+            break;
+        case STATS:
+            link_send(link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_STATS, 0, 0);
+            break;
+        case FRAMING:
+            if (argc != 2)
+            {
+                ui_usage(FRAMING);
+            }
+            else if (!strcmp(argv[1], "bench"))
+            {
+                framing_bench();
+            }
+            else if (!strcmp(argv[1], "hdlc!"))
+            {
+                /* This end only: a device that resets is back in HDLC and
+                 * can't read the request in COBS. */
+                link->framing = COMMS_FRAMING_HDLC;
+                fprintf(stderr, "%d: HDLC framing\n", hl->index);
             }
             else
             {
-                node_id = strtoul(argv[1], NULL, 0) & 0xF;
-                fprintf(stderr, "New node id: %X\n", node_id);
+                u8 framing = strcmp(argv[1], "cobs") ? COMMS_FRAMING_HDLC : COMMS_FRAMING_COBS;
+
+                /* both ends switch once the device echoes it */
+                link_send(link, 0xF, TASK_ID_COMMS<<4|COMMS_MSG_FRAMING, 1, &framing);
             }
             break;
-        case QUIT:
-            ui_quit = 1;
+        case CREDIT:
+            if (argc != 2)
+            {
+                ui_usage(CREDIT);
+            }
+            else
+            {
+                /* "on" again after the device resets */
+                credit_request(link, !strcmp(argv[1], "on"));
+            }
             break;
+        case SYNC:
+            if (argc != 2)
+            {
+                ui_usage(SYNC);
+                break;
+            }
+            free(rd->mirror_name);
+            rd->mirror_name = strdup(link_filename(hl, argv[1]));
+            read_flash_sm(hl, CMD_SYNC_BEGIN, 0, 0);
+            break;
+        case POLICY:
+        {
+            u8 entry[1+LOG_POLICY_SIZE];
+            unsigned type, interval;
 
+            if (argc != 5)
+            {
+                ui_usage(POLICY);
+                break;
+            }
+            type     = strtoul(argv[1], NULL, 0);
+            interval = strtoul(argv[3], NULL, 0);
+            if (type < 1 || type > LOG_MAX_CHANNELS || interval > 0xFFFF)
+            {
+                ui_usage(POLICY);
+                break;
+            }
+            entry[0] = type;
+            entry[1] = strtoul(argv[2], NULL, 0);
+            entry[2] = strtoul(argv[4], NULL, 0);
+            entry[3] = interval;
+            entry[4] = interval >> 8;
+            link_send(link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_SET_POLICY, sizeof(entry), entry);
+            break;
+        }
         case SAMPLES:
             {
                 unsigned index;
@@ -323,18 +677,24 @@ void ui_callback(char *str)
                 index = strtoul(argv[1], NULL, 0);
                 if (strcmp(argv[1], "all"))
                 {
-                    read_flash_sm(CMD_READ_SAMPLES_BEGIN, sizeof(index), (u8 *)&index);
+                    read_flash_sm(hl, CMD_READ_SAMPLES_BEGIN, sizeof(index), (u8 *)&index);
                 }
                 else
                 {
-                    read_flash_sm(CMD_READ_SAMPLES_ALL, 0, 0);
+                    read_flash_sm(hl, CMD_READ_SAMPLES_ALL, 0, 0);
                 }
         
                 break;
             }
         case DESCRIPTORS:
             {
-                read_flash_sm(CMD_READ_HEADERS_BEGIN, 0, 0);
+                read_flash_sm(hl, CMD_READ_HEADERS_BEGIN, 0, 0);
+                break;
+            }
+        case SESSIONS:
+            {
+                hl->reader.list_stats = 1;
+                read_flash_sm(hl, CMD_READ_HEADERS_BEGIN, 0, 0);
                 break;
             }
 
@@ -342,17 +702,27 @@ void ui_callback(char *str)
             {
                 unsigned index;
                 char *filename = NULL;
-                FILE *file;
-                int bin = 0;
+                psamp_format_t format = PSAMP_TEXT;
                 
                 if (argc != 3  && argc != 4) 
                 {
                     ui_usage(PSAMP);
                     break;
                 }
-                if (argc == 4 && !strcmp(argv[3], "bin"))
+                if (argc == 4)
                 {
-                    bin = 1;
+                    if (!strcmp(argv[3], "bin"))
+                    {
+                        format = PSAMP_BIN;
+                    }
+                    else if (!strcmp(argv[3], "col"))
+                    {
+                        format = PSAMP_COL;
+                    }
+                    else if (!strcmp(argv[3], "csv"))
+                    {
+                        format = PSAMP_CSV;
+                    }
                 }
 
                 if (argv[2] && strcmp(argv[2], ""))
@@ -363,15 +733,16 @@ void ui_callback(char *str)
                 if (strcmp(argv[1], "all"))
                 { 
                     index = strtoul(argv[1], NULL, 0);
-                    write_samples_to_file(index, filename, bin);
+                    write_samples_to_file(hl, index, link_filename(hl, filename), format);
                 }
                 else
                 {
-                    for(index=0; index<descriptor_count; index++)
+                    for(index=0; index<rd->descriptor_count; index++)
                     {
                         char buf[256];
-                        sprintf(buf, "%s-%d.psamp", filename, index);
-                        write_samples_to_file(index, buf, bin);
+                        sprintf(buf, "%s-%d.%s", link_filename(hl, filename), index,
+                                psamp_suffix[format]);
+                        write_samples_to_file(hl, index, buf, format);
                     }
                 }
 
@@ -383,6 +754,85 @@ void ui_callback(char *str)
             isvalid = 0;
             ui_usage(UNKNOWN);
     }
+    return isvalid;
+}
+
+void ui_callback(char *str)
+{
+    char *p, *q = str;
+    char *argv[20];
+    int argc=0;
+    int isvalid = 1;
+    command_id_t cmd;
+    char *str_for_hist = strdup(str);
+ 
+    if (!str || *str == 0)
+    {
+        return;
+    }
+    
+    while ((p=strtok(q, " ")))
+    {
+        argv[argc++] = p;
+        q = NULL;
+    }
+    cmd = parse_command(argv[0]);
+    
+    switch(cmd)
+    {
+        case SETID:
+            if (argc < 2)
+            {
+                ui_usage(SETID);
+            }
+            else
+            {
+                node_id = strtoul(argv[1], NULL, 0) & 0xF;
+                fprintf(stderr, "New node id: %X\n", node_id);
+            }
+            break;
+        case QUIT:
+            ui_quit = 1;
+            break;
+        case LINK:
+            if (argc == 2 && !strcmp(argv[1], "all"))
+            {
+                target_link = -1;
+            }
+            else if (argc == 2)
+            {
+                unsigned l = strtoul(argv[1], NULL, 0);
+                if (l >= num_links)
+                {
+                    fprintf(stderr, "No link %d (%d open)\n", l, num_links);
+                    break;
+                }
+                target_link = l;
+            }
+            {
+                unsigned l;
+                for(l=0; l<num_links; l++)
+                {
+                    fprintf(stderr, "%c%2d: %s\n", 
+                            (target_link == -1 || target_link == l) ? '*' : ' ',
+                            l, links[l].device);
+                }
+            }
+            break;
+        default:
+            if (target_link == -1)
+            {
+                unsigned l;
+                for(l=0; l<num_links; l++)
+                {
+                    isvalid = ui_command(&links[l], cmd, argc, argv);
+                }
+            }
+            else
+            {
+                isvalid = ui_command(&links[target_link], cmd, argc, argv);
+            }
+    }
     if (isvalid)
     {
         add_history(str_for_hist);
@@ -402,52 +852,145 @@ void quit_ui()
     fprintf(stderr, "\n");
 }
                     
+#define CREDIT_TIMEOUT_MS   500
+
+static long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Octets queued and no credit for CREDIT_TIMEOUT_MS: the device reset, or
+ * its last credit was lost.  Either way it's taken all it had by now, so
+ * another window goes out, and the request again.  If that brings no
+ * credit either, the rest goes without flow control. */
+static void credit_check(host_link_t *hl)
+{
+    comms_link_t *link = &hl->link;
+    long now = now_ms();
+
+    if (!link->tx_queue_len)
+    {
+        hl->credit_since = 0;
+    }
+    else if (!hl->credit_since || link->tx_acked != hl->credit_acked)
+    {
+        if (hl->credit_since)
+        {
+            hl->credit_asked = 0;
+        }
+        hl->credit_acked = link->tx_acked;
+        hl->credit_since = now;
+    }
+    else if (now - hl->credit_since >= CREDIT_TIMEOUT_MS && !hl->credit_asked)
+    {
+        fprintf(stderr, "%d: no credit for %d ms, asking again\n",
+                hl->index, CREDIT_TIMEOUT_MS);
+        hl->credit_asked = 1;
+        credit_request(link, 1);
+        link->tx_acked = link->tx_sent;
+        tx_flush(link);
+        hl->credit_acked = link->tx_acked;
+        hl->credit_since = now;
+    }
+    else if (now - hl->credit_since >= CREDIT_TIMEOUT_MS)
+    {
+        fprintf(stderr, "%d: still no credit, sending without\n", hl->index);
+        link->tx_window = 0;
+        tx_flush(link);
+        hl->credit_since = 0;
+    }
+}
+
 void do_console()
 {
-    int nb,ret;
-    char in;
-    fd_set rdfds;
+    int nb, ret, epfd;
+    unsigned l;
+    u8 in[256];
+    struct epoll_event ev, events[MAX_LINKS+1];
     
+    epfd = epoll_create1(0);
+    if (epfd == -1)
+    {
+        perror("epoll_create1");
+        return;
+    }
+
+    /* A NULL data.ptr is the console; anything else is a link. */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ui_fd, &ev);
+
+    for(l=0; l<num_links; l++)
+    {
+        if (links[l].link.fd == -1)
+        {
+            continue;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &links[l];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, links[l].link.fd, &ev) == -1)
+        {
+            fprintf(stderr, "epoll_ctl(%s): %s\n", links[l].device, strerror(errno));
+        }
+    }
+
     init_ui();
 
-    
     while (!ui_quit)
     {
-        FD_ZERO(&rdfds);
-        FD_SET(serial_fd, &rdfds);
-        FD_SET(ui_fd, &rdfds);
-        ret = select(serial_fd+1, &rdfds, NULL, NULL, NULL);
-//        fprintf(stderr, "select returned %d\n", ret);
-        if (ret == -1)
+        int e, timeout = -1;
+
+        for(l=0; l<num_links; l++)
         {
-            perror("select");
-            return;
+            credit_check(&links[l]);
+            if (links[l].link.tx_queue_len)
+            {
+                timeout = CREDIT_TIMEOUT_MS;
+            }
         }
-        else if (ret == 0)
+        ret = epoll_wait(epfd, events, MAX_LINKS+1, timeout);
+        if (ret == -1)
         {
-            continue;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
         }
 
-        if (FD_ISSET(serial_fd, &rdfds))
+        for(e=0; e<ret; e++)
         {
-            nb=read(serial_fd, &in, 1);
+            host_link_t *hl = events[e].data.ptr;
+
+            if (hl == NULL)
+            {
+                rl_callback_read_char();
+                continue;
+            }
+
+            nb = read(hl->link.fd, in, sizeof(in));
             
             if (nb <= 0)
             {
-                fprintf(stderr, "read(serial_fd,...): %d - %s (%d)\n",
-                    nb, strerror(errno), errno);
+                fprintf(stderr, "read(%s,...): %d - %s (%d)\n",
+                    hl->device, nb, strerror(errno), errno);
             }            
             else
             {
-//                fprintf(stderr, "IN: %02X\n", (u8)in);
-                rx_notify(in, 0);
+                int i;
+                for(i=0; i<nb; i++)
+                {
+//                    fprintf(stderr, "IN: %02X\n", in[i]);
+                    rx_notify(&hl->link, in[i], 0);
+                }
             }
         }
-        if (FD_ISSET(ui_fd, &rdfds))
-        {
-            rl_callback_read_char();
-        }
     }
+    close(epfd);
     quit_ui();
 }
             
@@ -564,8 +1107,9 @@ char digit2txt(u8 digit)
 
 int last, padding;
 
-void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
+void packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload)
 {
+    host_link_t *hl = (host_link_t *)link;
 
     unsigned i;
 #if 0
@@ -603,30 +1147,124 @@ void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
             fprintf(stderr, "\n");
         }
     }
-    fprintf(stderr, "\n");
-#endif
-    ++packet_count;
-
-    if (voltage_log)
+    fprintf(stderr, "\n");
+#endif
+    ++packet_count;
+
+    if (voltage_log)
+    {
+        if (code == 0xCC)
+        {
+            fprintf(stderr, "Average ADC: %02X%02X\n", payload[1], payload[0]);
+        }
+    }
+    else if (code == 0x34)
+    {
+        unsigned adc = (payload[1]<<8) | payload[0];
+
+        double vin = (adc * 5.0) / (64*1024);
+        double vinx = (adc * 5.0) / 1024;
+
+        fprintf(stderr, "ADC = %5d Vin %1.3f or %1.3f\n", adc, vin, vinx);
+    }
+    else if (code == 0x35)
+    {
+        fprintf(stderr, "                                     "
+                "ADC: %02X %02X\n", payload[0], payload[1]);
+    }
+    else if (code == (TASK_ID_COMMS<<4|COMMS_MSG_NAK) && length == 1)
+    {
+        /* The device dropped a frame.  Replies carry no address, so only
+         * the last frame sent is safe to send again; a flash read resent
+         * after its answer came would be answered twice. */
+        if (payload[0] != hl->last_code)
+        {
+            fprintf(stderr, "%d: NAK, command %02X lost\n", hl->index, payload[0]);
+        }
+        else if (payload[0] == (TASK_ID_COMMS<<4|COMMS_MSG_CREDIT))
+        {
+            fprintf(stderr, "%d: NAK, resending %02X\n", hl->index, payload[0]);
+            credit_request(link, hl->last_payload[0]);
+        }
+        else
+        {
+            fprintf(stderr, "%d: NAK, resending %02X\n", hl->index, payload[0]);
+            link_send(link, hl->last_to, hl->last_code, hl->last_length, hl->last_payload);
+        }
+    }
+    else if (code == (TASK_ID_COMMS<<4|COMMS_MSG_FRAMING) && length == 1)
+    {
+        link->framing = payload[0];
+        fprintf(stderr, "%d: %s framing\n", hl->index,
+                link->framing == COMMS_FRAMING_COBS ? "COBS" : "HDLC");
+    }
+    else if (code == (TASK_ID_COMMS<<4|COMMS_MSG_CREDIT) && length == 2)
+    {
+        /* the answer to credit_request(); 0 window if it was "off" */
+        link->tx_delta = link->tx_credit_mark - payload[0];
+        link->tx_acked = link->tx_credit_mark;
+        link->tx_window = payload[1];
+        fprintf(stderr, "%d: credit window %d octets\n", hl->index, payload[1]);
+        tx_flush(link);
+    }
+    else if (code == (TASK_ID_COMMS<<4|COMMS_MSG_CREDIT) && length == 1)
+    {
+        if (link->tx_window)
+        {
+            link->tx_acked = payload[0] + link->tx_delta;
+            tx_flush(link);
+        }
+    }
+    else if (code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_INFO) && length == 3)
+    {
+        fprintf(stderr, "Flash: density %X, %d byte pages, %d KB\n",
+                payload[0], 1 << payload[1], (1 << payload[2]) / 1024);
+        if (hl->reader.state == STATE_SYNC_INFO_WAIT)
+        {
+            read_flash_sm(hl, EVT_FLASH_INFO_RECEIVED, length, payload);
+        }
+    }
+    else if (code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RLE))
     {
-        if (code == 0xCC)
+        static u8 expanded[0x10000];
+        long n = log_rle_expand(payload, length, expanded, sizeof(expanded));
+
+        if (n > 0)
         {
-            fprintf(stderr, "Average ADC: %02X%02X\n", payload[1], payload[0]);
+            read_flash_sm(hl, EVT_FLASH_PACKET_RECEIVED, n, expanded);
+        }
+        else
+        {
+            fprintf(stderr, "Bad run length code\n");
+            read_flash_sm(hl, EVT_PACKET_ERROR, 0, 0);
         }
     }
-    else if (code == 0x34)
+    else if (code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_HASH_RANGE))
     {
-        unsigned adc = (payload[1]<<8) | payload[0];
-
-        double vin = (adc * 5.0) / (64*1024);
-        double vinx = (adc * 5.0) / 1024;
-
-        fprintf(stderr, "ADC = %5d Vin %1.3f or %1.3f\n", adc, vin, vinx);
+        read_flash_sm(hl, EVT_FLASH_HASH_RECEIVED, length, payload);
     }
-    else if (code == 0x35)
+    else if (code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_ERROR) && length == 1)
     {
-        fprintf(stderr, "                                     "
-                "ADC: %02X %02X\n", payload[0], payload[1]);
+        fprintf(stderr, "Flash error %d\n", payload[0]);
+        if (payload[0] == FLASH_ERR_BUSY)
+        {
+            /* try the request again */
+            read_flash_sm(hl, EVT_PACKET_ERROR, 0, 0);
+        }
+        else if (payload[0] == FLASH_ERR_BAD_CMD && hl->reader.rle_sent &&
+                 !hl->reader.rle_unsupported)
+        {
+            /* firmware older than READ_RLE; again with READ_RANGE */
+            hl->reader.rle_unsupported = 1;
+            read_flash_sm(hl, EVT_PACKET_ERROR, 0, 0);
+        }
+    }
+    else if (code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_STATS) && length == 6)
+    {
+        fprintf(stderr, "Logging: %d dropped in interrupts, %d in tasks, "
+                "%d records lost\n",
+                payload[1]<<8 | payload[0], payload[3]<<8 | payload[2],
+                payload[5]<<8 | payload[4]);
     }
     else if (code == 0xa0)
     {
@@ -656,7 +1294,7 @@ void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
 
     }
 #else
-    else if (code == 0x53 && read_flash_sm(EVT_FLASH_PACKET_RECEIVED, length, payload) != STATE_BAD_PACKET)
+    else if (code == 0x53 && read_flash_sm(hl, EVT_FLASH_PACKET_RECEIVED, length, payload) != STATE_BAD_PACKET)
     {
         ;
     }
@@ -835,32 +1473,27 @@ void packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
     }
         
     fflush(stdout);
-        
+
+    if (payload)
+    {
+        rx_payload_release(link, payload);
+    }
 }
 
-void bad_packet_received(msgaddr_t addr, u8 code, u8 length, u8 flags, u8 *payload)
+void bad_packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload)
 {
-    fprintf(stderr, "BAD packet received: %X%X %02X %02X %02X\n",
-            addr.from,addr.to, code, length, flags);
+    host_link_t *hl = (host_link_t *)link;
+    fprintf(stderr, "%s: BAD packet received: %X%X %02X %02X %02X\n",
+            hl->device, addr.from,addr.to, code, length, flags);
     int i;
     for(i=0; i<length; i++)
     {
         fprintf(stderr, "%02X ", payload[i]);
     }
 
-    read_flash_sm(EVT_PACKET_ERROR, 0, 0);
-}
-
-    
-u8 *bufferpool_request(u8 size)
-{
-    return (u8*)malloc(size);
+    read_flash_sm(hl, EVT_PACKET_ERROR, 0, 0);
 }
 
-void bufferpool_release(u8 *p)
-{
-    free(p);
-}
 
 typedef enum {
     TESTRX,
@@ -874,16 +1507,29 @@ int main(int argc, char **argv)
     testmode_t mode = CONSOLE;
     FILE *fp;
 
-    while ((ch=getopt(argc, argv, "p:r:t:b:v")) != -1)
+    while ((ch=getopt(argc, argv, "p:r:t:b:vR")) != -1)
     {
         switch(ch)
         {
             case 'p':
-                serial_device = strdup(optarg);
+                /* May be given more than once; each port gets its own link. */
+                if (num_links == MAX_LINKS)
+                {
+                    fprintf(stderr, "Too many ports (max %d)\n", MAX_LINKS);
+                    return -1;
+                }
+                links[num_links].device = strdup(optarg);
+                links[num_links].index = num_links;
+                links[num_links].link.fd = -1;
+                ++num_links;
                 break;
             case 'v':
                 voltage_log = 1;
                 break;
+            case 'R':
+                /* decode payloads in place rather than from the pool */
+                rx_ring_size = 64*1024L;
+                break;
             case 'r':
                 fp = strcmp(optarg, "-") ? fopen(optarg, "r") : stdin;
                 if (!fp)
@@ -921,10 +1567,34 @@ int main(int argc, char **argv)
                 return -1;
         }
     }
+    if (num_links == 0)
+    {
+        links[0].device = "/dev/ttyUSB0";
+        links[0].link.fd = -1;
+        num_links = 1;
+    }
+
+    if (rx_ring_size)
+    {
+        unsigned l;
+        for(l=0; l<num_links; l++)
+        {
+            comms_link_set_rx_ring(&links[l].link, malloc(rx_ring_size), rx_ring_size);
+        }
+    }
+
     if (mode == CONSOLE)
     {
-        open_serial();
-        config_port();
+        unsigned l;
+        for(l=0; l<num_links; l++)
+        {
+            if (open_serial(&links[l]) != -1)
+            {
+                config_port(&links[l]);
+                /* firmware without credits won't answer; then we never wait */
+                credit_request(&links[l].link, 1);
+            }
+        }
         do_console();
     }
     else if (mode == TESTRX)
@@ -938,7 +1608,7 @@ int main(int argc, char **argv)
             u8 val = strtoul(buf, NULL, 0);
             
             printf("rx_notify(%02X, 0)\n", val);
-            rx_notify(val, 0);
+            rx_notify(&links[0].link, val, 0);
         }
     }
     else if (mode == TESTTX)
@@ -998,7 +1668,7 @@ int main(int argc, char **argv)
                     }
                     else {
                         printf("payload done.\n");
-                        send_msg(to, code, payload_len, payload);
+                        link_send(&links[0].link, to, code, payload_len, payload);
                         return 0;
                     }
                 }
@@ -1027,63 +1697,166 @@ static inline void addr_to_buf(u32 addr, u8 *buf)
     buf[2] = addr;
 }
 
-void buf_to_desc(u8 *buf, logged_data_descriptor_t *desc)
+/* A unit summed as dataflash_hash() does on the device */
+static u32 flash_hash(const u8 *p, u32 length)
+{
+    u16 a = 0, b = 0;
+
+    while (length--)
+    {
+        a += *p++;
+        b += a;
+    }
+    return a | (u32)b << 16;
+}
+
+static void sync_hash_request(host_link_t *hl, u32 addr, unsigned count, u8 shift)
+{
+    u8 buf[5];
+
+    addr_to_buf(addr, buf);
+    buf[3] = count;
+    buf[4] = shift;
+    hl->reader.sync_count = count;
+    link_send(&hl->link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_HASH_RANGE, 5, buf);
+}
+
+/* Flash reads: READ_RANGE, or run length code over erased flash (see
+ * log_read_rle_next()).  A READ_RLE reply comes back expanded as
+ * EVT_FLASH_PACKET_RECEIVED. */
+static void read_request(host_link_t *hl, u32 addr, u32 length)
+{
+    flash_reader_t *rd = &hl->reader;
+    u8 buf[5];
+
+    addr_to_buf(addr, buf);
+    rd->rle_sent = rd->rle_next && !rd->rle_unsupported;
+    if (!rd->rle_sent)
+    {
+        buf[3] = length < FLASH_RANGE_MAX ? length : FLASH_RANGE_MAX;
+        link_send(&hl->link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RANGE, 4, buf);
+        return;
+    }
+    if (length > 0xFFFF)
+    {
+        length = 0xFFFF;
+    }
+    buf[3] = length>>8;
+    buf[4] = length;
+    link_send(&hl->link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RLE, 5, buf);
+}
+
+/* Reads the mirror, or starts it as erased flash; 0 if that worked. */
+static int sync_load_mirror(flash_reader_t *rd)
+{
+    FILE *f;
+
+    free(rd->mirror);
+    free(rd->page_state);
+    rd->mirror = malloc(rd->mirror_size);
+    rd->page_state = calloc(rd->mirror_size >> rd->page_shift, 1);
+    if (!rd->mirror || !rd->page_state)
+    {
+        fprintf(stderr, "malloc error\n");
+        return -1;
+    }
+    memset(rd->mirror, 0xFF, rd->mirror_size);
+    f = fopen(rd->mirror_name, "rb");
+    if (f)
+    {
+        if (fread(rd->mirror, 1, rd->mirror_size, f) == 0 && ferror(f))
+        {
+            perror(rd->mirror_name);
+        }
+        fclose(f);
+    }
+    return 0;
+}
+
+static void sync_finish(host_link_t *hl)
 {
-    desc->flags = buf[0];
-    desc->sequence_number = buf[1];
-    desc->data_start_offset = (buf[4]<<16 | buf[3]<<8 | buf[2]);
-    desc->data_length = (buf[7]<<16 | buf[6]<<8 | buf[5]);
+    flash_reader_t *rd = &hl->reader;
+    FILE *f = fopen(rd->mirror_name, "wb");
+
+    if (!f || fwrite(rd->mirror, rd->mirror_size, 1, f) != 1)
+    {
+        perror(rd->mirror_name);
+    }
+    else
+    {
+        fprintf(stderr, "%d: %s in sync; read %u pages (%u KB)\n", hl->index,
+                rd->mirror_name, rd->sync_pages,
+                (rd->sync_pages << rd->page_shift) / 1024);
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+    free(rd->page_state);
+    rd->page_state = NULL;
+    rd->state = STATE_SYNC_DONE;
 }
 
-flash_sm_state_t read_flash_sm(cmd_or_event_t event, unsigned length, u8 *data)
+flash_sm_state_t read_flash_sm(host_link_t *hl, cmd_or_event_t event, unsigned length, u8 *data)
 {
-    static u32 addr;
-    static unsigned descriptor_index;
-    static flash_sm_state_t state;
-    static read_all;
-    static cmd_or_event_t last_cmd;
-    static unsigned last_length;
-    static u8 *last_data;
+    flash_reader_t *rd = &hl->reader;
     int notall = 0;
     
 //    fprintf(stderr, "read_flash_sm(%d, %d, ...)\n", event, length);
     
     if (event != EVT_FLASH_PACKET_RECEIVED && event != EVT_PACKET_ERROR)
     {
-        last_cmd = event;
-        last_length = length;
-        last_data = data;
+        /* Keep the argument by value; data may point at the caller's stack. */
+        rd->last_cmd = event;
+        rd->last_length = length;
+        rd->last_arg = (data && length == sizeof(unsigned)) ? *(unsigned *)data : 0;
+    }
+    else if (event == EVT_PACKET_ERROR && (rd->state == STATE_READ_SAMPLES_WAIT || rd->state == STATE_READ_HEADERS_WAIT ||
+                                           rd->state == STATE_READ_STATS_WAIT || rd->state == STATE_SYNC_INFO_WAIT ||
+                                           rd->state == STATE_SYNC_BLOCKS_WAIT || rd->state == STATE_SYNC_PAGES_WAIT ||
+                                           rd->state == STATE_SYNC_READ_WAIT))
+    {
+        return read_flash_sm(hl, rd->last_cmd, rd->last_length, (u8 *)&rd->last_arg);
     }
-    else if (event == EVT_PACKET_ERROR && (state == STATE_READ_SAMPLES_WAIT || state == STATE_READ_HEADERS_WAIT))
+    else if (event == EVT_FLASH_PACKET_RECEIVED &&
+             (rd->state == STATE_READ_SAMPLES_WAIT || rd->state == STATE_SYNC_READ_WAIT))
     {
-        return read_flash_sm(last_cmd, last_length, last_data);
+        rd->rle_next = log_read_rle_next(rd->rle_sent, data, length);
     }
     
     switch (event)
     {
         case CMD_READ_HEADERS_BEGIN:
-            addr = 0;
+            rd->addr = 0;
+            rd->descriptor_count = 0;
             /* fall-through */
         case CMD_READ_HEADERS_CONTINUE:
             {                
                 u8 buf[4];
 
-                addr_to_buf(addr, buf);                
-                buf[3] = sizeof(logged_data_descriptor_t);
+                addr_to_buf(rd->addr, buf);                
+                buf[3] = LOG_DESC_SIZE;
             
-                state = STATE_READ_HEADERS_WAIT;
+                rd->state = STATE_READ_HEADERS_WAIT;
                 
-                send_msg(0xF, 0x53, 4, buf);
+                link_send(&hl->link, 0xF, 0x53, 4, buf);
 
                 break;
             }
             
         case CMD_READ_SAMPLES_BEGIN:
-            descriptor_index = *(unsigned *)data;
+            rd->descriptor_index = *(unsigned *)data;
 
-            if (descriptor_index > descriptor_count)
+            if (rd->descriptor_index >= rd->descriptor_count)
             {
-                fprintf(stderr, "descriptor index %d is greater than read descriptor count %d\n", descriptor_index, descriptor_count);
+                if (rd->read_all)
+                {
+                    fprintf(stderr, "%s: read all %d sessions\n", hl->device, rd->descriptor_count);
+                    rd->read_all = 0;
+                    rd->state = STATE_READ_SAMPLES_DONE;
+                    break;
+                }
+                fprintf(stderr, "descriptor index %d is greater than read descriptor count %d\n", rd->descriptor_index, rd->descriptor_count);
                 break;
             }
             notall = 1;
@@ -1092,159 +1865,390 @@ flash_sm_state_t read_flash_sm(cmd_or_event_t event, unsigned length, u8 *data)
         case CMD_READ_SAMPLES_ALL:
             if (!notall)
             {
-                read_all = 1;
-                descriptor_index = 0;
+                rd->read_all = 1;
+                rd->descriptor_index = 0;
             }
             
             fprintf(stderr, "Reading %04X - %04X (%04X bytes) described by descriptor %d\n",
-                    descriptors[descriptor_index].data_start_offset,
-                    descriptors[descriptor_index].data_start_offset + descriptors[descriptor_index].data_length,
-                    descriptors[descriptor_index].data_length,
-                    descriptor_index);
+                    log_desc_start(&rd->descriptors[rd->descriptor_index]),
+                    log_desc_start(&rd->descriptors[rd->descriptor_index]) + rd->descriptors[rd->descriptor_index].data_length,
+                    rd->descriptors[rd->descriptor_index].data_length,
+                    rd->descriptor_index);
 
-            if (descriptors[descriptor_index].data_length != 0)
+            if (rd->descriptors[rd->descriptor_index].data_length != 0)
             {
-                sample_buffers[descriptor_index] = malloc(descriptors[descriptor_index].data_length);
+                rd->sample_buffers[rd->descriptor_index] = malloc(rd->descriptors[rd->descriptor_index].data_length);
             }
             else
             {
-                fprintf(stderr, "Unknown length: mallocing 512kB\n");
-                sample_buffers[descriptor_index] = malloc(512*1024);
+                fprintf(stderr, "Unknown length: mallocing %dkB\n", UNKNOWN_LENGTH_MAX/1024);
+                rd->sample_buffers[rd->descriptor_index] = malloc(UNKNOWN_LENGTH_MAX);
             }
-            if (!sample_buffers[descriptor_index])
+            if (!rd->sample_buffers[rd->descriptor_index])
             {
                 fprintf(stderr, "malloc error\n");
                 break;
             }
 
-            addr = descriptors[descriptor_index].data_start_offset;
+            rd->addr = log_desc_start(&rd->descriptors[rd->descriptor_index]);
             
             /* fall-through */            
         case CMD_READ_SAMPLES_CONTINUE:
-            {                
-                u8 buf[4];
+            {
+                logged_data_descriptor_t *desc = &rd->descriptors[rd->descriptor_index];
+                u32 done = rd->addr - log_desc_start(desc);
+                u32 left = desc->data_length ? desc->data_length - done : UNKNOWN_LENGTH_MAX - done;
 
-                addr_to_buf(addr, buf);                
-                buf[3] = 15;  /* max */
+                if (!left)
+                {
+                    fprintf(stderr, "No erased flash in %dkB -- stopping streaming read\n",
+                            UNKNOWN_LENGTH_MAX/1024);
+                    desc->data_length = done;
+                    rd->state = STATE_READ_SAMPLES_DONE;
+                    break;
+                }
+                rd->state = STATE_READ_SAMPLES_WAIT;
+                read_request(hl, rd->addr, left);
+                break;
+            }
             
-                state = STATE_READ_SAMPLES_WAIT;
-                
-                send_msg(0xF, 0x53, 4, buf);
+        case CMD_READ_STATS_BEGIN:
+            rd->descriptor_index = 0;
+            /* fall-through */
+        case CMD_READ_STATS_NEXT:
+            /* Sessions without statistics just get their line. */
+            for(; rd->descriptor_index < rd->descriptor_count; rd->descriptor_index++)
+            {
+                logged_data_descriptor_t *desc = &rd->descriptors[rd->descriptor_index];
 
+                printf("%3d: v%d seq %4d start %05X length %05X\n", rd->descriptor_index,
+                       log_desc_version(desc->flags), log_desc_seq(desc),
+                       (unsigned)log_desc_start(desc), (unsigned)desc->data_length);
+                if (desc->flags == LOG_DESC_FLAGS_V3S)
+                {
+                    break;
+                }
+            }
+            if (rd->descriptor_index >= rd->descriptor_count)
+            {
+                rd->list_stats = 0;
+                rd->state = STATE_READ_STATS_DONE;
                 break;
             }
-            
+            rd->stats_have = 0;
+            /* fall-through */
+        case CMD_READ_STATS_CONTINUE:
+            {
+                u8 buf[4];
+                unsigned want = rd->stats_have < 2 ? 2 : log_stats_size(rd->stats);
+
+                want -= rd->stats_have;
+                addr_to_buf(log_desc_stats(&rd->descriptors[rd->descriptor_index]) + rd->stats_have, buf);
+                buf[3] = want > 15 ? 15 : want;
+
+                rd->state = STATE_READ_STATS_WAIT;
+
+                link_send(&hl->link, 0xF, 0x53, 4, buf);
+
+                break;
+            }
+
+        case CMD_SYNC_BEGIN:
+            rd->state = STATE_SYNC_INFO_WAIT;
+            link_send(&hl->link, 0xF, TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_INFO, 0, 0);
+            break;
+
+        case CMD_SYNC_BLOCKS:
+            {
+                u32 nblocks = rd->mirror_size >> (rd->page_shift + 3);
+                unsigned count = nblocks - rd->sync_pos;
+
+                if (rd->sync_pos >= nblocks)
+                {
+                    rd->sync_pos = 0;
+                    read_flash_sm(hl, CMD_SYNC_PAGES, 0, 0);
+                    break;
+                }
+                fprintf(stderr, "%d: Sync block %u of %u   \r", hl->index,
+                        (unsigned)rd->sync_pos, (unsigned)nblocks);
+                rd->state = STATE_SYNC_BLOCKS_WAIT;
+                sync_hash_request(hl, rd->sync_pos << (rd->page_shift + 3),
+                        count > FLASH_HASH_MAX ? FLASH_HASH_MAX : count, rd->page_shift + 3);
+                break;
+            }
+
+        case CMD_SYNC_PAGES:
+            {
+                u32 npages = rd->mirror_size >> rd->page_shift;
+                unsigned count = 0;
+
+                while (rd->sync_pos < npages && rd->page_state[rd->sync_pos] != SYNC_PAGE_MAYBE)
+                {
+                    rd->sync_pos++;
+                }
+                if (rd->sync_pos >= npages)
+                {
+                    rd->sync_pos = 0;
+                    rd->addr = 0;
+                    read_flash_sm(hl, CMD_SYNC_READ, 0, 0);
+                    break;
+                }
+                while (count < FLASH_HASH_MAX && rd->sync_pos + count < npages &&
+                       rd->page_state[rd->sync_pos + count] == SYNC_PAGE_MAYBE)
+                {
+                    count++;
+                }
+                rd->state = STATE_SYNC_PAGES_WAIT;
+                sync_hash_request(hl, rd->sync_pos << rd->page_shift, count, rd->page_shift);
+                break;
+            }
+
+        case CMD_SYNC_READ:
+            {
+                u32 npages = rd->mirror_size >> rd->page_shift;
+                u32 page = 1UL << rd->page_shift;
+
+                while (rd->sync_pos < npages && rd->page_state[rd->sync_pos] != SYNC_PAGE_DIFFERS)
+                {
+                    rd->sync_pos++;
+                    rd->addr = rd->sync_pos << rd->page_shift;
+                }
+                if (rd->sync_pos >= npages)
+                {
+                    sync_finish(hl);
+                    break;
+                }
+                fprintf(stderr, "%d: Sync read %05lX   \r", hl->index, rd->addr);
+                rd->state = STATE_SYNC_READ_WAIT;
+                read_request(hl, rd->addr, page - (rd->addr & (page-1)));
+                break;
+            }
+
+        case EVT_FLASH_INFO_RECEIVED:
+            rd->page_shift  = data[1];
+            rd->mirror_size = 1UL << data[2];
+            if (sync_load_mirror(rd))
+            {
+                rd->state = STATE_SYNC_DONE;
+                break;
+            }
+            rd->sync_pos   = 0;
+            rd->sync_pages = 0;
+            read_flash_sm(hl, CMD_SYNC_BLOCKS, 0, 0);
+            break;
+
+        case EVT_FLASH_HASH_RECEIVED:
+            {
+                u8 shift = rd->state == STATE_SYNC_BLOCKS_WAIT ? rd->page_shift + 3 : rd->page_shift;
+                unsigned i;
+
+                if ((rd->state != STATE_SYNC_BLOCKS_WAIT && rd->state != STATE_SYNC_PAGES_WAIT) ||
+                    length != 4 * rd->sync_count)
+                {
+                    fprintf(stderr, "Unexpected hashes in state %d\n", rd->state);
+                    break;
+                }
+                for(i=0; i<rd->sync_count; i++)
+                {
+                    u32 unit = rd->sync_pos + i;
+                    u32 h = data[4*i] | data[4*i+1]<<8 | data[4*i+2]<<16 | (u32)data[4*i+3]<<24;
+                    int differs = h != flash_hash(rd->mirror + (unit << shift), 1UL << shift);
+
+                    if (rd->state == STATE_SYNC_BLOCKS_WAIT)
+                    {
+                        memset(rd->page_state + (unit << 3),
+                               differs ? SYNC_PAGE_MAYBE : SYNC_PAGE_SAME, 8);
+                    }
+                    else
+                    {
+                        rd->page_state[unit] = differs ? SYNC_PAGE_DIFFERS : SYNC_PAGE_SAME;
+                    }
+                }
+                rd->sync_pos += rd->sync_count;
+                read_flash_sm(hl, rd->state == STATE_SYNC_BLOCKS_WAIT ? CMD_SYNC_BLOCKS : CMD_SYNC_PAGES, 0, 0);
+                break;
+            }
+
         case EVT_FLASH_PACKET_RECEIVED:
             {
                 u8 *payload = data;
-                switch (state)
+                switch (rd->state)
                 {
+                    case STATE_SYNC_READ_WAIT:
+                        {
+                            u32 page = 1UL << rd->page_shift;
+
+                            if (length > page - (rd->addr & (page-1)))
+                            {
+                                length = page - (rd->addr & (page-1));
+                            }
+                            memcpy(rd->mirror + rd->addr, payload, length);
+                            rd->addr += length;
+                            if (!(rd->addr & (page-1)))
+                            {
+                                rd->page_state[rd->sync_pos] = SYNC_PAGE_SAME;
+                                rd->sync_pages++;
+                            }
+                            read_flash_sm(hl, CMD_SYNC_READ, 0, 0);
+                            break;
+                        }
                     case STATE_READ_HEADERS_WAIT:
                         {
                             /* descriptor in packet. */
                             logged_data_descriptor_t *desc;
                             
-                            if (length != sizeof(logged_data_descriptor_t))
+                            if (length != LOG_DESC_SIZE)
                             {
                                 fprintf(stderr, "EVT_FLASH_PACKET_RECIEVED in state READ_HEADERS_WAIT: length is %d, not %d\n",
-                                        length, sizeof(logged_data_descriptor_t));
-                                return;
+                                        length, LOG_DESC_SIZE);
+                                return rd->state;
                             }
 
 
-                            desc =  &descriptors[descriptor_count];
+                            desc =  &rd->descriptors[rd->descriptor_count];
 
-                            buf_to_desc(payload, desc);
+                            log_desc_from_buf(payload, desc);
                             
                             fprintf(stderr, "Descriptor %d @ %X \n"
                                             " flags             %X\n"
                                             " sequence number   %d\n"
                                             " data_start_offset %X\n"
                                             " data_length       %X\n",
-                                            descriptor_count, addr, 
+                                            rd->descriptor_count, rd->addr, 
                                             desc->flags, 
-                                            desc->sequence_number,
-                                            desc->data_start_offset,
+                                            log_desc_seq(desc),
+                                            log_desc_start(desc),
                                             desc->data_length);
                             
  
-                            if (desc->flags != 0xDD)
+                            if (desc->flags == LOG_DESC_FLAGS_ERASED)
                             {
                                 /* done reading headers */
-                                fprintf(stderr, "EVT_FLASH_PACKET_RECIEVED: flags at addr %X are %X, stopping\n", addr, desc->flags);
-                                state = STATE_READ_HEADERS_DONE;
+                                fprintf(stderr, "EVT_FLASH_PACKET_RECIEVED: flags at addr %X are %X, stopping\n", rd->addr, desc->flags);
+                                rd->descriptor_count = log_order_descriptors(rd->descriptors, rd->descriptor_count);
+                                rd->state = STATE_READ_HEADERS_DONE;
+                                if (rd->list_stats)
+                                {
+                                    read_flash_sm(hl, CMD_READ_STATS_BEGIN, 0, 0);
+                                }
                                 break;
                             }
                             
-                            addr += 8;
-                            ++descriptor_count;
+                            rd->addr += LOG_DESC_SIZE;
+                            if (log_desc_valid(desc->flags))
+                            {
+                                ++rd->descriptor_count;
+                            }
+                            if (rd->addr >= MAX_DESCRIPTORS * LOG_DESC_SIZE)
+                            {
+                                /* every slot in use */
+                                rd->descriptor_count = log_order_descriptors(rd->descriptors, rd->descriptor_count);
+                                rd->state = STATE_READ_HEADERS_DONE;
+                                if (rd->list_stats)
+                                {
+                                    read_flash_sm(hl, CMD_READ_STATS_BEGIN, 0, 0);
+                                }
+                                break;
+                            }
                             //fprintf(stderr, "Wait...\r");
                             //usleep(100000);
-                            read_flash_sm(CMD_READ_HEADERS_CONTINUE, 0, 0);
+                            read_flash_sm(hl, CMD_READ_HEADERS_CONTINUE, 0, 0);
                             break;
                         }
                     case STATE_READ_SAMPLES_WAIT:
                         {
-                            unsigned buf_offset = addr - descriptors[descriptor_index].data_start_offset;
+                            unsigned buf_offset = rd->addr - log_desc_start(&rd->descriptors[rd->descriptor_index]);
 
-                            fprintf(stderr, "Read %05X - %05X               \r",
-                                    descriptors[descriptor_index].data_start_offset, addr+length);
+                            fprintf(stderr, "%d: Read %05X - %05X               \r",
+                                    hl->index,
+                                    log_desc_start(&rd->descriptors[rd->descriptor_index]), rd->addr+length);
 
-//                            printf("read_samples_wait: addr %05X length %02d offset %05X \r", addr, length, buf_offset);
+//                            printf("read_samples_wait: addr %05X length %02d offset %05X \r", rd->addr, length, buf_offset);
 
-                            if (descriptors[descriptor_index].data_length == 0)
+                            if (rd->descriptors[rd->descriptor_index].data_length == 0)
                             {
-                                /* length not saved.  Keep reading until 8 0xFFs in a row. */
-                                int z, y=0;
-                                for(z=0; z<length; z++)
-                                {
-                                    if (payload[z] == 0xFF)
-                                    {
-                                        ++y;
-                                    }
-                                }
-                                if (y == length)
+                                /* length not saved.  Keep reading until erased flash. */
+                                long end = log_session_end(log_desc_version(rd->descriptors[rd->descriptor_index].flags),
+                                                           buf_offset, payload, length);
+                                if (end >= 0)
                                 {
-                                    fprintf(stderr, "Read 8 FFs -- stopping streaming read (length is %X\n", buf_offset);
-                                    descriptors[descriptor_index].data_length = buf_offset;
-                                    state = STATE_READ_SAMPLES_DONE;
+                                    memcpy(rd->sample_buffers[rd->descriptor_index] + buf_offset, payload, end - buf_offset);
+                                    fprintf(stderr, "Reached erased flash -- stopping streaming read (length is %lX)\n", end);
+                                    rd->descriptors[rd->descriptor_index].data_length = end;
+                                    rd->state = STATE_READ_SAMPLES_DONE;
                                     break;
                                 }
-                                memcpy(sample_buffers[descriptor_index] + buf_offset, payload, length);
-                                addr += length;
-                                read_flash_sm(CMD_READ_SAMPLES_CONTINUE, 0, 0);
+                                memcpy(rd->sample_buffers[rd->descriptor_index] + buf_offset, payload, length);
+                                rd->addr += length;
+                                read_flash_sm(hl, CMD_READ_SAMPLES_CONTINUE, 0, 0);
                             }
                             else
                             {
-                                if (buf_offset + length > descriptors[descriptor_index].data_length)
+                                if (buf_offset + length > rd->descriptors[rd->descriptor_index].data_length)
                                 {
-                                    length = descriptors[descriptor_index].data_length - buf_offset;
+                                    length = rd->descriptors[rd->descriptor_index].data_length - buf_offset;
                                 }
 
-                                memcpy(sample_buffers[descriptor_index] + buf_offset, payload, length);
-                                addr += length;
+                                memcpy(rd->sample_buffers[rd->descriptor_index] + buf_offset, payload, length);
+                                rd->addr += length;
 
-                                if (addr < descriptors[descriptor_index].data_start_offset + descriptors[descriptor_index].data_length)
+                                if (rd->addr < log_desc_start(&rd->descriptors[rd->descriptor_index]) + rd->descriptors[rd->descriptor_index].data_length)
                                 {
-                                    read_flash_sm(CMD_READ_SAMPLES_CONTINUE, 0, 0);
+                                    read_flash_sm(hl, CMD_READ_SAMPLES_CONTINUE, 0, 0);
                                 }
-                                else if (read_all)
+                                else if (rd->read_all)
                                 {
-                                    ++descriptor_index;
-                                    read_flash_sm(CMD_READ_SAMPLES_BEGIN, 4, (u8 *)&descriptor_index);
+                                    ++rd->descriptor_index;
+                                    read_flash_sm(hl, CMD_READ_SAMPLES_BEGIN, 4, (u8 *)&rd->descriptor_index);
                                 }
                                 else
                                 {
-                                    state = STATE_READ_SAMPLES_DONE;
+                                    rd->state = STATE_READ_SAMPLES_DONE;
                                     printf("\nDone; read %d bytes\n", 
-                                            descriptors[descriptor_index].data_length);
+                                            rd->descriptors[rd->descriptor_index].data_length);
                                 }
                             }
                             break;
                         }
+                    case STATE_READ_STATS_WAIT:
+                        {
+                            log_channel_stats_t st[LOG_MAX_CHANNELS];
+                            unsigned size;
+                            int n;
+
+                            if (rd->stats_have + length > sizeof(rd->stats))
+                            {
+                                length = sizeof(rd->stats) - rd->stats_have;
+                            }
+                            memcpy(rd->stats + rd->stats_have, payload, length);
+                            rd->stats_have += length;
+                            if (rd->stats_have < 2)
+                            {
+                                read_flash_sm(hl, CMD_READ_STATS_CONTINUE, 0, 0);
+                                break;
+                            }
+                            size = log_stats_size(rd->stats);
+                            if (size && rd->stats_have < size)
+                            {
+                                read_flash_sm(hl, CMD_READ_STATS_CONTINUE, 0, 0);
+                                break;
+                            }
+                            n = log_stats_from_buf(rd->stats, rd->stats_have, st);
+                            if (n < 0)
+                            {
+                                printf("       no statistics\n");
+                            }
+                            else
+                            {
+                                log_print_stats(stdout, st, n);
+                            }
+                            ++rd->descriptor_index;
+                            read_flash_sm(hl, CMD_READ_STATS_NEXT, 0, 0);
+                            break;
+                        }
                     default:
-                        fprintf(stderr, "Received flash buffer in state %d\n", state);
-                        state = STATE_BAD_PACKET;
+                        fprintf(stderr, "Received flash buffer in state %d\n", rd->state);
+                        rd->state = STATE_BAD_PACKET;
                 }
             }
             break;
@@ -1252,16 +2256,46 @@ flash_sm_state_t read_flash_sm(cmd_or_event_t event, unsigned length, u8 *data)
             fprintf(stderr, "read_flash_sm: unknown event %d\n", event);
     }
 
-    return state;
+    return rd->state;
 }
                     
             
             
-void write_samples_to_file(unsigned index, char *filename, int binary)
+void write_samples_to_file(host_link_t *hl, unsigned index, char *filename, psamp_format_t format)
 {
+    flash_reader_t *rd = &hl->reader;
     FILE *file;
-    unsigned si = 0;
-    unsigned last_time = 0;
+    int version;
+
+    if (index >= rd->descriptor_count || !rd->sample_buffers[index])
+    {
+        fprintf(stderr, "No samples downloaded for descriptor %d\n", index);
+        return;
+    }
+    version = log_desc_version(rd->descriptors[index].flags);
+
+    if (format == PSAMP_COL || format == PSAMP_CSV)
+    {
+        log_columns_t cols;
+
+        if (log_decode_columns(rd->sample_buffers[index], 
+                               rd->descriptors[index].data_length, version, &cols))
+        {
+            fprintf(stderr, "Out of memory decoding descriptor %d\n", index);
+        }
+        else if (format == PSAMP_COL)
+        {
+            log_write_columnar(&cols, filename);
+        }
+        else
+        {
+            log_write_csv(&cols, filename);
+        }
+        fprintf(stderr, "%s: %lu samples in %d columns (%lu skipped, %lu bad octets)\n",
+                filename, cols.samples, cols.ncolumns, cols.skipped, cols.garbage);
+        log_columns_free(&cols);
+        return;
+    }
 
     file = fopen(filename, "w");
     if (!file)
@@ -1271,77 +2305,42 @@ void write_samples_to_file(unsigned index, char *filename, int binary)
         return;
     }
     
-    if (!binary)
+    if (format == PSAMP_TEXT)
     {
-        for(si=0; si<descriptors[index].data_length; )
-        {
-            u8 *sp = &sample_buffers[index][si];
-            u8 flags = (*sp&0xF);
-            u8 len   = (*sp>>4);
+        log_reader_t r;
+        log_sample_t smp;
+        unsigned long long last_time = 0;
 
-            if (flags != 0xA)
+        log_reader_init(&r, version, rd->sample_buffers[index], 
+                        rd->descriptors[index].data_length);
+        while (log_reader_next(&r, &smp))
+        {
+            unsigned long long timestamp = smp.t_usec;
+            unsigned long long tdelt = timestamp - last_time;
+            char line[128];
+            int n, i;
+            
+            /* format once, print to both */
+            n = sprintf(line, "| %02X %6llu.%03llu.%03llu (+%llu.%03llu.%03llu) ",
+                smp.type,
+                timestamp/1000000, (timestamp/1000)%1000, timestamp%1000,
+                tdelt/1000000, (tdelt/1000)%1000, tdelt%1000);
+            for(i=0; i<smp.width; i++)
             {
-                int j, ok=0;
-                ++si;
-                continue;
-
-                fprintf(stderr, "invalid flags for sample in buffer at offset %X\n", si);
-                for(j=0; j<20; j++)
-                {
-                    if ((*(sp+j)&0xF)==0xA)
-                    {
-                        si += j;
-                        ok=1;
-                        break;
-                    }
-                }
-                if(!ok)
-                {
-                    break;
-                }
+                n += sprintf(line+n, "%02X ", smp.value[i]);
             }
+            line[n++] = '\n';
 
-            {
-                unsigned timestamp = sp[5]<<24 | sp[4]<<16 | sp[3]<<8 | sp[2];
-                unsigned tdelt = timestamp - last_time;
-                int i;
-                
-                printf("| %02X %02X %6d.%03d.%03d (+%d.%03d.%03d) ",
-            //fprintf(stderr, "| %02X %02X %08X %02X%02X\n",
-                    sp[0], sp[1],
-                    timestamp/1000000, (timestamp/1000)%1000, timestamp%1000,
-                    tdelt/1000000, (tdelt/1000)%1000, tdelt%1000);
-                for(i=0; i<len; i++)
-                {
-                    printf("%02X ", sp[6+i]);
-                }
-                printf("\n");
-
-                if (file)
-                {
-                    fprintf(file, "| %02X %02X %6d.%03d.%03d (+%d.%03d.%03d) ",
-                        sp[0], sp[1],
-                        timestamp/1000000, (timestamp/1000)%1000, timestamp%1000,
-                        tdelt/1000000, (tdelt/1000)%1000, tdelt%1000);
-                    for(i=0; i<len; i++)
-                    {
-                        fprintf(file, "%02X ", sp[6+i]);
-                    }
-                    fprintf(file, "\n");
-                }
-
-                
-            
-                last_time = timestamp;
-
-                si += 6+len;
-            }
+            fwrite(line, 1, n, stdout);
+            fwrite(line, 1, n, file);
+        
+            last_time = timestamp;
         }
     }
     else
     {
         /* binary */
-        size_t ret = fwrite(sample_buffers[index], descriptors[index].data_length, 1, file);
+        size_t ret = fwrite(rd->sample_buffers[index], rd->descriptors[index].data_length, 1, file);
         if (ret != 1)
         {
             fprintf(stderr, "fwrite failed: %s\n", strerror(errno));
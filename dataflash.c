@@ -22,6 +22,8 @@
 *******************************************************************************/
 
 #include "dataflash.h"
+#include "tasks.h"
+#include "loggercmds.h"
 
 /* this is actually the V1 mute fet on rev B. */
 #define DF_PORT PORTB
@@ -63,8 +65,29 @@ static inline void df_mutex_exit()
 #endif
 
 
+u8 df_density    = 0x7;            /* AT45DB041 until we've asked */
+u8 df_page_shift = 8;
+u8 df_size_shift = 19;
+static u8 df_addr_shift = 9;        /* byte address bits in a command */
+
+static void buffers_init();
+
+/* By density code: pages, page size.  Codes 0x3 to 0xF. */
+static const u8 df_geometry[7][2] = {
+    /* log2 pages, log2 data bytes per page */
+    {  9,  8 },                     /* 0011 AT45DB011 */
+    { 10,  8 },                     /* 0101 AT45DB021 */
+    { 11,  8 },                     /* 0111 AT45DB041 */
+    { 12,  8 },                     /* 1001 AT45DB081 */
+    { 12,  9 },                     /* 1011 AT45DB161 */
+    { 13,  9 },                     /* 1101 AT45DB321 */
+    { 13, 10 },                     /* 1111 AT45DB642 */
+};
+
 void dataflash_init()
 {
+    u8 d;
+
     /* Set MOSI, SCK, FLASH_CS as outputs.
      * Also make sure /SS is an output.
      * This will interfere with the user of the SS pin, 
@@ -81,15 +104,24 @@ void dataflash_init()
      * MSTR = 1  - master mode
      * CPOL = 1  - spi mode 3
      * CPHA = 1  - spi mode 3
-     * SPR1 = 0  - 01 = Fosc/16 or Fosc/8
-     * SPR0 = 1  - "
+     * SPR1 = 0  - 00 with SPI2X = Fosc/2, 9.2 MHz at 18.432 MHz;
+     * SPR0 = 0  - the AT45DB041 is good for 13 (20 for the B part)
      */
-      SPCR = (1<<SPE)|(1<<MSTR)|(1<<SPR0)|(1<<CPOL)|(1<<CPHA);
-
-//    SPCR = (1<<SPE)|(1<<MSTR)|(1<<SPR0)|(1<<SPR1)|(1<<CPOL)|(1<<CPHA);
+    SPCR = (1<<SPE)|(1<<MSTR)|(1<<CPOL)|(1<<CPHA);
     
     /* SPI2X = 1 - 2x mode */
-//    SPSR = (1<<SPI2X);
+    SPSR = (1<<SPI2X);
+
+    /* Anything that isn't a density code (no chip) leaves the DB041. */
+    d = (dataflash_read_status_reg() >> 2) & 0xF;
+    if ((d & 1) && d >= 0x3)
+    {
+        df_density    = d;
+        df_page_shift = df_geometry[(d-3)/2][1];
+        df_size_shift = df_geometry[(d-3)/2][0] + df_page_shift;
+        df_addr_shift = df_page_shift + 1;
+    }
+    buffers_init();
 }
 
 static void spi_write(u8 byte)
@@ -170,14 +202,22 @@ u8 dataflash_buffer_read(u8 addr)
     return ret;
 }
 
+static void spi_write_addr24(u32 a)
+{
+    spi_write(a>>16);
+    spi_write(a>>8);
+    spi_write(a);
+}
+
 void spi_write_addr(flash_offset_t addr)
 {
-    /* 24 bit address format:
+    /* 24 bit address format, for the DB041:
      * 0000 PPPPPPPPPPP BBBBBBBBB 
      * 4rsv 11 page     9 byte
      * 
      * There are 9 bits to select the byte in the page, but there are only 264 bytes per page.
-     * These upper 8 bytes will not be used.   
+     * The 8 above DF_PAGE_DATA are outside the linear offset space; the
+     * append path keeps its page tags there (DF_PAGE_TAG).
      *
      *  So offset 256 is 
      *   0000  00000000001 000000000
@@ -188,108 +228,728 @@ void spi_write_addr(flash_offset_t addr)
      *  There are 2048 pages (11 bits) of 256 useful bytes each (8 bits) for a total of 19
      *  address bits.
      * 
+     * The bigger parts have more page bits, and 10 or 11 byte bits.
      * */
-    flash_offset_t page = addr>>8;
-
-    spi_write(page>>7); /* bits 11:7 of page */
-    spi_write(page<<1); /* bits 6:0 of page and a zero for the MSB of the 9 bit offset */
-    spi_write(addr);    /* bits 7:0 of byte offset in page */
+    spi_write_addr24((u32)(addr >> df_page_shift) << df_addr_shift | 
+                     (addr & (DF_PAGE_DATA-1)));
 }
 
-void dataflash_write(flash_offset_t byte_offset, u8 length, u8 *data)
+/******************************************************************************
+* Chip buffers
+*        Each SRAM buffer is either free, collecting an append page, waiting
+*        for or in the middle of its program to main memory, or held by a
+*        queued write.  Appends and programs only ever touch a buffer the
+*        chip isn't using, so the logger can fill one while the other
+*        programs.
+*******************************************************************************/
+typedef enum {
+    BUF_FREE,
+    BUF_FILLING,
+    BUF_QUEUED,
+    BUF_PROGRAMMING,
+    BUF_RESERVED,
+} df_buf_state_t;
+
+static u8               buf_state[2];
+static flash_offset_t   buf_page[2];
+static u16              buf_fill[2];        /* first byte not yet written */
+static u16              buf_tag[2];
+static u8               append_buf;         /* BUFFER_1 or BUFFER_2 */
+static u8               append_next = BUFFER_2; /* 0 with one buffer */
+static u16              append_tag = 0xFFFF;
+
+#define DF_PAD_CHUNK    16      /* octets of padding per interrupts-off burst */
+
+/* The AT45DB011 has Buffer 1 only; the second stays out of use. */
+static void buffers_init()
 {
-    if (df_mutex_enter())
+    if (df_density == 0x3)
     {
-        return;
+        buf_state[BUFFER_2] = BUF_RESERVED;
+        append_next = 0;
     }
-    
-    u8 f = disable_interrupts();
-    while (length > 0)
-    {        
-        wait_for_ready();
+}
+
+static u8 buffer_write_op(u8 b)
+{
+    return b == BUFFER_1 ? BUFFER_1_WRITE : BUFFER_2_WRITE;
+}
 
-        /* Load the buffer from flash */
+/* Pad what's left of the page, tag it and start programming it.  The
+ * padding goes out in bursts so a full page doesn't hold interrupts off. */
+static void buffer_program(u8 b)
+{
+    u8 f, n;
+
+    while (buf_fill[b] < DF_PAGE_DATA)
+    {
+        f = disable_interrupts();
         df_select();
-        spi_write(0x55);    /* main memory to buffer 2 transfer */
-        spi_write_addr(byte_offset);
+        spi_write(buffer_write_op(b));
+        spi_write_addr(buf_page[b] + buf_fill[b]);
+        n = DF_PAD_CHUNK;
+        do {
+            spi_write(0xFF);
+        } while (++buf_fill[b] < DF_PAGE_DATA && --n);
         df_deselect();
+        restore_flags(f);
+    }
+
+    f = disable_interrupts();
+    df_select();
+    spi_write(buffer_write_op(b));
+    spi_write_addr24(DF_PAGE_TAG);
+    spi_write(buf_tag[b]);
+    spi_write(buf_tag[b]>>8);
+    df_deselect();
 
-        wait_for_ready();
+    df_select();
+    spi_write(b == BUFFER_1 ? B1_TO_MM_PAGE_PROG_WITH_ERASE : 
+                              B2_TO_MM_PAGE_PROG_WITH_ERASE);
+    spi_write_addr(buf_page[b]);
+    df_deselect();
+    buf_state[b] = BUF_PROGRAMMING;
+    restore_flags(f);
+}
+
+/* With one buffer, a queued write or copy takes the page the logger is
+ * filling out first; dataflash_append() reads it back to carry on. */
+static void single_buffer_release()
+{
+    if (!append_next && buf_state[BUFFER_1] == BUF_FILLING)
+    {
+        buf_state[BUFFER_1] = BUF_QUEUED;
+    }
+}
+
+/* With one buffer the logger can't fill a page while the last one
+ * programs, so it waits for it, with interrupts on meanwhile.  Not for a
+ * buffer a queued write holds; that only comes back in dataflash_poll(). */
+static void single_buffer_wait()
+{
+    u8 f;
+
+    for(;;)
+    {
+        f = disable_interrupts();
+        if (buf_state[BUFFER_1] != BUF_QUEUED &&
+            buf_state[BUFFER_1] != BUF_PROGRAMMING)
+        {
+            restore_flags(f);
+            return;
+        }
+        if (dataflash_read_status_reg() & 0x80)
+        {
+            if (buf_state[BUFFER_1] == BUF_PROGRAMMING)
+            {
+                buf_state[BUFFER_1] = BUF_FREE;
+            }
+            else
+            {
+                buffer_program(BUFFER_1);
+            }
+        }
+        restore_flags(f);
+    }
+}
+
+/******************************************************************************
+* dataflash_append
+*        Nothing here waits on the chip.  If the buffer the next page needs
+*        hasn't finished programming, nothing from that page on is written
+*        and 1 is returned; on a one buffer chip it waits instead.
+*******************************************************************************/
+u8 dataflash_append(flash_offset_t byte_offset, u8 length, u8 *data)
+{
+    u8 f = disable_interrupts();
+    u8 b = append_buf;
+    
+    while (length > 0)
+    {
+        flash_offset_t page = byte_offset & ~(flash_offset_t)(DF_PAGE_DATA-1);
+        u16 in_page = byte_offset & (DF_PAGE_DATA-1);
+
+        if (buf_state[b] != BUF_FILLING || buf_page[b] != page)
+        {
+            if (buf_state[b] == BUF_FILLING)
+            {
+                buf_state[b] = BUF_QUEUED;
+                b ^= append_next;
+            }
+            if (!append_next)
+            {
+                restore_flags(f);
+                single_buffer_wait();
+                f = disable_interrupts();
+            }
+            if (buf_state[b] != BUF_FREE)
+            {
+                append_buf = b;
+                restore_flags(f);
+                return 1;
+            }
+            buf_state[b] = BUF_FILLING;
+            buf_page[b]  = page;
+            buf_fill[b]  = 0;
+            buf_tag[b]   = append_tag;
+            if (!append_next && in_page)
+            {
+                /* It may have gone out part filled; what's there stays. */
+                restore_flags(f);
+                wait_for_ready();
+                f = disable_interrupts();
+                df_select();
+                spi_write(MM_PAGE_TO_B1_XFER);
+                spi_write_addr(page);
+                df_deselect();
+                buf_fill[b] = in_page;
+                restore_flags(f);
+                wait_for_ready();
+                f = disable_interrupts();
+            }
+        }
 
-        /* Write until the end of this page, or length bytes,
-         * whichever comes first. */
+        /* Anything skipped over since the last append stays erased. */
         df_select();
-        spi_write(0x87);    /* buffer 2 write */
-        spi_write_addr(byte_offset);
+        spi_write(buffer_write_op(b));
+        if (in_page > buf_fill[b])
+        {
+            spi_write_addr(page + buf_fill[b]);
+            do {
+                spi_write(0xFF);
+            } while (++buf_fill[b] < in_page);
+        }
+        else
+        {
+            spi_write_addr(byte_offset);
+        }
 
         do {
             spi_write(*data++);
             ++byte_offset;
             --length;
-        } while (length && (byte_offset&0xFF));
+        } while (length && (byte_offset & (DF_PAGE_DATA-1)));
         
         df_deselect();
 
-        wait_for_ready();
+        in_page = byte_offset & (DF_PAGE_DATA-1);
+        if (!in_page)
+        {
+            buf_fill[b]  = DF_PAGE_DATA;
+            buf_state[b] = BUF_QUEUED;
+            b ^= append_next;
+        }
+        else if (in_page > buf_fill[b])
+        {
+            buf_fill[b] = in_page;
+        }
+    }
 
-        /* Write the buffer back */
-        df_select();
-        spi_write(0x86);    /* buffer 2 to main memory w/ erase */
-        spi_write_addr(byte_offset-1);
-        df_deselect();
+    append_buf = b;
+    restore_flags(f);
+    return 0;
+}
+
+void dataflash_append_tag(u16 tag)
+{
+    u8 f = disable_interrupts();
+    append_tag = tag;
+    restore_flags(f);
+}
+
+void dataflash_append_flush()
+{
+    u8 f = disable_interrupts();
+    if (buf_state[append_buf] == BUF_FILLING)
+    {
+        buf_state[append_buf] = BUF_QUEUED;
+        append_buf ^= append_next;
     }
+    restore_flags(f);
+}
+
+/******************************************************************************
+* Operation queue
+*******************************************************************************/
+typedef enum {
+    DF_OP_READ,
+    DF_OP_WRITE,
+    DF_OP_WRITE_BUF,
+    DF_OP_ERASE_ALL,
+    DF_OP_ERASE_BLOCK,
+    DF_OP_COPY,
+    DF_OP_HASH,
+    DF_OP_RLE,
+} df_op_type_t;
 
+#define DF_STEP_DONE    0xFF
+
+typedef struct {
+    u8              type;
+    u8              tag;
+    u8              step;
+    u8              buf;                /* DF_OP_WRITE*: buffer it holds,
+                                           DF_OP_HASH: log2 unit,
+                                           DF_OP_RLE: length high octet */
+    u8              length;             /* DF_OP_COPY: pages, DF_OP_HASH: units */
+    flash_offset_t  addr;
+    union {
+        u8              *dst;               /* DF_OP_READ, DF_OP_WRITE_BUF,
+                                               DF_OP_HASH, DF_OP_RLE */
+        u8              src[DF_WRITE_MAX];  /* DF_OP_WRITE */
+        flash_offset_t  to;                 /* DF_OP_COPY */
+    } data;
+} df_op_t;
+
+static df_op_t  df_queue[DF_QUEUE_LEN];
+static u8       df_head, df_count;
+
+static u8 df_submit(u8 type, flash_offset_t addr, u8 length, u8 *data, u8 tag, u8 aux)
+{
+    df_op_t *op;
+    u8 f, i;
+
+    f = disable_interrupts();
+    if (df_count == DF_QUEUE_LEN)
+    {
+        restore_flags(f);
+        return 1;
+    }
+    op = &df_queue[(df_head + df_count) % DF_QUEUE_LEN];
+    op->type   = type;
+    op->tag    = tag;
+    op->step   = 0;
+    op->length = length;
+    op->addr   = addr;
+    op->buf    = aux;
+    if (type == DF_OP_WRITE)
+    {
+        for(i=0; i<length; i++)
+        {
+            op->data.src[i] = data[i];
+        }
+    }
+    else if (type == DF_OP_COPY)
+    {
+        op->data.to = *(flash_offset_t *)data;
+    }
+    else
+    {
+        op->data.dst = data;
+    }
+    ++df_count;
     restore_flags(f);
-    df_mutex_exit();
+    return 0;
 }
 
-void dataflash_erase_all()
+u8 dataflash_read(flash_offset_t byte_offset, u8 length, u8 *data, u8 tag)
 {
-    const flash_offset_t block_size = 256*8;
-    u16 i;
+    return df_submit(DF_OP_READ, byte_offset, length, data, tag, 0);
+}
 
-    if (df_mutex_enter())
+u8 dataflash_write(flash_offset_t byte_offset, u8 length, u8 *data, u8 tag)
+{
+    if (length > DF_WRITE_MAX || 
+        (byte_offset & (DF_PAGE_DATA-1)) + length > DF_PAGE_DATA)
     {
-        return;
+        return 1;
     }
+    return df_submit(DF_OP_WRITE, byte_offset, length, data, tag, 0);
+}
 
-    
-    for(i=0; i<256; i++)
+u8 dataflash_write_buf(flash_offset_t byte_offset, u8 length, u8 *data, u8 tag)
+{
+    if (!length || (byte_offset & (DF_PAGE_DATA-1)) + length > DF_PAGE_DATA)
     {
-        flash_offset_t addr = block_size * i;
-        
-        wait_for_ready();
-        df_select();
-        spi_write(0x50);
-        spi_write_addr(addr);
-        df_deselect();
+        return 1;
     }
+    return df_submit(DF_OP_WRITE_BUF, byte_offset, length, data, tag, 0);
+}
 
-    df_mutex_exit();
+u8 dataflash_erase_all(u8 tag)
+{
+    return df_submit(DF_OP_ERASE_ALL, 0, 0, NULL, tag, 0);
 }
 
-void buffer_byte_consumer(u8 byte, u16 index, u16 ctx)
+u8 dataflash_erase_block(flash_offset_t byte_offset, u8 tag)
 {
-    u8 *buf = (u8 *)ctx;
-    buf[index] = byte;
+    return df_submit(DF_OP_ERASE_BLOCK, byte_offset & ~(DF_BLOCK_SIZE-1), 0, NULL, tag, 0);
 }
 
-void dataflash_read_range(flash_offset_t byte_offset, u16 length, u8 *read_buf)
+/* Whole pages, spare octets and all, through a chip buffer; nothing
+ * crosses the SPI bus but commands. */
+u8 dataflash_copy(flash_offset_t from, flash_offset_t to, u8 pages, u8 tag)
 {
-    dataflash_read_range_to_consumer(byte_offset, length, 
-            buffer_byte_consumer, (u16)read_buf);
+    if (!pages)
+    {
+        return 1;
+    }
+    to &= ~(flash_offset_t)(DF_PAGE_DATA-1);
+    return df_submit(DF_OP_COPY, from & ~(flash_offset_t)(DF_PAGE_DATA-1), pages, (u8 *)&to, tag, 0);
 }
 
-void dataflash_read_range_to_consumer(flash_offset_t byte_offset, u16 length, 
+u8 dataflash_hash(flash_offset_t byte_offset, u8 count, u8 shift, u8 *hashes, u8 tag)
+{
+    if (!count || shift > df_size_shift ||
+        (byte_offset & (((flash_offset_t)1 << shift) - 1)))
+    {
+        return 1;
+    }
+    return df_submit(DF_OP_HASH, byte_offset, count, hashes, tag, shift);
+}
+
+u8 dataflash_read_rle(flash_offset_t byte_offset, u16 length, u8 *data, u8 tag)
+{
+    if (!length || data[0] < 2)
+    {
+        return 1;
+    }
+    return df_submit(DF_OP_RLE, byte_offset, length, data, tag, length>>8);
+}
+
+u8 dataflash_queue_free()
+{
+    return DF_QUEUE_LEN - df_count;
+}
+
+/* Sums of the DF_OP_HASH unit in progress; there's only ever one. */
+static u16 df_hash_a, df_hash_b;
+
+static void df_hash_byte(u8 b, u16 i, u16 ctx)
+{
+    df_hash_a += b;
+    df_hash_b += df_hash_a;
+}
+
+/* DF_OP_RLE in progress: code goes in df_rle_code[1..df_rle_n] */
+static u8  *df_rle_code;
+static u16 df_rle_left;             /* octets still to take; 0 once full */
+static u16 df_rle_run;              /* octets of df_rle_v not yet coded */
+static u8  df_rle_v, df_rle_n;
+static u8  df_rle_lit;              /* open literal code, or 0 */
+
+/* Code octets a run would take if it ended now */
+static u8 df_rle_cost(u16 run)
+{
+    if (run >= 3)
+    {
+        return 3;
+    }
+    if (df_rle_lit && df_rle_code[df_rle_lit] + 1 + run <= DF_RLE_LITERAL_MAX)
+    {
+        return run;
+    }
+    return run + 1;
+}
+
+static void df_rle_flush()
+{
+    if (df_rle_run >= 3)
+    {
+        df_rle_code[++df_rle_n] = 0x80 | (df_rle_run-1)>>8;
+        df_rle_code[++df_rle_n] = df_rle_run-1;
+        df_rle_code[++df_rle_n] = df_rle_v;
+        df_rle_lit = 0;
+        df_rle_run = 0;
+    }
+    for(; df_rle_run; df_rle_run--)
+    {
+        if (df_rle_lit && df_rle_code[df_rle_lit] < DF_RLE_LITERAL_MAX-1)
+        {
+            df_rle_code[df_rle_lit]++;
+        }
+        else
+        {
+            df_rle_lit = ++df_rle_n;
+            df_rle_code[df_rle_lit] = 0;
+        }
+        df_rle_code[++df_rle_n] = df_rle_v;
+    }
+}
+
+/* Takes the octet only if everything taken so far can still be coded
+ * in the room left. */
+static void df_rle_byte(u8 b, u16 i, u16 ctx)
+{
+    if (!df_rle_left)
+    {
+        return;
+    }
+    if (!df_rle_run || b != df_rle_v || df_rle_run == DF_RLE_RUN_MAX)
+    {
+        df_rle_flush();
+        df_rle_v = b;
+    }
+    if (df_rle_n + df_rle_cost(df_rle_run + 1) > df_rle_code[0])
+    {
+        df_rle_left = 0;
+        return;
+    }
+    df_rle_run++;
+    df_rle_left--;
+}
+
+/* One step of the operation at the head of the queue.  The chip is ready. */
+static void df_step(df_op_t *op)
+{
+    flash_offset_t unit;
+    u16 n;
+    u8 f, i;
+
+    switch (op->type)
+    {
+        case DF_OP_READ:
+            f = disable_interrupts();
+            dataflash_read_range(op->addr, op->length, op->data.dst);
+            restore_flags(f);
+            op->step = DF_STEP_DONE;
+            break;
+            
+        case DF_OP_ERASE_ALL:
+        case DF_OP_ERASE_BLOCK:
+            f = disable_interrupts();
+            df_select();
+            spi_write(BLOCK_ERASE);
+            spi_write_addr(op->addr);
+            df_deselect();
+            restore_flags(f);
+            op->addr += DF_BLOCK_SIZE;
+            if (op->type == DF_OP_ERASE_BLOCK || op->addr >= DF_SIZE)
+            {
+                op->step = DF_STEP_DONE;
+            }
+            break;
+            
+        case DF_OP_WRITE:
+        case DF_OP_WRITE_BUF:
+            f = disable_interrupts();
+            if (op->step == 0)
+            {
+                /* Load the page into whichever buffer the logger isn't
+                 * using, while the page it's filling is no more than half
+                 * full: that buffer is the one the logger goes on to
+                 * next, and this way it's programmed and free again
+                 * first. */
+                single_buffer_release();
+                if (buf_state[append_buf] == BUF_FILLING && 
+                    buf_fill[append_buf] > DF_PAGE_DATA/2)
+                {
+                    restore_flags(f);
+                    break;
+                }
+                for(i=BUFFER_1; i<=BUFFER_2; i++)
+                {
+                    if (buf_state[i] == BUF_FREE)
+                    {
+                        buf_state[i] = BUF_RESERVED;
+                        op->buf = i;
+                        df_select();
+                        spi_write(i == BUFFER_1 ? MM_PAGE_TO_B1_XFER : MM_PAGE_TO_B2_XFER);
+                        spi_write_addr(op->addr);
+                        df_deselect();
+                        op->step = 1;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                df_select();
+                spi_write(buffer_write_op(op->buf));
+                spi_write_addr(op->addr);
+                for(i=0; i<op->length; i++)
+                {
+                    spi_write(op->type == DF_OP_WRITE ? op->data.src[i] : op->data.dst[i]);
+                }
+                df_deselect();
+                
+                df_select();
+                spi_write(op->buf == BUFFER_1 ? B1_TO_MM_PAGE_PROG_WITH_ERASE : 
+                                                B2_TO_MM_PAGE_PROG_WITH_ERASE);
+                spi_write_addr(op->addr);
+                df_deselect();
+                op->step = DF_STEP_DONE;
+            }
+            restore_flags(f);
+            break;
+
+        case DF_OP_HASH:
+            /* DF_SCAN_CHUNK at a time, so interrupts aren't held off for
+             * a whole unit. */
+            unit = (flash_offset_t)1 << op->buf;
+            if (!(op->addr & (unit-1)))
+            {
+                df_hash_a = df_hash_b = 0;
+            }
+            n = unit - (op->addr & (unit-1)) < DF_SCAN_CHUNK ?
+                unit - (op->addr & (unit-1)) : DF_SCAN_CHUNK;
+            f = disable_interrupts();
+            dataflash_read_range_to_consumer(op->addr, n, df_hash_byte, 0);
+            restore_flags(f);
+            op->addr += n;
+            if (!(op->addr & (unit-1)))
+            {
+                op->data.dst[0] = df_hash_a;
+                op->data.dst[1] = df_hash_a>>8;
+                op->data.dst[2] = df_hash_b;
+                op->data.dst[3] = df_hash_b>>8;
+                op->data.dst += 4;
+                if (!--op->length)
+                {
+                    op->step = DF_STEP_DONE;
+                }
+            }
+            break;
+
+        case DF_OP_RLE:
+            if (op->step == 0)
+            {
+                df_rle_code = op->data.dst;
+                df_rle_left = (u16)op->buf<<8 | op->length;
+                df_rle_run  = 0;
+                df_rle_n    = 0;
+                df_rle_lit  = 0;
+                op->step = 1;
+            }
+            n = df_rle_left < DF_SCAN_CHUNK ? df_rle_left : DF_SCAN_CHUNK;
+            f = disable_interrupts();
+            dataflash_read_range_to_consumer(op->addr, n, df_rle_byte, 0);
+            restore_flags(f);
+            op->addr += n;
+            if (!df_rle_left)
+            {
+                df_rle_flush();
+                df_rle_code[0] = df_rle_n;
+                op->step = DF_STEP_DONE;
+            }
+            break;
+
+        case DF_OP_COPY:
+            /* A buffer at a time, given back between pages so the
+             * logger can keep appending. */
+            f = disable_interrupts();
+            if (op->step == 0)
+            {
+                single_buffer_release();
+                for(i=BUFFER_1; i<=BUFFER_2; i++)
+                {
+                    if (buf_state[i] == BUF_FREE)
+                    {
+                        buf_state[i] = BUF_RESERVED;
+                        op->buf = i;
+                        df_select();
+                        spi_write(i == BUFFER_1 ? MM_PAGE_TO_B1_XFER : MM_PAGE_TO_B2_XFER);
+                        spi_write_addr(op->addr);
+                        df_deselect();
+                        op->step = 1;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                df_select();
+                spi_write(op->buf == BUFFER_1 ? B1_TO_MM_PAGE_PROG_WITH_ERASE : 
+                                                B2_TO_MM_PAGE_PROG_WITH_ERASE);
+                spi_write_addr(op->data.to);
+                df_deselect();
+                buf_state[op->buf] = BUF_PROGRAMMING;
+                op->addr    += DF_PAGE_DATA;
+                op->data.to += DF_PAGE_DATA;
+                op->step = --op->length ? 0 : DF_STEP_DONE;
+            }
+            restore_flags(f);
+            break;
+    }
+}
+
+/******************************************************************************
+* dataflash_poll
+*        Called on every pass of the datalogger task.  Does nothing while the
+*        chip is busy; otherwise starts one thing: a page program if one is
+*        waiting (the logger needs its buffer back), else the next step of
+*        the queued operation.  A finished operation is reported to the
+*        datalogger task before it leaves the queue, retrying while the
+*        mailbox is full.
+*******************************************************************************/
+void dataflash_poll()
+{
+    df_op_t *op;
+    u8 f, b;
+
+    f = disable_interrupts();
+    if (!(dataflash_read_status_reg() & 0x80))
+    {
+        restore_flags(f);
+        return;
+    }
+
+    /* ready, so anything that was programming is done */
+    for(b=BUFFER_1; b<=BUFFER_2; b++)
+    {
+        if (buf_state[b] == BUF_PROGRAMMING)
+        {
+            buf_state[b] = BUF_FREE;
+        }
+    }
+    restore_flags(f);
+    
+    for(b=BUFFER_1; b<=BUFFER_2; b++)
+    {
+        if (buf_state[b] == BUF_QUEUED)
+        {
+            buffer_program(b);
+            return;
+        }
+    }
+
+    if (!df_count)
+    {
+        return;
+    }
+    
+    op = &df_queue[df_head];
+    if (op->step != DF_STEP_DONE)
+    {
+        df_step(op);
+        return;
+    }
+
+    if (op->tag && 
+        send_to_task(TASK_ID_DATALOGGER, FLASH_CMD_OP_DONE, 1, &op->tag))
+    {
+        return;
+    }
+    
+    f = disable_interrupts();
+    if (op->type == DF_OP_WRITE || op->type == DF_OP_WRITE_BUF)
+    {
+        buf_state[op->buf] = BUF_FREE;
+    }
+    df_head = (df_head + 1) % DF_QUEUE_LEN;
+    --df_count;
+    restore_flags(f);
+}
+
+/******************************************************************************
+* Continuous array read
+*        One 0x68 command reads on through the whole range.  The array is
+*        addressed in whole pages, so the DF_PAGE_SPARE bytes at the end of
+*        each page are clocked through and dropped.  The next byte is
+*        clocked out while the last one is stored, which at Fosc/2 leaves
+*        the loop waiting on the SPI only briefly.  Into read_buf, or to
+*        consumer_f if read_buf is 0.
+*******************************************************************************/
+static void read_array(flash_offset_t byte_offset, u16 length, u8 *read_buf,
         byte_consumer_func_t consumer_f, u16 consumer_ctx)
 {
-    u16 i;
-    if (df_mutex_enter())
+    u16 i = 0, n;
+    u8 b;
+    
+    if (!length || df_mutex_enter())
     {
         return;
     }
-        
-next_page:
     wait_for_ready();
     
     df_select();
@@ -299,33 +959,49 @@ next_page:
     spi_write(0);
     spi_write(0);
     spi_write(0);
-    
-    for(i=0; i<length; i++)
+
+    SPDR = 0;
+    for(;;)
     {
-#if 0
-        /* array reads use 264 byte pages... must recompute address OR we
-         * could just do dummy reads here. */
-        if ((byte_offset + i)>>8 != byte_offset>>8)
+        /* up to the end of this page */
+        n = DF_PAGE_DATA - ((byte_offset + i) & (DF_PAGE_DATA-1));
+        if (n > length - i)
         {
-            length -= i;
-            byte_offset += i;
-            df_deselect();
-            goto next_page;
+            n = length - i;
         }
-#endif   
-        spi_write(0);
-        consumer_f(spi_read(), i, consumer_ctx);
-
-        /* dummy reads */
-        if (((byte_offset+i)&0xFF)==0xFF)
+        n += i;
+        while (i < n)
         {
-            u8 z;
-            for(z=0; z<8; z++)                
+            while (!(SPSR & (1<<SPIF)))
+                ;
+            b = SPDR;
+            if (i+1 < length)
+            {
+                SPDR = 0;
+            }
+            if (read_buf)
             {
-                spi_write(0);
-                spi_read();
+                read_buf[i] = b;
             }
-        }            
+            else
+            {
+                consumer_f(b, i, consumer_ctx);
+            }
+            i++;
+        }
+        if (i == length)
+        {
+            break;
+        }
+
+        /* the page's spare bytes; the byte in flight is the first */
+        for(b=0; b<DF_PAGE_SPARE; b++)
+        {
+            while (!(SPSR & (1<<SPIF)))
+                ;
+            SPDR;
+            SPDR = 0;
+        }
     }
 
     df_deselect();
@@ -333,4 +1009,44 @@ next_page:
     df_mutex_exit();
 }
 
+void dataflash_read_range(flash_offset_t byte_offset, u16 length, u8 *read_buf)
+{
+    read_array(byte_offset, length, read_buf, 0, 0);
+}
+
+/* The tag dataflash_append() gave the page holding byte_offset.  Waits
+ * like dataflash_read_range(). */
+u16 dataflash_page_tag(flash_offset_t byte_offset)
+{
+    u16 tag;
+
+    if (df_mutex_enter())
+    {
+        return 0xFFFF;
+    }
+    wait_for_ready();
+
+    df_select();
+    spi_write(0x68);
+    spi_write_addr24((u32)(byte_offset >> df_page_shift) << df_addr_shift | DF_PAGE_TAG);
+    spi_write(0);
+    spi_write(0);
+    spi_write(0);
+    spi_write(0);
+    spi_write(0);
+    tag = spi_read();
+    spi_write(0);
+    tag |= (u16)spi_read()<<8;
+    df_deselect();
+
+    df_mutex_exit();
+    return tag;
+}
+
+void dataflash_read_range_to_consumer(flash_offset_t byte_offset, u16 length, 
+        byte_consumer_func_t consumer_f, u16 consumer_ctx)
+{
+    read_array(byte_offset, length, 0, consumer_f, consumer_ctx);
+}
+
 
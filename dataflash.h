@@ -31,18 +31,89 @@ typedef u32 flash_offset_t;
 
 void dataflash_init();
 
-void dataflash_write(flash_offset_t byte_offset, u8 length, u8 *data);
+/* Flash operations are queued and carried out a step at a time by
+ * dataflash_poll(), so nothing waits on the busy flag.  A submit returns
+ * nonzero if the queue is full.  With a nonzero tag the datalogger task
+ * gets FLASH_CMD_OP_DONE, with the tag as payload, when the operation is
+ * finished.  Writes are copied into the queue and must stay within a page;
+ * a read's buffer must stay valid until it's done.  dataflash_write_buf()
+ * is for writes too long to copy: up to the rest of the page, from a
+ * buffer that, as a read's, must stay valid until it's done. */
+#define DF_QUEUE_LEN    4
+#define DF_WRITE_MAX    8
+
+/* dataflash_hash() puts 4 octets in hashes for each of count units of
+ * 1 << shift octets from byte_offset (a multiple of the unit): the
+ * Fletcher sums A (of the octets) and B (of A), 16 bits each, both from
+ * 0, little endian A then B.  Hashes and run length reads go through the
+ * flash DF_SCAN_CHUNK octets a step. */
+#define DF_SCAN_CHUNK   32
+
+/* dataflash_read_rle() codes as much of length octets from byte_offset
+ * as fits in data[0] octets (2 at least) from data[1], and sets data[0]
+ * to the octets of code.  Codes are
+ *   0nnnnnnn, n+1 octets                   n+1 literal octets
+ *   1nnnnnnn nnnnnnnn, v                   n+1 octets of v
+ * so erased flash goes at 10 KB an octet. */
+#define DF_RLE_LITERAL_MAX  128
+#define DF_RLE_RUN_MAX      32768
+
+u8 dataflash_read(flash_offset_t byte_offset, u8 length, u8 *data, u8 tag);
+u8 dataflash_write(flash_offset_t byte_offset, u8 length, u8 *data, u8 tag);
+u8 dataflash_write_buf(flash_offset_t byte_offset, u8 length, u8 *data, u8 tag);
+u8 dataflash_erase_all(u8 tag);
+u8 dataflash_erase_block(flash_offset_t byte_offset, u8 tag);   /* 2 KB */
+u8 dataflash_copy(flash_offset_t from, flash_offset_t to, u8 pages, u8 tag);
+u8 dataflash_hash(flash_offset_t byte_offset, u8 count, u8 shift, u8 *hashes, u8 tag);
+u8 dataflash_read_rle(flash_offset_t byte_offset, u16 length, u8 *data, u8 tag);
+u8 dataflash_queue_free();
+void dataflash_poll();
+
+/* Sequential writes for logging.  Data collects in one of the chip's
+ * SRAM buffers and the page is only programmed (by dataflash_poll()) once
+ * it fills, or after dataflash_append_flush().  Whatever follows the last
+ * byte appended to a page, or precedes the first, is left erased.  The
+ * two buffers take turns so appending carries on while the previous page
+ * programs; if that program still hasn't finished when the next page is
+ * needed, dataflash_append() returns nonzero.  Until it is programmed the
+ * page being filled still reads back as its old contents. */
+u8 dataflash_append(flash_offset_t byte_offset, u8 length, u8 *data);
+void dataflash_append_flush();
+
+/* Geometry, read from the density bits of the status register by
+ * dataflash_init(): AT45DB011 to DB081 have 264 byte pages, DB161 and
+ * DB321 528, DB642 1056.  Offsets are linear over the first DF_PAGE_DATA
+ * of each (page << df_page_shift | byte), so pages and erase blocks fall
+ * on powers of two, and reads skip the spare bytes.  The spare bytes
+ * aren't wasted: the append path tags each page there.  Binary page mode
+ * would take them away, and can't be undone on the parts that have it. */
+extern u8 df_density;               /* status register bits 5:2 */
+extern u8 df_page_shift;            /* log2 DF_PAGE_DATA */
+extern u8 df_size_shift;            /* log2 DF_SIZE */
+
+#define DF_PAGE_DATA    ((u16)1 << df_page_shift)
+#define DF_PAGE_SPARE   (DF_PAGE_DATA / 32)
+#define DF_PAGE_TAG     DF_PAGE_DATA            /* 16 bits, LE */
+#define DF_BLOCK_SHIFT  (df_page_shift + 3)     /* 8 pages */
+#define DF_BLOCK_SIZE   ((flash_offset_t)1 << DF_BLOCK_SHIFT)
+#define DF_SIZE         ((flash_offset_t)1 << df_size_shift)
+
+/* Pages programmed by the append path carry a 16 bit tag at DF_PAGE_TAG.
+ * The tag in force when a page is started is the one it gets. */
+void dataflash_append_tag(u16 tag);
 
 u8 dataflash_read_status_reg();
 void dataflash_buffer_write(u8 byte, u8 addr);
 u8 dataflash_buffer_read(u8 addr);
+
+/* Immediate reads, waiting for the chip: only while nothing is queued. */
 void dataflash_read_range(flash_offset_t addr, u16 length, u8 *read_buf);
+u16 dataflash_page_tag(flash_offset_t byte_offset);
 
 typedef void (*byte_consumer_func_t)(u8, u16, u16);
 
 void dataflash_read_range_to_consumer(flash_offset_t byte_offset, u16 length, 
         byte_consumer_func_t consumer_f, u16 consumer_ctx);
-void dataflash_erase_all();
 
 
 /* from AVR335 */
@@ -29,13 +29,56 @@
 #include "userinterface.h"
 #include "audiradio.h"
 #include "output.h"
+#include "persist.h"
+#include "boost.h"
+#include "egt.h"
+#include "fuelpressure5v.h"
+
+#if TIMEBASE_HZ != LOG_TIME_HZ
+#error "LOG_TIME_HZ doesn't match the timebase"
+#endif
 
 task_t dl_taskinfo;
 static u8 dl_mailbox_buf[20];
 
 u8 sampling_flag;
+static u8 erasing_flag;
+
+/* dataflash op tags, besides the FLASH_CMD_ codes that have replies */
+#define TAG_RING    0x10
+#define TAG_TRIG    0x11
+#define TAG_PREVIEW 0x12    /* + level */
+
+/* The one READ_RANGE, READ_BYTE, HASH_RANGE or READ_RLE waiting on the
+ * flash queue; a READ_RLE reply is FLASH_RLE_MAX (READ_MAX-1) octets at
+ * most, after its length. */
+#define READ_MAX    15      /* 64 here used to overflow the stack silently */
+static u8 read_buf[READ_MAX];
+static u8 read_len;
+static u8 read_pending;
 
 u8 dl_task();
+static void ring_poll();
+static void ring_op_done();
+static inline u8 ring_busy();
+static void policy_load();
+static flash_err_t policy_set(u8 *entry);
+static inline u8 policy_pass(u8 type, u8 length, u8 *data);
+static void trig_load();
+static flash_err_t trig_set(u8 *rule);
+static void trig_poll();
+static void trig_op_done();
+static void log_start();
+static void log_stop();
+static inline u8 log_running();
+static void stage_drain();
+static void stats_reset();
+static u8 stats_write();
+static void stage_stats(u8 *stats);
+static void preview_init();
+static void preview_reset();
+static void preview_close(u8 level);
+static void preview_op_done(u8 level);
 u8 datalogger_display_func(ui_mode_t mode, ui_display_event_t event);
 static inline u8 datalogger_config_func(ui_mode_t mode, ui_display_event_t event);
 
@@ -43,6 +86,8 @@ task_t *data_logger_task_create()
 {
     dataflash_init();
     datalogger_init();
+    policy_load();
+    trig_load();
     
     register_display_mode(MODE_DATALOGGER, datalogger_display_func);
 
@@ -52,34 +97,94 @@ task_t *data_logger_task_create()
 void msgtx_byte_consumer(u8 byte, u16 index, u16 ctx)
 {
     fcsum_t *fcs = (fcsum_t *)ctx;
-    tx_csum_and_escape(byte, fcs);
+    tx_csum_and_escape(&uart_link, byte, fcs);
+}
+
+static void dl_op_done(u8 tag)
+{
+    u8 v;
+
+    switch (tag)
+    {
+        case FLASH_CMD_READ_RANGE:
+            send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RANGE, 
+                    read_len, read_buf);
+            read_pending = 0;
+            break;
+        case FLASH_CMD_READ_BYTE:
+            send_msg(&uart_link, 0xF, 0x57, 1, read_buf);
+            read_pending = 0;
+            break;
+        case FLASH_CMD_HASH_RANGE:
+            send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_HASH_RANGE,
+                    read_len, read_buf);
+            read_pending = 0;
+            break;
+        case FLASH_CMD_READ_RLE:
+            send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RLE,
+                    read_buf[0], read_buf+1);
+            read_pending = 0;
+            break;
+        case FLASH_CMD_INITIALIZE:
+            erasing_flag = 0;
+            datalogger_init();
+            v = 1;
+            send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_INITIALIZE, 
+                    1, &v);
+            break;
+        case TAG_RING:
+            ring_op_done();
+            break;
+        case TAG_TRIG:
+            trig_op_done();
+            break;
+        case TAG_PREVIEW:
+        case TAG_PREVIEW+1:
+            preview_op_done(tag - TAG_PREVIEW);
+            break;
+    }
 }
 
 u8 dl_task()
 {
     u8 payload_len, code;
 
+    dataflash_poll();
+    stage_drain();
+    ring_poll();
+    trig_poll();
+
     if (mailbox_head(&dl_taskinfo.mailbox, &code, &payload_len))
     {
         flash_err_t err = 0;
         switch(code)
         {
+            case FLASH_CMD_OP_DONE:
+                {
+                    u8 tag;
+                    mailbox_copy_payload(&dl_taskinfo.mailbox, &tag, 1, 0);
+                    dl_op_done(tag);
+                }
+                break;
             case FLASH_CMD_READ_SPCR:
                 {
                     u8 v[] = {SPCR, SPSR};
-                    send_msg(BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_SPCR, 
+                    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_SPCR, 
                             2, v);
                 }
                 break;
             case FLASH_CMD_INITIALIZE:
                 {
                     u8 v = 0;
-                    send_msg(BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_INITIALIZE, 
-                            1, &v);
-                    dataflash_erase_all();
-                    datalogger_init();
-                    v=1;
-                    send_msg(BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_INITIALIZE, 
+                    /* 1 follows from dl_op_done once the erase finishes */
+                    if (log_running() || erasing_flag || ring_busy() ||
+                        dataflash_erase_all(FLASH_CMD_INITIALIZE))
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
+                    erasing_flag = 1;
+                    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_INITIALIZE, 
                             1, &v);
                 }
                 break;
@@ -98,13 +203,13 @@ u8 dl_task()
                     addr = ((flash_offset_t)addrbuf[0]<<16) | ((flash_offset_t)addrbuf[1]<<8) | 
                             ((flash_offset_t)addrbuf[2]);
 
-                    fcsum_t fcs = send_msghdr(BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_PAGE, 
+                    fcsum_t fcs = send_msghdr(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_PAGE, 
                                 FLASH_PAGE_SIZE);
                     
                     dataflash_read_range_to_consumer(addr, FLASH_PAGE_SIZE, msgtx_byte_consumer,
                             (u16)(&fcs));
                     
-                    send_msgfcs(fcs);
+                    send_msgfcs(&uart_link, fcs);
                     break;
                 }
 #endif
@@ -112,20 +217,23 @@ u8 dl_task()
                 {
                     flash_offset_t addr;                    
                     u8 len;
-                    const u8 maxsz = 15; /* 64 here overflows the stack silently */
-                    const flash_offset_t flashsz = 512*1024L;
-                    u8 msgbuf[maxsz];
+                    u8 msgbuf[4];
 
                     if (payload_len != 4)
                     {
                         err = FLASH_ERR_BAD_PARAMS;
                         break;
                     }
+                    if (read_pending)
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
                     /* Read stack pointer.  This seems to be the deepest in the stack
                      * we get.  Currently with maxsz = 15 above we just barely graze the
                      * buffer pool.  */
                     //asm volatile ("in %0, __SP_H__\n in %1, __SP_L__" : "=r"(payload[0]), "=r"(payload[1]));
-                    //send_msg(0xF, 0xEA, 2, payload);
+                    //send_msg(&uart_link, 0xF, 0xEA, 2, payload);
                     
                     
                     mailbox_copy_payload(&dl_taskinfo.mailbox, msgbuf, 4, 0);
@@ -134,25 +242,29 @@ u8 dl_task()
                             ((flash_offset_t)msgbuf[2]);
                     len = msgbuf[3];
 
-                    if (len > maxsz)
+                    if (len > READ_MAX)
                     {
                         err = FLASH_ERR_TOO_LARGE;
                         break;
                     }
-                    if (addr > (flashsz-len))
+                    if (addr > (DF_SIZE-len))
                     {
                         err = FLASH_ERR_BAD_ADDR;
                         break;
                     }
 
 //                    u8 dbg[] = {addr>>16,addr>>8,addr,len};
-//                    send_msg(0xF, 0xea, sizeof(dbg), dbg);
+//                    send_msg(&uart_link, 0xF, 0xea, sizeof(dbg), dbg);
 
                     
-                    dataflash_read_range(addr, len, msgbuf);
-                    
-                    send_msg(BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RANGE, 
-                            len, msgbuf);
+                    /* replied to from dl_op_done */
+                    if (dataflash_read(addr, len, read_buf, FLASH_CMD_READ_RANGE))
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
+                    read_len = len;
+                    read_pending = 1;
                     break;
                 }
 #if 0
@@ -176,7 +288,7 @@ u8 dl_task()
                 {
                     u8 buf[4];
                     mailbox_copy_payload(&dl_taskinfo.mailbox, buf, 4, 0);
-                    log_data_sample(0x77, payload_len, buf);
+                    log_data_sample(DATA_TYPE_USER, payload_len, buf);
                 }
                 break;
 #endif
@@ -185,12 +297,154 @@ u8 dl_task()
                 {
                     u8 msgbuf[3];
                     flash_offset_t addr;
-                    u8 ret;
+                    if (read_pending)
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
                     mailbox_copy_payload(&dl_taskinfo.mailbox, msgbuf, 3, 0);
                     addr = ((flash_offset_t)msgbuf[0]<<16) | ((flash_offset_t)msgbuf[1]<<8) | 
                             ((flash_offset_t)msgbuf[2]);
-                    dataflash_read_range(addr, 1, &ret);
-                    send_msg(0xF, 0x57, 1, &ret);
+                    if (dataflash_read(addr, 1, read_buf, FLASH_CMD_READ_BYTE))
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
+                    read_pending = 1;
+                    break;
+                }
+
+            case FLASH_CMD_HASH_RANGE:
+                {
+                    u8 msgbuf[5];
+                    flash_offset_t addr;
+
+                    if (payload_len != 5)
+                    {
+                        err = FLASH_ERR_BAD_PARAMS;
+                        break;
+                    }
+                    if (read_pending)
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
+                    mailbox_copy_payload(&dl_taskinfo.mailbox, msgbuf, 5, 0);
+                    addr = ((flash_offset_t)msgbuf[0]<<16) | ((flash_offset_t)msgbuf[1]<<8) |
+                            ((flash_offset_t)msgbuf[2]);
+
+                    if (!msgbuf[3] || msgbuf[3] > FLASH_HASH_MAX)
+                    {
+                        err = FLASH_ERR_TOO_LARGE;
+                        break;
+                    }
+                    if (msgbuf[4] > df_size_shift ||
+                        (addr & (((flash_offset_t)1 << msgbuf[4]) - 1)) ||
+                        addr + ((flash_offset_t)msgbuf[3] << msgbuf[4]) > DF_SIZE)
+                    {
+                        err = FLASH_ERR_BAD_ADDR;
+                        break;
+                    }
+                    /* replied to from dl_op_done */
+                    if (dataflash_hash(addr, msgbuf[3], msgbuf[4], read_buf, FLASH_CMD_HASH_RANGE))
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
+                    read_len = 4 * msgbuf[3];
+                    read_pending = 1;
+                    break;
+                }
+
+            case FLASH_CMD_READ_RLE:
+                {
+                    u8 msgbuf[5];
+                    flash_offset_t addr;
+                    u16 len;
+
+                    if (payload_len != 5)
+                    {
+                        err = FLASH_ERR_BAD_PARAMS;
+                        break;
+                    }
+                    if (read_pending)
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
+                    mailbox_copy_payload(&dl_taskinfo.mailbox, msgbuf, 5, 0);
+                    addr = ((flash_offset_t)msgbuf[0]<<16) | ((flash_offset_t)msgbuf[1]<<8) |
+                            ((flash_offset_t)msgbuf[2]);
+                    len = msgbuf[3]<<8 | msgbuf[4];
+
+                    if (!len)
+                    {
+                        err = FLASH_ERR_BAD_PARAMS;
+                        break;
+                    }
+                    if (addr > DF_SIZE - len)
+                    {
+                        err = FLASH_ERR_BAD_ADDR;
+                        break;
+                    }
+                    /* replied to from dl_op_done, the code after its length */
+                    read_buf[0] = FLASH_RLE_MAX;
+                    if (dataflash_read_rle(addr, len, read_buf, FLASH_CMD_READ_RLE))
+                    {
+                        err = FLASH_ERR_BUSY;
+                        break;
+                    }
+                    read_pending = 1;
+                    break;
+                }
+
+            case FLASH_CMD_SET_TRIGGER:
+                {
+                    u8 msgbuf[4];
+
+                    if (payload_len != 4)
+                    {
+                        err = FLASH_ERR_BAD_PARAMS;
+                        break;
+                    }
+                    mailbox_copy_payload(&dl_taskinfo.mailbox, msgbuf, 4, 0);
+                    err = trig_set(msgbuf);
+                    break;
+                }
+
+            case FLASH_CMD_GET_INFO:
+                {
+                    u8 info[3];
+
+                    info[0] = df_density;
+                    info[1] = df_page_shift;
+                    info[2] = df_size_shift;
+                    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_INFO, 
+                            sizeof(info), info);
+                    break;
+                }
+
+            case FLASH_CMD_GET_STATS:
+                {
+                    u8 stats[6];
+
+                    stage_stats(stats);
+                    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_STATS, 
+                            sizeof(stats), stats);
+                    break;
+                }
+
+            case FLASH_CMD_SET_POLICY:
+                {
+                    u8 msgbuf[1+LOG_POLICY_SIZE];
+
+                    if (payload_len != sizeof(msgbuf))
+                    {
+                        err = FLASH_ERR_BAD_PARAMS;
+                        break;
+                    }
+                    mailbox_copy_payload(&dl_taskinfo.mailbox, msgbuf, sizeof(msgbuf), 0);
+                    err = policy_set(msgbuf);
                     break;
                 }
             default:
@@ -198,7 +452,7 @@ u8 dl_task()
         }
         if (err != 0)
         {
-            send_msg(BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_ERROR, 1, (u8*)&err);
+            send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_ERROR, 1, (u8*)&err);
         }        
         
         mailbox_advance(&dl_taskinfo.mailbox);
@@ -215,174 +469,1597 @@ delta_time_t        last_sample_time;
 
 logged_data_descriptor_t active_desc;
 
-void datalogger_init()
+/* v2 record being assembled.  Values are kept in channel order. */
+static u16          rec_mask;
+static delta_time_t rec_time;
+static u8           rec_len;
+static u8           rec_vals[LOG_V2_MAX_VALUES];
+static u16          records_lost;       /* flash not ready for them */
+
+/* Running statistics of the session, per channel; see LOG_STATS_MAGIC */
+static u16          stat_min[LOG_MAX_CHANNELS];
+static u16          stat_max[LOG_MAX_CHANNELS];
+static u32          stat_count[LOG_MAX_CHANNELS];
+static u32          stat_sum[LOG_MAX_CHANNELS];
+static u8           stat_sum_hi[LOG_MAX_CHANNELS];
+
+/* Preview buckets being gathered, and where each level writes next; see
+ * LOG_PREVIEW_TAG.  A level's record stays in pv_out until the flash
+ * has it. */
+static flash_offset_t   pv_head[LOG_PREVIEW_LEVELS];
+static delta_time_t     pv_start[LOG_PREVIEW_LEVELS];   /* of the bucket */
+static u16              pv_bucket[LOG_PREVIEW_LEVELS];
+static u16              pv_mask[LOG_PREVIEW_LEVELS];
+static u16              pv_min[LOG_PREVIEW_LEVELS][LOG_MAX_CHANNELS];
+static u16              pv_max[LOG_PREVIEW_LEVELS][LOG_MAX_CHANNELS];
+static u8               pv_out[LOG_PREVIEW_LEVELS][LOG_PREVIEW_MAX];
+static u8               pv_busy;        /* levels whose pv_out is queued */
+static u8               pv_started;     /* the session has had a sample */
+
+/* Samples waiting for dl_task, one ring per producer context so each has
+ * a single producer and the drain needs no locking.  The producer only
+ * moves tail and the consumer only head. */
+typedef struct {
+    delta_time_t    t;
+    u8              type;
+    u8              length;
+    u8              data[LOG_USER_MAX];
+} staged_sample_t;
+
+typedef struct {
+    staged_sample_t *entry;
+    u8              mask;               /* entries - 1, a power of two less one */
+    volatile u8     head;
+    volatile u8     tail;
+    u16             dropped;            /* full when a sample came */
+} stage_ring_t;
+
+static staged_sample_t  stage_isr_buf[LOG_STAGE_ISR_LEN];
+static staged_sample_t  stage_task_buf[LOG_STAGE_TASK_LEN];
+static stage_ring_t     stage_isr  = { stage_isr_buf,  LOG_STAGE_ISR_LEN-1 };
+static stage_ring_t     stage_task = { stage_task_buf, LOG_STAGE_TASK_LEN-1 };
+
+/* Per channel policy, by data type - 1, and where each channel is at. */
+static log_policy_t     policy[LOG_MAX_CHANNELS];
+static u16              policy_active;      /* channels with a policy */
+static u16              policy_fresh;       /* not logged yet this session */
+static u8               policy_count[LOG_MAX_CHANNELS];
+static timerinterval_t  policy_time[LOG_MAX_CHANNELS];
+static u16              policy_value[LOG_MAX_CHANNELS];
+
+/******************************************************************************
+* Ring upkeep
+*        ring_block is the next block to erase, one ahead of the block being
+*        written; nothing goes into it until the erase is done.  First the
+*        sessions from ring_retire on, oldest first, are checked against
+*        it: one wholly inside is retired, one that runs past it is trimmed
+*        to start after it, and the first one clear of it ends the check.
+*        Driven from dl_task a flash operation at a time.
+*******************************************************************************/
+typedef enum {
+    RING_IDLE,
+    RING_READ,              /* reading the descriptor of ring_retire */
+    RING_UPDATE,            /* rewriting it */
+    RING_ERASE,
+} ring_state_t;
+
+static u8                       ring_state;
+static u16                      ring_block;
+static log_index_t              ring_retire;
+static logged_data_descriptor_t ring_desc;
+
+/* Triggered logging, below */
+typedef enum {
+    TRIG_IDLE,
+    TRIG_ARMING,            /* waiting for the ring to make room */
+    TRIG_ARMED,             /* writing round the pre-trigger ring */
+    TRIG_FIRED,             /* logging until no rule has held for a while */
+} trig_state_t;
+
+static u8                       trig_state;
+static flash_offset_t           trig_base;      /* start of the pre-trigger ring */
+
+static inline u16 block_of(flash_offset_t offset)
 {
-    flash_offset_t offset = 0;
-    logged_data_descriptor_t desc;
-    u8 *buf = (u8*)&desc;
-    u8 didx;
-    
-    /* Read in all existing headers.  Stop when 0xFF is read. */
-    for(didx=0; didx<MAX_DESCRIPTORS; didx++)
-    {
-        dataflash_read_range(offset, sizeof(logged_data_descriptor_t), buf);
-        if (desc.flags != 0xDD)
-        {
-            break;
-        }
+    return offset >> DF_BLOCK_SHIFT;
+}
+
+static inline u16 next_block(u16 block)
+{
+    return block == LOG_BLOCKS-1 ? block_of(DATA_START_OFFSET) : block+1;
+}
 
-        next_available_index = desc.sequence_number+1;
-        next_available_data = desc.data_start_offset + desc.data_length;
-        offset += sizeof(desc);
+static inline u8 ring_busy()
+{
+    return ring_state != RING_IDLE;
+}
+
+/* How far round the ring to is from from */
+static inline u16 blocks_ahead(u16 from, u16 to)
+{
+    return (to + (LOG_BLOCKS-1) - from) % (LOG_BLOCKS-1);
+}
+
+/* Where a session following data that ends at offset starts: the next
+ * chip page (pages are tagged whole), or back at the start of the ring. */
+static flash_offset_t next_session_start(flash_offset_t offset)
+{
+    offset = (offset + DF_PAGE_DATA-1) & ~(flash_offset_t)(DF_PAGE_DATA-1);
+    if (offset < DATA_START_OFFSET || offset > DATA_END_OFFSET)
+    {
+        return DATA_START_OFFSET;
     }
+    return offset;
+}
 
-    if (next_available_index == 0)
+static void ring_erase()
+{
+    ring_state = RING_IDLE;
+    if (!dataflash_erase_block(ring_block * LOG_BLOCK_SIZE, TAG_RING))
     {
-        /* empty flash */
-        next_available_data = DATA_START_OFFSET;
+        ring_state = RING_ERASE;
     }
 }
-    
 
-log_index_t begin_sampling()
+/* Look at the next session that might be in the way.  If the queue is
+ * full this drops back to idle and ring_poll() picks it up again. */
+static void ring_next()
 {
-    if (next_available_index >= MAX_DESCRIPTORS)
+    ring_state = RING_IDLE;
+    if (ring_retire == next_available_index)
     {
-        return MAX_DESCRIPTORS;
+        ring_erase();
     }
-    
-    active_desc.flags = 0xDD;
-    active_desc.sequence_number = next_available_index++;
-    active_desc.data_start_offset = next_available_data;
-    active_desc.data_length = 0;
+    else if (!dataflash_read(LOG_DESC_SLOT(ring_retire) * sizeof(logged_data_descriptor_t),
+                sizeof(logged_data_descriptor_t), (u8 *)&ring_desc, TAG_RING))
+    {
+        ring_state = RING_READ;
+    }
+}
 
-    dataflash_write(active_desc.sequence_number * sizeof(logged_data_descriptor_t), 
-            sizeof(logged_data_descriptor_t), (u8 *)&active_desc);    
+/* Whether blocks ahead of the head still need erasing: normally just the
+ * next one, but arming wants room for the pre-trigger ring and for a
+ * copy of it. */
+static u8 ring_short()
+{
+    flash_offset_t head;
+    u16 hb, last;
 
-    sampling_flag = 1;
-    
-    return active_desc.sequence_number;
+    head = sampling_flag ? log_desc_start(&active_desc) + active_desc.data_length :
+                           next_session_start(next_available_data);
+    hb = block_of(head);
+    last = next_block(hb);
+    if (trig_state == TRIG_ARMING)
+    {
+        last = block_of(trig_base) + 2*LOG_PRETRIG_BLOCKS - 1;
+    }
+    return blocks_ahead(hb, ring_block) <= blocks_ahead(hb, last);
 }
-        
-void end_sampling()
+
+static void ring_poll()
 {
-    sampling_flag = 0;
-    
-    // interrupts off here
-    dataflash_write(active_desc.sequence_number * sizeof(logged_data_descriptor_t), 
-            sizeof(logged_data_descriptor_t), (u8 *)&active_desc);    
+    /* Armed, the pre-trigger ring looks after its own blocks. */
+    if (ring_state != RING_IDLE || erasing_flag || trig_state == TRIG_ARMED)
+    {
+        return;
+    }
 
-    next_available_data = active_desc.data_start_offset + active_desc.data_length;
+    if (ring_short())
+    {
+        ring_next();
+    }
 }
 
-static inline delta_time_t get_usec_time()
+static void ring_op_done()
 {
-    delta_time_t t;
+    flash_offset_t start, end, es, ee;
+    u8 active, f;
+
+    switch (ring_state)
+    {
+        case RING_READ:
+            es = ring_block * LOG_BLOCK_SIZE;
+            ee = es + LOG_BLOCK_SIZE;
+
+            f = disable_interrupts();
+            active = sampling_flag && ring_retire == log_desc_seq(&active_desc);
+            if (active)
+            {
+                ring_desc = active_desc;
+            }
+            restore_flags(f);
 
-    t = TICK_TO_MSEC(readtime()) * 1000;
-    t += SUBTICK_TO_USEC(readsubtick());
+            if (!log_desc_valid(ring_desc.flags) || 
+                log_desc_seq(&ring_desc) != ring_retire ||
+                log_desc_start(&ring_desc) + ring_desc.data_length <= DATA_START_OFFSET)
+            {
+                /* already gone, or from before the ring */
+                ring_retire = log_seq_next(ring_retire);
+                ring_next();
+                break;
+            }
 
-    return t;
+            start = log_desc_start(&ring_desc);
+            end   = start + (ring_desc.data_length ? ring_desc.data_length : 1);
+            if (start >= ee || end <= es)
+            {
+                /* clear, and so is everything newer */
+                ring_erase();
+                break;
+            }
+            
+            if (end > ee && ring_desc.data_length)
+            {
+                log_desc_set_start(&ring_desc, ee);
+                ring_desc.data_length = end - ee;
+                if (active)
+                {
+                    f = disable_interrupts();
+                    active_desc.data_length -= ee - log_desc_start(&active_desc);
+                    log_desc_set_start(&active_desc, ee);
+                    ring_desc = active_desc;
+                    restore_flags(f);
+                }
+            }
+            else if (active)
+            {
+                /* nothing logged yet; leave it be */
+                ring_erase();
+                break;
+            }
+            else
+            {
+                ring_desc.flags = LOG_DESC_FLAGS_RETIRED;
+            }
+            
+            ring_state = RING_IDLE;
+            if (!dataflash_write(LOG_DESC_SLOT(ring_retire) * sizeof(logged_data_descriptor_t),
+                    sizeof(logged_data_descriptor_t), (u8 *)&ring_desc, TAG_RING))
+            {
+                ring_state = RING_UPDATE;
+            }
+            break;
+            
+        case RING_UPDATE:
+            if (ring_desc.flags == LOG_DESC_FLAGS_RETIRED)
+            {
+                ring_retire = log_seq_next(ring_retire);
+            }
+            ring_next();
+            break;
+            
+        case RING_ERASE:
+            ring_block = next_block(ring_block);
+            ring_state = RING_IDLE;
+            break;
+    }
 }
 
-void log_data_sample(logged_data_type_t type, u8 length, u8 *data)
+/* Power lost while logging leaves a session without its length.  Every
+ * page it wrote carries its sequence number as the page tag, and they run
+ * unbroken from where the descriptor left it (its start, or the trigger
+ * for a triggered session), so the first page without it is found in a
+ * few reads however far it got. */
+static void recover_session(logged_data_descriptor_t *desc)
 {
-    const unsigned max_log_len = 4;
-    int i;
-    logged_data_sample_t *hdr;
-    u8 buf[sizeof(logged_data_sample_t) + max_log_len];
-    
-    if (!sampling_flag)
+    log_index_t seq = log_desc_seq(desc);
+    flash_offset_t start = log_desc_start(desc);
+    u16 lo, hi, mid;
+
+    lo = (start + desc->data_length) >> df_page_shift;
+    hi = (DATA_END_OFFSET+1) >> df_page_shift;
+    while (lo < hi)
     {
-        return;
+        mid = lo + (hi - lo)/2;
+        if (dataflash_page_tag((flash_offset_t)mid << df_page_shift) == seq)
+        {
+            lo = mid+1;
+        }
+        else
+        {
+            hi = mid;
+        }
     }
-    
-    hdr = (logged_data_sample_t *)buf;
-    for(i=0; i<length; i++)
-    {
-        buf[sizeof(*hdr) + i] = data[i];
-    }    
-    
-    if (length > max_log_len)
+
+    if ((flash_offset_t)lo << df_page_shift > start + desc->data_length)
     {
-        length = max_log_len;
+        desc->data_length = ((flash_offset_t)lo << df_page_shift) - start;
+        dataflash_write(LOG_DESC_SLOT(seq) * sizeof(logged_data_descriptor_t),
+                sizeof(logged_data_descriptor_t), (u8 *)desc, 0);
     }
-    
-    flash_offset_t offset = active_desc.data_start_offset + active_desc.data_length;
-    
-    if (offset + sizeof(*hdr) + length > DATA_END_OFFSET)
+}
+
+void datalogger_init()
+{
+    logged_data_descriptor_t desc, newest;
+    u16 slot;
+    u8 found = 0;
+
+    /* Slots are used in order and then reused, so the table ends at the
+     * first one never written.  One pass over block 0 at most. */
+    for(slot=0; slot<MAX_DESCRIPTORS; slot++)
     {
-        /* end of flash */
-        end_sampling();
-        return;
+        dataflash_read_range(slot * sizeof(desc), sizeof(desc), (u8 *)&desc);
+        if (desc.flags == LOG_DESC_FLAGS_ERASED)
+        {
+            break;
+        }
+        if (!log_desc_valid(desc.flags))
+        {
+            continue;
+        }
+        if (!found || log_seq_cmp(log_desc_seq(&desc), log_desc_seq(&newest)) > 0)
+        {
+            newest = desc;
+        }
+        if (!found || log_seq_cmp(log_desc_seq(&desc), ring_retire) < 0)
+        {
+            ring_retire = log_desc_seq(&desc);
+        }
+        found = 1;
     }
-    
-    hdr->flags = 0xA;
-    hdr->data_length = length;
-    hdr->data_type = type;
-    
-#if 0
-    if (active_desc.data_length)
+
+    if (found)
     {
-        /* not first sample */
-        hdr->time_delta_usec = last_sample_time - get_usec_time();
+        if (newest.flags != LOG_DESC_FLAGS_V1)
+        {
+            recover_session(&newest);
+        }
+        next_available_index = log_seq_next(log_desc_seq(&newest));
+        next_available_data = next_session_start(log_desc_end(&newest));
     }
     else
     {
-        hdr->time_delta_usec = 0;
+        /* empty flash */
+        next_available_index = 0;
+        ring_retire = 0;
+        next_available_data = DATA_START_OFFSET;
     }
-    last_sample_time = hdr->time_delta_usec;
-#else
-    hdr->time_delta_usec = get_usec_time();
-#endif
 
-    dataflash_write(offset, sizeof(*hdr)+length, buf);
+    /* The block ahead may not have been erased before power went. */
+    ring_state = RING_IDLE;
+    ring_block = next_block(block_of(next_available_data));
 
-    active_desc.data_length += sizeof(*hdr) + length;
+    preview_init();
 }
+    
 
-
-/* Change this to use output_number, etc.
- * Mode = M2
- * Flash log number when logging, otherwise hold solid.
- */
-
-u8 datalogger_display_func(ui_mode_t mode, ui_display_event_t event)
+/* Write the descriptor of a new session and log into it from its end. */
+static u8 start_session(flash_offset_t start, flash_offset_t length)
 {
-    number_display_flags_t dflags = CENTER_FLASH;
-    center_letter_t cflags;
-    s16 val;
+    active_desc.flags = LOG_DESC_FLAGS_V3;
+    log_desc_set_seq(&active_desc, next_available_index);
+    log_desc_set_start(&active_desc, start);
+    active_desc.data_length = length;
 
-    if (event >= IN_CONFIG)
-        return datalogger_config_func(mode, event);
-
-    if (sampling_flag)
+    if (dataflash_write(LOG_DESC_SLOT(next_available_index) * sizeof(logged_data_descriptor_t), 
+            sizeof(logged_data_descriptor_t), (u8 *)&active_desc, 0))
     {
-        cflags = CENTER_A;
-        val = active_desc.sequence_number;
+        /* flash queue full */
+        return 1;
     }
-    else
+    dataflash_append_tag(next_available_index);
+    next_available_index = log_seq_next(next_available_index);
+    policy_fresh = policy_active;
+    stats_reset();
+    preview_reset();
+
+    /* that slot's last session is gone */
+    if (((next_available_index - ring_retire) & LOG_SEQ_MASK) > MAX_DESCRIPTORS)
     {
-        cflags = CENTER_NONE;
-        val = next_available_index;
+        ring_retire = (next_available_index - MAX_DESCRIPTORS) & LOG_SEQ_MASK;
     }
 
-    output_number(mode, val, cflags, dflags);
+    sampling_flag = 1;
+    
     return 0;
 }
 
-static inline u8 datalogger_config_func(ui_mode_t mode, 
-                                        ui_display_event_t event)
+u8 begin_sampling()
 {
-    sampling_flag = !sampling_flag;
-    if (sampling_flag)
+    if (erasing_flag)
     {
-        begin_sampling();
+        return 1;
     }
-    else
-    {
+    rec_mask = 0;
+
+    /* v2 pages decode on their own, so start on a page */
+    return start_session(next_session_start(next_available_data), 0);
+}
+
+static void flush_record();
+        
+/* end_sampling() without taking in what's staged first; for the end of
+ * flash, when the drain is what got us here. */
+static void close_session()
+{
+    u8 f = disable_interrupts();
+    u8 stats;
+
+    flush_record();
+    stats = stats_write();
+    sampling_flag = 0;
+    dataflash_append_flush();
+    restore_flags(f);
+
+    if (stats == 0)
+    {
+        active_desc.flags = LOG_DESC_FLAGS_V3S;
+    }
+    dataflash_write(LOG_DESC_SLOT(log_desc_seq(&active_desc)) * sizeof(logged_data_descriptor_t), 
+            sizeof(logged_data_descriptor_t), (u8 *)&active_desc, 0);    
+
+    /* after the descriptor, which matters more */
+    preview_close(0);
+    preview_close(1);
+
+    next_available_data = stats == 2 ? 
+        log_desc_start(&active_desc) + active_desc.data_length :
+        log_desc_stats(&active_desc) + LOG_STATS_MAX;
+}
+
+void end_sampling()
+{
+    stage_drain();
+    close_session();
+}
+
+/******************************************************************************
+* Triggered logging
+*        Armed, records go round the LOG_PRETRIG_BLOCKS blocks from
+*        trig_base, each block erased just before the head comes back to
+*        it; the ring's LOG_PRETRIG_BLOCKS blocks after that are kept
+*        erased.  When a rule holds, a session is opened over whatever the
+*        ring still has, oldest block first.  If that has wrapped, the
+*        newer part is copied page for page into the blocks after the ring
+*        so the session reads straight through, and logging carries on
+*        after the copy.
+*******************************************************************************/
+#define TRIG_RING_SIZE  ((flash_offset_t)LOG_PRETRIG_BLOCKS * LOG_BLOCK_SIZE)
+#define TRIG_NONE       0xFF
+
+/* Pages written while armed aren't in any session yet. */
+#define TRIG_PAGE_TAG   0xFFFE
+
+static u8               trig_ops;       /* log_trig_op_t, two bits per source */
+static s16              trig_level[LOG_TRIG_SOURCES];
+static u8               trig_head;      /* ring block being written */
+static u8               trig_dirty;     /* ring blocks that aren't erased */
+static u8               trig_erasing;   /* ring block being erased */
+static timerinterval_t  trig_polled;
+static timerinterval_t  trig_until;
+
+static void trig_load()
+{
+    u8 i;
+
+    trig_ops = load_persist_data(PDATA_TRIG_OPS);
+    if (trig_ops == 0xFF)
+    {
+        /* erase_persist_data() */
+        trig_ops = 0;
+    }
+    for(i=0; i<LOG_TRIG_SOURCES; i++)
+    {
+        trig_level[i] = load_persist_data_16(PDATA_TRIG_LEVEL_BOOST_L + 2*i);
+    }
+}
+
+/* rule = { source, op, level (s16, LE) }; echoed back once stored */
+static flash_err_t trig_set(u8 *rule)
+{
+    u8 source = rule[0];
+    u8 op     = rule[1];
+
+    if (source >= LOG_TRIG_SOURCES || op > LOG_TRIG_BELOW)
+    {
+        return FLASH_ERR_BAD_PARAMS;
+    }
+    trig_ops &= ~(3<<(2*source));
+    trig_ops |= op<<(2*source);
+    trig_level[source] = rule[2] | (u16)rule[3]<<8;
+
+    save_persist_data(PDATA_TRIG_OPS, trig_ops);
+    save_persist_data_16(PDATA_TRIG_LEVEL_BOOST_L + 2*source, trig_level[source]);
+    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_SET_TRIGGER, 
+            4, rule);
+    return 0;
+}
+
+static u8 trig_rules_hold()
+{
+    u8 i, op;
+    s16 v;
+
+    for(i=0; i<LOG_TRIG_SOURCES; i++)
+    {
+        op = (trig_ops >> (2*i)) & 3;
+        if (op == LOG_TRIG_OFF)
+        {
+            continue;
+        }
+        switch (i)
+        {
+            case LOG_TRIG_BOOST:
+                v = boost_get_psig();
+                break;
+            case LOG_TRIG_EGT:
+                v = egt_get_celsius();
+                if (v == EGT_INVALID)
+                {
+                    continue;
+                }
+                break;
+            default:
+                v = fp_get_relative_mbar();
+                break;
+        }
+        if ((op == LOG_TRIG_ABOVE && v > trig_level[i]) ||
+            (op == LOG_TRIG_BELOW && v < trig_level[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Where the next pre-trigger ring goes: on a block after the log, with
+ * room for the copy behind it before the end of flash. */
+static flash_offset_t trig_ring_base()
+{
+    flash_offset_t base = next_session_start(next_available_data);
+
+    base = (base + LOG_BLOCK_SIZE-1) & ~(flash_offset_t)(LOG_BLOCK_SIZE-1);
+    if (base + 2*TRIG_RING_SIZE > DATA_END_OFFSET+1)
+    {
+        base = DATA_START_OFFSET;
+    }
+    return base;
+}
+
+/* Called from flush_record() while armed, with the record's offset.
+ * Returns where it goes, or 0 if that block isn't erased yet. */
+static flash_offset_t trig_place(flash_offset_t offset)
+{
+    u8 b;
+
+    if (offset >= trig_base + TRIG_RING_SIZE)
+    {
+        offset = trig_base;
+    }
+    b = (offset - trig_base) >> DF_BLOCK_SHIFT;
+    if (b != trig_head && (trig_dirty & (1<<b)))
+    {
+        return 0;
+    }
+    trig_head = b;
+    trig_dirty |= 1<<b;
+    return offset;
+}
+
+static void trig_arm()
+{
+    u8 f = disable_interrupts();
+
+    active_desc.flags = LOG_DESC_FLAGS_V3;
+    log_desc_set_start(&active_desc, trig_base);
+    active_desc.data_length = 0;
+    log_desc_set_seq(&active_desc, next_available_index);
+    rec_mask = 0;
+    trig_head = 0;
+    trig_dirty = 0;
+    trig_erasing = TRIG_NONE;
+    policy_fresh = policy_active;
+    dataflash_append_tag(TRIG_PAGE_TAG);
+    trig_state = TRIG_ARMED;
+    sampling_flag = 1;
+    restore_flags(f);
+}
+
+static void trig_fire()
+{
+    flash_offset_t head, start, length;
+    u8 o, pages, f;
+
+    /* Wait out an erase in the ring: logging after the trigger may be
+     * about to go into that block.  Room for the descriptor and copy. */
+    if (trig_erasing != TRIG_NONE || dataflash_queue_free() < 2)
+    {
+        return;
+    }
+
+    stage_drain();
+    f = disable_interrupts();
+    flush_record();
+    dataflash_append_flush();
+
+    /* What follows goes on a fresh page, tagged with the session. */
+    head = trig_base + active_desc.data_length;
+    head = (head + DF_PAGE_DATA-1) & ~(flash_offset_t)(DF_PAGE_DATA-1);
+
+    /* the oldest block still holding data */
+    o = (trig_head+1) % LOG_PRETRIG_BLOCKS;
+    while (o != trig_head && !(trig_dirty & (1<<o)))
+    {
+        o = (o+1) % LOG_PRETRIG_BLOCKS;
+    }
+    start = trig_base + (flash_offset_t)o * LOG_BLOCK_SIZE;
+
+    pages = 0;
+    if (start > head)
+    {
+        pages  = (head - trig_base) >> df_page_shift;
+        length = trig_base + TRIG_RING_SIZE - start + (head - trig_base);
+    }
+    else
+    {
+        length = head - start;
+    }
+
+    start_session(start, length);
+    if (pages)
+    {
+        dataflash_copy(trig_base, trig_base + TRIG_RING_SIZE, pages, 0);
+    }
+    trig_state = TRIG_FIRED;
+    restore_flags(f);
+
+    trig_until = readtime() + MS_TO_TICK(LOG_POSTTRIG_MSEC);
+}
+
+static void trig_poll()
+{
+    timerinterval_t now = readtime();
+    u8 b;
+
+    switch (trig_state)
+    {
+        case TRIG_ARMING:
+            if (!ring_busy() && !ring_short())
+            {
+                trig_arm();
+            }
+            break;
+
+        case TRIG_ARMED:
+            /* erase ahead of the head round the ring */
+            b = (trig_head+1) % LOG_PRETRIG_BLOCKS;
+            if ((trig_dirty & (1<<b)) && trig_erasing == TRIG_NONE &&
+                !dataflash_erase_block(trig_base + (flash_offset_t)b * LOG_BLOCK_SIZE, TAG_TRIG))
+            {
+                trig_erasing = b;
+            }
+            /* fall through */
+
+        case TRIG_FIRED:
+            if ((timerinterval_t)(now - trig_polled) < MS_TO_TICK(LOG_TRIG_POLL_MSEC))
+            {
+                break;
+            }
+            trig_polled = now;
+
+            if (trig_rules_hold())
+            {
+                if (trig_state == TRIG_ARMED)
+                {
+                    trig_fire();
+                }
+                else
+                {
+                    trig_until = now + MS_TO_TICK(LOG_POSTTRIG_MSEC);
+                }
+            }
+            else if (trig_state == TRIG_FIRED && (s16)(now - trig_until) >= 0)
+            {
+                end_sampling();
+                trig_base = trig_ring_base();
+                trig_state = TRIG_ARMING;
+            }
+            break;
+    }
+}
+
+static void trig_op_done()
+{
+    u8 f;
+
+    if (trig_erasing != TRIG_NONE)
+    {
+        f = disable_interrupts();
+        trig_dirty &= ~(1<<trig_erasing);
+        restore_flags(f);
+        trig_erasing = TRIG_NONE;
+    }
+}
+
+static inline u8 log_running()
+{
+    return sampling_flag || trig_state != TRIG_IDLE;
+}
+
+/* The logger's on/off switch.  With any trigger rule set, on means armed. */
+static void log_start()
+{
+    if (trig_ops)
+    {
+        trig_base = trig_ring_base();
+        trig_state = TRIG_ARMING;
+    }
+    else
+    {
+        begin_sampling();
+    }
+}
+
+static void log_stop()
+{
+    u8 f;
+
+    if (trig_state == TRIG_ARMED)
+    {
+        /* Nothing to keep.  The ring's blocks get erased again when the
+         * log reaches them. */
+        f = disable_interrupts();
+        sampling_flag = 0;
+        rec_mask = 0;
+        dataflash_append_flush();
+        restore_flags(f);
+        ring_block = block_of(trig_base);
+    }
+    else if (sampling_flag)
+    {
         end_sampling();
     }
+    trig_state = TRIG_IDLE;
+}
+
+static u8 put_varint(u8 *p, u32 v)
+{
+    u8 n = 0;
+
+    while (v > 0x7F)
+    {
+        p[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+/******************************************************************************
+* v3 value coding
+*******************************************************************************/
+static u16          v3_last[LOG_MAX_CHANNELS];
+static u16          v3_acc[LOG_V3_STREAMS];
+static delta_time_t v3_delta;
+static u16          v3_mask;
+
+typedef struct {
+    u8      *p;
+    u8      bits;                       /* in *p so far */
+} bit_writer_t;
+
+static void v3_reset()
+{
+    u8 i;
+
+    for(i=0; i<LOG_MAX_CHANNELS; i++)
+    {
+        v3_last[i] = 0;
+    }
+    for(i=0; i<LOG_V3_STREAMS; i++)
+    {
+        v3_acc[i] = 0;
+    }
+    v3_delta = 0;
+    v3_mask = 0;
+}
+
+static u8 put_mask(u8 *p)
+{
+    if (rec_mask == v3_mask)
+    {
+        *p = LOG_V3_SAME_MASK;
+        return 1;
+    }
+    v3_mask = rec_mask;
+    return put_varint(p, rec_mask);
+}
+
+static void put_bits(bit_writer_t *bw, u32 v, u8 n)
+{
+    while (n--)
+    {
+        if (!bw->bits)
+        {
+            *bw->p = 0;
+        }
+        if (v & ((u32)1<<n))
+        {
+            *bw->p |= 0x80 >> bw->bits;
+        }
+        if (++bw->bits == 8)
+        {
+            bw->p++;
+            bw->bits = 0;
+        }
+    }
+}
+
+static void put_rice(bit_writer_t *bw, u32 z, u8 stream, u8 width)
+{
+    u8 k = log_v3_k(v3_acc[stream]);
+    u32 q = z >> k;
+
+    if (q >= LOG_V3_ESCAPE)
+    {
+        put_bits(bw, (1<<LOG_V3_ESCAPE)-1, LOG_V3_ESCAPE);
+        put_bits(bw, z, width);
+    }
+    else
+    {
+        put_bits(bw, ((u16)1<<(q+1))-2, q+1);
+        put_bits(bw, z, k);
+    }
+    v3_acc[stream] = log_v3_adapt(v3_acc[stream], z);
+}
+
+/* The bit stream part of the pending record, given its time delta; moves
+ * the streams on.  Returns the octets used. */
+static u8 encode_record(u8 *out, delta_time_t delta)
+{
+    bit_writer_t bw;
+    s32 dd;
+    s16 dv;
+    u16 v;
+    u8 c, i, size;
+    u8 *vp = rec_vals;
+
+    bw.p = out;
+    bw.bits = 0;
+
+    dd = delta - v3_delta;
+    v3_delta = delta;
+    put_rice(&bw, (u32)dd << 1 ^ (u32)(dd >> 31), LOG_MAX_CHANNELS, 32);
+
+    for(c=0; c<LOG_MAX_CHANNELS; c++)
+    {
+        if (!(rec_mask & (1<<c)))
+        {
+            continue;
+        }
+        size = log_type_size(c+1);
+        if (size == 2)
+        {
+            v = vp[0] | (u16)vp[1]<<8;
+            dv = v - v3_last[c];
+            v3_last[c] = v;
+            put_rice(&bw, (u16)((u16)dv << 1 ^ (u16)(dv >> 15)), c, 16);
+            vp += 2;
+            continue;
+        }
+        if (size == 0)
+        {
+            size = *vp + 1;
+        }
+        for(i=0; i<size; i++)
+        {
+            put_bits(&bw, *vp++, 8);
+        }
+    }
+    return bw.p - out + (bw.bits != 0);
+}
+
+/******************************************************************************
+* flush_record
+*        Write out the pending record.  A record that won't fit in what's
+*        left of the page moves to the next one; the gap stays erased.  A
+*        record that starts a page is preceded by a keyframe, and the value
+*        streams start over there.
+*        Only from dl_task.
+*******************************************************************************/
+static void flush_record()
+{
+    u8 buf[LOG_V3_MAX_RECORD];
+    u8 *rec = &buf[6];                  /* after room for a keyframe */
+    u8 n, m;
+    flash_offset_t offset;
+    u8 in_page;
+
+    if (!rec_mask)
+    {
+        return;
+    }
+
+    offset = log_desc_start(&active_desc) + active_desc.data_length;
+    in_page = offset & (FLASH_PAGE_SIZE-1);
+
+    if (in_page)
+    {
+        m = put_mask(rec);
+        n = m + encode_record(&rec[m], rec_time - last_sample_time);
+        if (in_page + n > FLASH_PAGE_SIZE)
+        {
+            /* Not here; the streams it moved on start over anyway. */
+            offset += FLASH_PAGE_SIZE - in_page;
+            in_page = 0;
+        }
+    }
+    if (!in_page)
+    {
+        v3_reset();
+        m = put_mask(rec);
+        n = m + encode_record(&rec[m], 0);
+        rec -= 6;
+        n += 6;
+        rec[0] = LOG_V3_KEYFRAME;
+        rec[1] = 0x00;
+        rec[2] = rec_time;
+        rec[3] = rec_time>>8;
+        rec[4] = rec_time>>16;
+        rec[5] = rec_time>>24;
+    }
+
+    rec_mask = 0;
+    last_sample_time = rec_time;
+
+    if (trig_state == TRIG_ARMED)
+    {
+        offset = trig_place(offset);
+        if (!offset)
+        {
+            records_lost++;
+            return;
+        }
+    }
+    if (offset + n > DATA_END_OFFSET)
+    {
+        /* End of flash: carry on in a new session back at the start.
+         * The record was coded for this one, so it's lost. */
+        records_lost++;
+        close_session();
+        begin_sampling();
+        return;
+    }
+    if (block_of(offset) == ring_block)
+    {
+        /* Not erased yet.  Lose the record, as when the buffer's busy. */
+        records_lost++;
+        return;
+    }
+
+    if (dataflash_append(offset, n, rec))
+    {
+        /* The last page is still programming.  The record is lost; the
+         * next one tries the same page again, keyframe and all. */
+        records_lost++;
+        return;
+    }
+
+    active_desc.data_length = offset + n - log_desc_start(&active_desc);
+}
+
+/******************************************************************************
+* Logging policy
+*******************************************************************************/
+static void policy_update(u8 c, u8 *entry)
+{
+    policy[c].decimate    = entry[0];
+    policy[c].deadband    = entry[1];
+    policy[c].interval_ms = entry[2] | (u16)entry[3]<<8;
+
+    if (policy[c].decimate == 0xFF && policy[c].deadband == 0xFF &&
+        policy[c].interval_ms == 0xFFFF)
+    {
+        /* erase_persist_data() */
+        policy[c].decimate    = 0;
+        policy[c].deadband    = 0;
+        policy[c].interval_ms = 0;
+    }
+    if (policy[c].decimate > 1 || policy[c].deadband || policy[c].interval_ms)
+    {
+        policy_active |= 1<<c;
+    }
+    else
+    {
+        policy_active &= ~(1<<c);
+    }
+    policy_count[c] = 0;
+    policy_fresh |= 1<<c;
+}
+
+static void policy_load()
+{
+    u8 c, i;
+    u8 entry[LOG_POLICY_SIZE];
+
+    for(c=0; c<LOG_MAX_CHANNELS; c++)
+    {
+        for(i=0; i<LOG_POLICY_SIZE; i++)
+        {
+            entry[i] = load_persist_data(PDATA_LOG_POLICY + c*LOG_POLICY_SIZE + i);
+        }
+        policy_update(c, entry);
+    }
+}
+
+/* entry = { type, decimate, deadband, interval_ms (LE) }; echoed back */
+static flash_err_t policy_set(u8 *entry)
+{
+    u8 c = entry[0] - 1;
+    u8 i, f;
+
+    if (c >= LOG_MAX_CHANNELS)
+    {
+        return FLASH_ERR_BAD_PARAMS;
+    }
+    for(i=0; i<LOG_POLICY_SIZE; i++)
+    {
+        save_persist_data(PDATA_LOG_POLICY + c*LOG_POLICY_SIZE + i, entry[1+i]);
+    }
+    f = disable_interrupts();
+    policy_update(c, &entry[1]);
+    restore_flags(f);
+
+    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_DATALOGGER<<4|FLASH_CMD_SET_POLICY, 
+            1+LOG_POLICY_SIZE, entry);
+    return 0;
+}
+
+/* Whether a sample gets past its channel's policy; a few compares for a
+ * channel without one.  Called with interrupts off. */
+static inline u8 policy_pass(u8 type, u8 length, u8 *data)
+{
+    u8 c = type-1;
+    const log_policy_t *p = &policy[c];
+    timerinterval_t now;
+    u16 v, d;
+
+    if (!(policy_active & (1<<c)))
+    {
+        return 1;
+    }
+    if (p->decimate > 1)
+    {
+        if (++policy_count[c] < p->decimate)
+        {
+            return 0;
+        }
+        policy_count[c] = 0;
+    }
+
+    now = readtime();
+    v = length ? data[0] : 0;
+    if (length > 1)
+    {
+        v |= (u16)data[1]<<8;
+    }
+    if (!(policy_fresh & (1<<c)))
+    {
+        if ((timerinterval_t)(now - policy_time[c]) < MS_TO_TICK(p->interval_ms))
+        {
+            return 0;
+        }
+        d = v > policy_value[c] ? v - policy_value[c] : policy_value[c] - v;
+        if (p->deadband && d <= p->deadband)
+        {
+            return 0;
+        }
+    }
+    policy_fresh &= ~(1<<c);
+    policy_time[c]  = now;
+    policy_value[c] = v;
+    return 1;
+}
+
+/******************************************************************************
+* Session statistics
+*******************************************************************************/
+static void stats_reset()
+{
+    u8 c;
+
+    for(c=0; c<LOG_MAX_CHANNELS; c++)
+    {
+        stat_count[c] = 0;
+    }
+}
+
+static void stats_add(u8 c, u16 v)
+{
+    u32 sum;
+
+    if (!stat_count[c])
+    {
+        stat_min[c] = v;
+        stat_max[c] = v;
+        stat_sum[c] = 0;
+        stat_sum_hi[c] = 0;
+    }
+    else if (v < stat_min[c])
+    {
+        stat_min[c] = v;
+    }
+    else if (v > stat_max[c])
+    {
+        stat_max[c] = v;
+    }
+    stat_count[c]++;
+
+    sum = stat_sum[c] + v;
+    if (sum < v)
+    {
+        stat_sum_hi[c]++;
+    }
+    stat_sum[c] = sum;
+}
+
+/* Appends the statistics after the session's data.  0 if they're all
+ * there, 1 if the flash wasn't ready part way, 2 if there's nowhere to
+ * put them. */
+static u8 stats_write()
+{
+    flash_offset_t offset = log_desc_stats(&active_desc);
+    u8 buf[LOG_STATS_ENTRY];
+    u8 c, n;
+
+    if (!active_desc.data_length || trig_state == TRIG_ARMED || 
+        offset + LOG_STATS_MAX > DATA_END_OFFSET ||
+        block_of(offset) == ring_block || 
+        block_of(offset + LOG_STATS_MAX - 1) == ring_block)
+    {
+        return 2;
+    }
+
+    n = 0;
+    for(c=0; c<LOG_MAX_CHANNELS; c++)
+    {
+        n += stat_count[c] != 0;
+    }
+    buf[0] = LOG_STATS_MAGIC;
+    buf[1] = n;
+    if (dataflash_append(offset, 2, buf))
+    {
+        return 1;
+    }
+    offset += 2;
+
+    for(c=0; c<LOG_MAX_CHANNELS; c++)
+    {
+        if (!stat_count[c])
+        {
+            continue;
+        }
+        buf[0]  = c+1;
+        buf[1]  = stat_min[c];
+        buf[2]  = stat_min[c]>>8;
+        buf[3]  = stat_max[c];
+        buf[4]  = stat_max[c]>>8;
+        buf[5]  = stat_count[c];
+        buf[6]  = stat_count[c]>>8;
+        buf[7]  = stat_count[c]>>16;
+        buf[8]  = stat_count[c]>>24;
+        buf[9]  = stat_sum[c];
+        buf[10] = stat_sum[c]>>8;
+        buf[11] = stat_sum[c]>>16;
+        buf[12] = stat_sum[c]>>24;
+        buf[13] = stat_sum_hi[c];
+        if (dataflash_append(offset, LOG_STATS_ENTRY, buf))
+        {
+            return 1;
+        }
+        offset += LOG_STATS_ENTRY;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* Preview
+*        Each level's ring is written a record at a time from pv_out, in
+*        place, so only a block it enters needs erasing first.  After a
+*        restart a level carries on from the block after the one holding
+*        its newest page.  A bucket is dropped rather than waited for if
+*        the level's last record is still queued or the queue is nearly
+*        full; the data log comes first.
+*******************************************************************************/
+static inline flash_offset_t preview_base(u8 level)
+{
+    return (flash_offset_t)log_preview_first(df_size_shift, DF_BLOCK_SHIFT, level) * 
+        LOG_BLOCK_SIZE;
+}
+
+static inline flash_offset_t preview_limit(u8 level)
+{
+    return preview_base(level) + 
+        (flash_offset_t)log_preview_blocks(df_size_shift, DF_BLOCK_SHIFT, level) * 
+        LOG_BLOCK_SIZE;
+}
+
+static void preview_init()
+{
+    flash_offset_t p, newest;
+    log_index_t seq, nseq = 0;
+    u16 bucket, nbucket = 0;
+    u8 hdr[5], l, found;
+
+    for(l=0; l<LOG_PREVIEW_LEVELS; l++)
+    {
+        found = 0;
+        newest = preview_base(l);
+        for(p=preview_base(l); p<preview_limit(l); p+=DF_PAGE_DATA)
+        {
+            dataflash_read_range(p, sizeof(hdr), hdr);
+            if (hdr[0] != (LOG_PREVIEW_TAG|l))
+            {
+                continue;
+            }
+            seq    = hdr[1] | (u16)hdr[2]<<8;
+            bucket = hdr[3] | (u16)hdr[4]<<8;
+            if (!found || log_seq_cmp(seq, nseq) > 0 || 
+                (seq == nseq && bucket > nbucket))
+            {
+                newest  = p;
+                nseq    = seq;
+                nbucket = bucket;
+            }
+            found = 1;
+        }
+        pv_head[l] = newest;
+        if (found)
+        {
+            pv_head[l] = (newest & ~(LOG_BLOCK_SIZE-1)) + LOG_BLOCK_SIZE;
+        }
+    }
+    pv_busy = 0;
+}
+
+static void preview_reset()
+{
+    u8 l;
+
+    for(l=0; l<LOG_PREVIEW_LEVELS; l++)
+    {
+        pv_mask[l] = 0;
+    }
+    pv_started = 0;
+}
+
+/* Closes the level's bucket, writing it out if anything was logged. */
+static void preview_close(u8 l)
+{
+    log_index_t seq = log_desc_seq(&active_desc);
+    flash_offset_t at;
+    u16 mask = pv_mask[l];
+    u8 *p = pv_out[l];
+    u8 c, n;
+
+    pv_mask[l] = 0;
+    if (!mask || (pv_busy & 1<<l))
+    {
+        return;
+    }
+
+    at = log_desc_start(&active_desc) + active_desc.data_length;
+    p[0] = LOG_PREVIEW_TAG | l;
+    p[1] = seq;
+    p[2] = seq>>8;
+    p[3] = pv_bucket[l];
+    p[4] = pv_bucket[l]>>8;
+    p[5] = at;
+    p[6] = at>>8;
+    p[7] = at>>16;
+    p[8] = mask;
+    p[9] = mask>>8;
+    n = LOG_PREVIEW_HDR;
+    for(c=0; c<LOG_MAX_CHANNELS; c++)
+    {
+        if (mask & 1<<c)
+        {
+            p[n++] = pv_min[l][c];
+            p[n++] = pv_min[l][c]>>8;
+            p[n++] = pv_max[l][c];
+            p[n++] = pv_max[l][c]>>8;
+        }
+    }
+
+    at = pv_head[l];
+    if ((at & (DF_PAGE_DATA-1)) + n > DF_PAGE_DATA)
+    {
+        at = (at & ~(flash_offset_t)(DF_PAGE_DATA-1)) + DF_PAGE_DATA;
+    }
+    if (at >= preview_limit(l))
+    {
+        at = preview_base(l);
+    }
+    if (!(at & (LOG_BLOCK_SIZE-1)))
+    {
+        if (dataflash_queue_free() < 3 || dataflash_erase_block(at, 0))
+        {
+            return;
+        }
+    }
+    else if (dataflash_queue_free() < 2)
+    {
+        return;
+    }
+    if (!dataflash_write_buf(at, n, p, TAG_PREVIEW + l))
+    {
+        pv_busy |= 1<<l;
+        pv_head[l] = at + n;
+    }
+}
+
+static void preview_add(u8 c, u16 v, delta_time_t t)
+{
+    delta_time_t len = LOG_TIME_HZ;
+    u8 l;
+
+    for(l=0; l<LOG_PREVIEW_LEVELS; l++, len *= LOG_PREVIEW_FANOUT)
+    {
+        if (!pv_started)
+        {
+            pv_start[l]  = t;
+            pv_bucket[l] = 0;
+        }
+        /* a sample staged a little out of order stays in the bucket */
+        while ((s32)(t - pv_start[l]) >= (s32)len)
+        {
+            preview_close(l);
+            pv_start[l] += len;
+            pv_bucket[l]++;
+        }
+
+        if (!(pv_mask[l] & 1<<c))
+        {
+            pv_mask[l] |= 1<<c;
+            pv_min[l][c] = v;
+            pv_max[l][c] = v;
+        }
+        else if (v < pv_min[l][c])
+        {
+            pv_min[l][c] = v;
+        }
+        else if (v > pv_max[l][c])
+        {
+            pv_max[l][c] = v;
+        }
+    }
+    pv_started = 1;
+}
+
+static void preview_op_done(u8 l)
+{
+    pv_busy &= ~(1<<l);
+}
+
+/******************************************************************************
+* record_sample
+*        Adds a sample that made it through staging to the record being
+*        assembled, flushing it first when the channel repeats or
+*        LOG_COALESCE_TIME has passed.  Only from dl_task.
+*******************************************************************************/
+static void record_sample(u8 type, u8 length, u8 *data, delta_time_t t)
+{
+    u16 bit, v;
+    u8 size, pos, i;
+
+    size = log_type_size(type);
+    if (size == 0)
+    {
+        size = length + 1;
+    }
+    bit = 1<<(type-1);
+
+    if (rec_mask &&
+        ((rec_mask & bit) || 
+         t - rec_time > LOG_COALESCE_TIME))
+    {
+        flush_record();
+    }
+    if (!sampling_flag)
+    {
+        /* flush hit the end of flash */
+        return;
+    }
+    if (!rec_mask)
+    {
+        rec_time = t;
+        rec_len = 0;
+    }
+
+    /* Only DATA_TYPE_USER has a variable size and it's the highest
+     * channel, so everything below it is fixed. */
+    pos = 0;
+    for(i=1; i<type; i++)
+    {
+        if (rec_mask & (1<<(i-1)))
+        {
+            pos += log_type_size(i);
+        }
+    }
+    for(i=rec_len; i>pos; i--)
+    {
+        rec_vals[i-1+size] = rec_vals[i-1];
+    }
+    if (type == DATA_TYPE_USER)
+    {
+        rec_vals[pos++] = length;
+    }
+    for(i=0; i<length; i++)
+    {
+        rec_vals[pos+i] = data[i];
+    }
+    rec_len += size;
+    rec_mask |= bit;
+
+    v = length ? data[0] | (length > 1 ? (u16)data[1]<<8 : 0) : 0;
+    stats_add(type-1, v);
+    if (trig_state != TRIG_ARMED)
+    {
+        /* armed, there's no session for it yet */
+        preview_add(type-1, v, t);
+    }
+}
+
+/* Takes in whatever the producers have staged, oldest first across the
+ * two rings.  Samples staged after a session ended are dropped. */
+static void stage_drain()
+{
+    stage_ring_t *r;
+    staged_sample_t *e;
+    u8 ih, th;
+
+    for(;;)
+    {
+        ih = stage_isr.head;
+        th = stage_task.head;
+        if (ih == stage_isr.tail)
+        {
+            if (th == stage_task.tail)
+            {
+                break;
+            }
+            r = &stage_task;
+        }
+        else if (th == stage_task.tail)
+        {
+            r = &stage_isr;
+        }
+        else
+        {
+            /* Both waiting: the earlier one, allowing for the wrap. */
+            r = (s32)(stage_task.entry[th].t - stage_isr.entry[ih].t) >= 0 ? 
+                    &stage_isr : &stage_task;
+        }
+        e = &r->entry[r->head];
+        if (sampling_flag)
+        {
+            record_sample(e->type, e->length, e->data, e->t);
+        }
+        r->head = (r->head + 1) & r->mask;
+    }
+}
+
+/* For FLASH_CMD_GET_STATS */
+static void stage_stats(u8 *stats)
+{
+    u8 f = disable_interrupts();
+
+    stats[0] = stage_isr.dropped;
+    stats[1] = stage_isr.dropped>>8;
+    stats[2] = stage_task.dropped;
+    stats[3] = stage_task.dropped>>8;
+    stats[4] = records_lost;
+    stats[5] = records_lost>>8;
+    restore_flags(f);
+}
+
+/******************************************************************************
+* log_data_sample
+*        Called from the ADC interrupt and from tasks.  Samples the channel's
+*        policy lets through are stamped and staged for dl_task, in the
+*        interrupt ring or the task ring depending on where the call came
+*        from, so neither ring has more than one producer.  A sample that
+*        finds its ring full is counted and dropped.
+*******************************************************************************/
+void log_data_sample(logged_data_type_t type, u8 length, u8 *data)
+{
+    stage_ring_t *r;
+    staged_sample_t *e;
+    u8 i, f, tail;
+    
+    if (!sampling_flag || type < 1 || type > LOG_MAX_CHANNELS)
+    {
+        return;
+    }
+
+    if (log_type_size(type) == 0)
+    {
+        if (length > LOG_USER_MAX)
+        {
+            length = LOG_USER_MAX;
+        }
+    }
+    else if (length != log_type_size(type))
+    {
+        return;
+    }
+
+    /* The policy state is shared, so that much stays atomic. */
+    f = disable_interrupts();
+    if (!policy_pass(type, length, data))
+    {
+        restore_flags(f);
+        return;
+    }
+    r = f ? &stage_task : &stage_isr;
+    tail = r->tail;
+    if (((tail + 1) & r->mask) == r->head)
+    {
+        r->dropped++;
+        restore_flags(f);
+        return;
+    }
+    e = &r->entry[tail];
+    e->t = read_timebase();
+    restore_flags(f);
+
+    e->type = type;
+    e->length = length;
+    for(i=0; i<length; i++)
+    {
+        e->data[i] = data[i];
+    }
+    r->tail = (tail + 1) & r->mask;
+}
+
+
+/* Change this to use output_number, etc.
+ * Mode = M2
+ * Flash log number when logging, otherwise hold solid.  E while armed
+ * for a trigger.
+ */
+
+u8 datalogger_display_func(ui_mode_t mode, ui_display_event_t event)
+{
+    number_display_flags_t dflags = CENTER_FLASH;
+    center_letter_t cflags;
+    s16 val;
+
+    if (event >= IN_CONFIG)
+        return datalogger_config_func(mode, event);
+
+    if (trig_state == TRIG_ARMING || trig_state == TRIG_ARMED)
+    {
+        cflags = CENTER_E;
+        val = next_available_index;
+    }
+    else if (sampling_flag)
+    {
+        cflags = CENTER_A;
+        val = log_desc_seq(&active_desc);
+    }
+    else
+    {
+        cflags = CENTER_NONE;
+        val = next_available_index;
+    }
+
+    output_number(mode, val, cflags, dflags);
+    return 0;
+}
+
+static inline u8 datalogger_config_func(ui_mode_t mode, 
+                                        ui_display_event_t event)
+{
+    if (!log_running())
+    {
+        log_start();
+    }
+    else
+    {
+        log_stop();
+    }
 
     return 0; /* done */
 }
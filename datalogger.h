@@ -36,14 +36,97 @@
 
 #include "loggercmds.h"
 
-#define OFFSET_BITS 24
+#define OFFSET_BITS 19           /* start field; see logged_data_descriptor_t */
 typedef u32 delta_time_t;
-typedef u8  log_index_t;
 
-#define MAX_DESCRIPTORS 64
+/* v1 and v2 sample times are microseconds made from the 16 bit
+ * millisecond tick, so they wrap. */
+#define SAMPLE_TIME_WRAP_USEC   (65536L * 1000L)
 
-#define DATA_START_OFFSET (MAX_DESCRIPTORS * sizeof(logged_data_descriptor_t))
-#define DATA_END_OFFSET 0x7FFFFL
+/* v3 times are the firmware's timebase (TIMEBASE_HZ in timers.h) as it
+ * stands, wrapping at 32 bits; only the host turns them into time. */
+#define LOG_TIME_HZ             2304000UL
+#define LOG_TIME_WRAP           (1ULL << 32)
+#define SAMPLE_HDR_SIZE         6           /* packed logged_data_sample_t */
+typedef u16 log_index_t;
+
+#define MAX_DESCRIPTORS 256     /* all of block 0 */
+
+/* The descriptor table has erase block 0 to itself.  The blocks after it,
+ * up to the preview levels at the top of the flash, are a ring: sessions
+ * go round it in order, the block ahead of the one being written is
+ * erased in advance, and whatever sessions it held are retired (or
+ * trimmed) first.  A session never wraps; one that reaches the end is
+ * closed and logging carries on in a new session at DATA_START_OFFSET.
+ * Block and flash sizes are the chip's. */
+#ifdef EMBEDDED
+#define LOG_BLOCK_SIZE      DF_BLOCK_SIZE
+#define LOG_BLOCKS          log_preview_first(df_size_shift, DF_BLOCK_SHIFT, 0)
+#define DATA_START_OFFSET   LOG_BLOCK_SIZE
+#define DATA_END_OFFSET     ((flash_offset_t)LOG_BLOCKS * LOG_BLOCK_SIZE - 1)
+#endif
+
+/* Preview: the min and max of each channel over buckets of time, for a
+ * look over a whole drive without reading all of it.  Level 0 buckets
+ * are a second, each level above LOG_PREVIEW_FANOUT times the one below,
+ * counted from the session's first sample (a triggered session's from
+ * the trigger).  Each level is a ring of erase blocks of its own at the
+ * top of the flash, the next block erased as writing enters it, with a
+ * record per bucket that logged anything; records never cross a page:
+ *   LOG_PREVIEW_TAG | level, u16 session seq, u16 bucket,
+ *   u24 flash offset the session's data had reached by the bucket's end,
+ *   u16 channel mask (as v2), then for each channel in it u16 min, u16 max
+ * little endian, over the same values as the statistics.  0xFF where a
+ * record would start means the rest of the page is unused. */
+#define LOG_PREVIEW_LEVELS  2
+#define LOG_PREVIEW_FANOUT  10
+#define LOG_PREVIEW_TAG     0x50
+#define LOG_PREVIEW_HDR     10
+#define LOG_PREVIEW_MAX     (LOG_PREVIEW_HDR + 4*LOG_MAX_CHANNELS)
+
+/* Erase blocks of a preview level, on a flash of 1 << size_shift octets
+ * in blocks of 1 << block_shift: a sixteenth for level 0, a sixty fourth
+ * for level 1, and never fewer than two. */
+static inline u16 log_preview_blocks(u8 size_shift, u8 block_shift, u8 level)
+{
+    u16 n = (u16)1 << (size_shift - block_shift - (level ? 6 : 4));
+
+    return n < 2 ? 2 : n;
+}
+
+/* First block of a preview level; level 0 sits below level 1. */
+static inline u16 log_preview_first(u8 size_shift, u8 block_shift, u8 level)
+{
+    u16 b = ((u16)1 << (size_shift - block_shift)) - 
+            log_preview_blocks(size_shift, block_shift, 1);
+
+    return level ? b : b - log_preview_blocks(size_shift, block_shift, 0);
+}
+
+/* log2 of the chip's page data for its size, for an image that doesn't
+ * say: AT45DB011 to DB081 256, DB161 and DB321 512, DB642 1024. */
+static inline u8 log_page_shift(u8 size_shift)
+{
+    return size_shift <= 20 ? 8 : size_shift <= 22 ? 9 : 10;
+}
+
+/* Sequence numbers are LOG_SEQ_BITS wide and wrap at a multiple of
+ * MAX_DESCRIPTORS, so a session always lives in slot seq % MAX_DESCRIPTORS.
+ * No more than MAX_DESCRIPTORS are live at once, so the sign of the
+ * difference says which of two is newer. */
+#define LOG_SEQ_BITS        13
+#define LOG_SEQ_MASK        ((1<<LOG_SEQ_BITS)-1)
+#define LOG_DESC_SLOT(seq)  ((seq) % MAX_DESCRIPTORS)
+
+static inline log_index_t log_seq_next(log_index_t seq)
+{
+    return (seq+1) & LOG_SEQ_MASK;
+}
+
+static inline s16 log_seq_cmp(log_index_t a, log_index_t b)
+{
+    return (s16)((a - b) << (16 - LOG_SEQ_BITS));
+}
 
 typedef enum {
     DATA_TYPE_MAP_VOLTS       =    1,
@@ -56,8 +139,24 @@ typedef enum {
     DATA_TYPE_EGT_RAW         =    8,
     DATA_TYPE_WB_VOLTS        =    9,
     DATA_TYPE_FP_VOLTS        =   10,
+    DATA_TYPE_USER            =   11,     /* FLASH_CMD_LOG_SAMPLE, 1..4 bytes */
 } logged_data_type_t;
 
+/* Value size of each type in a v2 record; 0 means a length octet comes
+ * first (DATA_TYPE_USER only). */
+static inline u8 log_type_size(u8 type)
+{
+    switch (type)
+    {
+        case DATA_TYPE_EGT_RAW:
+            return 4;
+        case DATA_TYPE_USER:
+            return 0;
+        default:
+            return 2;
+    }
+}
+
 typedef struct {
     u8              flags             : 4;        /* 1010 = sample */
     u8              data_length       : 4;        /* in bytes, -1 (1..16 bytes) */
@@ -66,14 +165,213 @@ typedef struct {
     /* data follows, 1 to 16 bytes long */
 } logged_data_sample_t;
 
+/* v1: a logged_data_sample_t header in front of every value.
+ *
+ * v2: one record per acquisition instant, never crossing a page:
+ *     varint channel mask     bit n = data type n+1 present
+ *     varint time delta       usec since the previous record
+ *     values                  in channel order, log_type_size() each
+ *   A mask of 0 is a keyframe and is followed by the absolute u32 time
+ *   instead; every page starts with one, so any page decodes on its own.
+ *   0xFF where a record would start means the rest of the page is unused,
+ *   if it is the page's last octet or another 0xFF follows.  (A mask
+ *   can start with 0xFF too, but its second octet is at most 0x0F.)
+ *   Varints are little endian, 7 bits per octet, high bit = more.
+ *   Sessions start on a page boundary.
+ *
+ * v3: pages, keyframes and the mask as in v2, except that a mask octet of
+ *   0x00 means the same channels as the last record.  The rest of a
+ *   record is a bit stream, most significant bit first, padded to an
+ *   octet with 0:
+ *     time                    change in the delta from the last record's
+ *                             (LOG_TIME_HZ counts)
+ *     each 2 octet channel    change from that channel's last value
+ *   both zigzagged (0, -1, 1, -2 .. to 0, 1, 2, 3 ..) and Rice coded: with
+ *   q = z >> k, q ones, a zero and the low k bits of z, or from q of
+ *   LOG_V3_ESCAPE on, that many ones and all of z (16 bits, 32 for time).
+ *   k follows the recent size of z in each stream; see log_v3_k().  An
+ *   escape counts as z = LOG_V3_ESCAPE << k there, so one outlier (or
+ *   the first value after a keyframe) doesn't upset it.
+ *   EGT_RAW and USER values (length octet first) go in as plain octets.
+ *   The keyframe is written 0x80 0x00, so a dump says which format it
+ *   is, and every stream starts again from 0 after one. */
+#define LOG_DESC_FLAGS_V1   0xDD
+#define LOG_DESC_FLAGS_V2   0xDE
+#define LOG_DESC_FLAGS_V2P  0xDC    /* v2, start in LOG_START_UNITs */
+#define LOG_DESC_FLAGS_V3   0xDB    /* start in LOG_START_UNITs too */
+#define LOG_DESC_FLAGS_V3S  0xDA    /* v3, statistics follow the data */
+#define LOG_DESC_FLAGS_RETIRED  0x00    /* data overwritten; skip the slot */
+#define LOG_DESC_FLAGS_ERASED   0xFF    /* never used; the table ends here */
+
+#define LOG_V2_KEYFRAME     0x00
+#define LOG_V2_PAD          0xFF
+#define LOG_MAX_CHANNELS    DATA_TYPE_USER
+#define LOG_USER_MAX        4
+#define LOG_V2_MAX_VALUES   (9*2 + 4 + 1 + LOG_USER_MAX)
+#define LOG_V2_MAX_RECORD   (5 + 2 + 4 + LOG_V2_MAX_VALUES)
+
+#define LOG_V3_KEYFRAME     0x80    /* then 0x00 */
+#define LOG_V3_SAME_MASK    0x00
+#define LOG_V3_ESCAPE       12
+#define LOG_V3_STREAMS      (LOG_MAX_CHANNELS + 1)      /* last one is time */
+#define LOG_V3_MAX_RECORD   (6 + 2 + (44 + 9*28 + 4*8 + (1+LOG_USER_MAX)*8 + 7)/8)
+
+/* Rice parameter for a stream whose log_v3_adapt() sum is acc: about
+ * log2 of the mean z.  Both start at 0 after a keyframe. */
+static inline u8 log_v3_k(u16 acc)
+{
+    u8 k = 0;
+
+    for(acc >>= 4; acc; acc >>= 1)
+    {
+        k++;
+    }
+    return k;
+}
+
+/* Roughly 8 times the mean of the last few z; can't pass 0xFFFF. */
+static inline u16 log_v3_adapt(u16 acc, u32 z)
+{
+    u32 limit = (u32)LOG_V3_ESCAPE << log_v3_k(acc);
+
+    if (z > limit)
+    {
+        z = limit;
+    }
+    return acc - (acc >> 3) + (z > 0x1FFF ? 0x1FFF : z);
+}
+
+/* Samples from different channels within this long of the first one
+ * go into the same record (one ADC round); 1 ms. */
+#define LOG_COALESCE_TIME   (LOG_TIME_HZ/1000)
+
+/* Entries staged for dl_task from interrupts and from tasks.  Powers of
+ * two; one entry in each always stays empty. */
+#define LOG_STAGE_ISR_LEN   8
+#define LOG_STAGE_TASK_LEN  4
+
+/* What each channel logs, kept in EEPROM from PDATA_LOG_POLICY.  A
+ * sample is dropped unless it is the decimate'th since the last one
+ * (0 or 1: every one), at least interval_ms after the last one logged,
+ * and more than deadband away from it (first two value octets, little
+ * endian).  The first sample of a session always goes in.  All zero, the
+ * EEPROM default, logs everything; so does an erased (all 0xFF) entry. */
 typedef struct {
-    u8 flags;                                   /* 0xDD */
-    u8 sequence_number;
-    flash_offset_t data_start_offset : OFFSET_BITS;
-    flash_offset_t data_length       : OFFSET_BITS;
+    u8              decimate;
+    u8              deadband;
+    u16             interval_ms;
+} log_policy_t;
+
+#define LOG_POLICY_SIZE     4       /* octets in EEPROM, as above */
+
+/* Triggered logging.  With any rule set, starting the logger arms it
+ * instead: records go round a pre-trigger ring of LOG_PRETRIG_BLOCKS
+ * erase blocks at the head of the log (one of them always being erased),
+ * and only when a rule holds is a session written, covering what the
+ * ring still has and then LOG_POSTTRIG_MSEC past the last time a rule
+ * held.  After that the logger arms again. */
+#define LOG_PRETRIG_BLOCKS  4
+#define LOG_POSTTRIG_MSEC   10000
+#define LOG_TRIG_POLL_MSEC  50
+
+typedef enum {
+    LOG_TRIG_BOOST,             /* boost_get_psig() */
+    LOG_TRIG_EGT,               /* egt_get_celsius() */
+    LOG_TRIG_FP,                /* fp_get_relative_mbar() */
+    LOG_TRIG_SOURCES
+} log_trig_source_t;
+
+typedef enum {
+    LOG_TRIG_OFF,
+    LOG_TRIG_ABOVE,
+    LOG_TRIG_BELOW,
+} log_trig_op_t;
+
+static inline u8 log_desc_valid(u8 flags)
+{
+    return flags == LOG_DESC_FLAGS_V1 || flags == LOG_DESC_FLAGS_V2 ||
+           flags == LOG_DESC_FLAGS_V2P || flags == LOG_DESC_FLAGS_V3 ||
+           flags == LOG_DESC_FLAGS_V3S;
+}
+
+static inline u8 log_desc_version(u8 flags)
+{
+    if (flags == LOG_DESC_FLAGS_V1)
+    {
+        return 1;
+    }
+    return (flags == LOG_DESC_FLAGS_V3 || flags == LOG_DESC_FLAGS_V3S) ? 3 : 2;
+}
+
+/* 8 octets on flash.  The top of the sequence number sits in bits the
+ * start offset doesn't need; tables written with 8 bit sequence numbers
+ * have zeros there and read the same.  The start is in bytes for V1 and
+ * V2, which only reach 512 KB, and in LOG_START_UNITs for V2P and V3;
+ * use log_desc_start(). */
+typedef struct {
+    u8 flags;                                   /* LOG_DESC_FLAGS_ */
+    u8 sequence_low;
+    flash_offset_t data_start        : OFFSET_BITS;
+    flash_offset_t sequence_high     : 24 - OFFSET_BITS;
+    flash_offset_t data_length       : 24;
 } logged_data_descriptor_t;
 
+#define LOG_DESC_SIZE   8
+#define LOG_START_UNIT  256     /* V2P sessions start on a page at least */
+
+static inline u8 log_desc_in_units(const logged_data_descriptor_t *d)
+{
+    return d->flags == LOG_DESC_FLAGS_V2P || d->flags == LOG_DESC_FLAGS_V3 ||
+           d->flags == LOG_DESC_FLAGS_V3S;
+}
+
+static inline flash_offset_t log_desc_start(const logged_data_descriptor_t *d)
+{
+    return log_desc_in_units(d) ? 
+        (flash_offset_t)d->data_start * LOG_START_UNIT : d->data_start;
+}
+
+static inline void log_desc_set_start(logged_data_descriptor_t *d, flash_offset_t start)
+{
+    d->data_start = log_desc_in_units(d) ? start / LOG_START_UNIT : start;
+}
+
+static inline log_index_t log_desc_seq(const logged_data_descriptor_t *d)
+{
+    return d->sequence_low | (log_index_t)d->sequence_high << 8;
+}
+
+static inline void log_desc_set_seq(logged_data_descriptor_t *d, log_index_t seq)
+{
+    d->sequence_low  = seq;
+    d->sequence_high = seq >> 8;
+}
+
 #define FLASH_PAGE_SIZE 256
+
+/* Statistics of a session end_sampling() closed, from the first
+ * FLASH_PAGE_SIZE boundary after its data (LOG_DESC_FLAGS_V3S only):
+ *   LOG_STATS_MAGIC, u8 entries, then for each channel that logged
+ *     u8 type, u16 min, u16 max, u32 count, 40 bit sum
+ *   little endian, over the first two value octets (little endian) of
+ *   every sample logged; a triggered session's start at the trigger.
+ *   They stay as logged when the ring trims the session's start. */
+#define LOG_STATS_MAGIC     0x53
+#define LOG_STATS_ENTRY     14
+#define LOG_STATS_MAX       (2 + LOG_MAX_CHANNELS*LOG_STATS_ENTRY)
+
+static inline flash_offset_t log_desc_stats(const logged_data_descriptor_t *d)
+{
+    return (log_desc_start(d) + d->data_length + FLASH_PAGE_SIZE-1) & 
+        ~(flash_offset_t)(FLASH_PAGE_SIZE-1);
+}
+
+/* Past the session's data and statistics */
+static inline flash_offset_t log_desc_end(const logged_data_descriptor_t *d)
+{
+    return d->flags == LOG_DESC_FLAGS_V3S ? log_desc_stats(d) + LOG_STATS_MAX :
+        log_desc_start(d) + d->data_length;
+}
         
   
 
@@ -84,7 +382,7 @@ task_t *data_logger_task_create();
 
 void datalogger_init();
 
-log_index_t begin_sampling();
+u8 begin_sampling();
 void end_sampling();
 
 void log_data_sample(logged_data_type_t type, u8 length, u8 *data);
@@ -157,8 +157,8 @@ u8 egt_display_func(ui_mode_t mode, ui_display_event_t event)
         TempC = convert_thermocouple_volts_to_temp(&tc_data);
 
 #if 0
-        send_msg(BROADCAST_NODE_ID, 0xCA, 4, (u8 *)&tc_data); 
-        send_msg(BROADCAST_NODE_ID, 0xCB, 2, (u8 *)&TempC); 
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xCA, 4, (u8 *)&tc_data); 
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xCB, 2, (u8 *)&TempC); 
 #endif   
         if (mode == MODE_EGT_PEAK)
         {            
@@ -201,6 +201,15 @@ u8 egt_display_func(ui_mode_t mode, ui_display_event_t event)
     output_temperature(mode, TempC, dmode);
     return 0;
 }
+
+s16 egt_get_celsius()
+{
+    if (tc_status != 0)
+    {
+        return EGT_INVALID;
+    }
+    return convert_thermocouple_volts_to_temp(&tc_data);
+}
     
 static inline u8 egt_config_func(ui_mode_t mode, ui_display_event_t event)
 {
@@ -241,7 +250,7 @@ u8 wideband_display_func(ui_mode_t mode, ui_display_event_t event)
     s16 number = 0;
 
 #if 0
-    send_msg(BROADCAST_NODE_ID, 0x34, 2, &ds2760_vin);
+    send_msg(&uart_link, BROADCAST_NODE_ID, 0x34, 2, &ds2760_vin);
 #endif
 
     if (tc_status != 0)
@@ -293,7 +302,7 @@ void egt_read_thermocouple()
     u8 vin[2];
     tc_status |= ow_2760_read_reg(OW_2760_REG_VOLTS_MSB, vin, 2);
 
-//    send_msg(BROADCAST_NODE_ID, 0x35, 2, vin);
+//    send_msg(&uart_link, BROADCAST_NODE_ID, 0x35, 2, vin);
 
     /* Example with Vin = 2.500 on board F (something wrong with this one):
      * MSB = 0x59 LSB = 0x70    01011001 01110000
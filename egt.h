@@ -37,5 +37,8 @@ extern u8                      tc_status;
 
 void egt_read_thermocouple();
 
+#define EGT_INVALID     ((s16)0x8000)   /* thermocouple module didn't answer */
+s16 egt_get_celsius();
+
 
 #endif /* !EGT_H */
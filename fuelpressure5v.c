@@ -149,22 +149,10 @@ void fp_adc_callback(adc_context_t *ctx)
 
 
 
-u8 fp_display_func(ui_mode_t mode, ui_display_event_t event)
+/* Absolute fuel pressure in mbar */
+static u16 fp_get_mbar()
 {
     u16 vofs10q6 = current_fp_accum;
-    u8 is_metric = 0;
-    center_letter_t cflags = CENTER_NONE;
-    number_display_flags_t dflags = DFLAGS_NONE;
-
-    if (event >= IN_CONFIG)
-        return fp_config_func(mode, event);
-
-    if (((mode == MODE_FP_RELATIVE) && fp_display_mode.metric.relative) ||
-        (mode == MODE_FP_ABSOLUTE && fp_display_mode.metric.absolute) ||
-        (mode == MODE_FP_RELATIVE_TROUGH && fp_display_mode.metric.trough))
-    {
-        is_metric = 1;
-    }
 
     if (vofs10q6 > ZERO_OFFSET_10Q6)
     {
@@ -184,6 +172,32 @@ u8 fp_display_func(ui_mode_t mode, ui_display_event_t event)
     vofs10q6 += 1013;
     vofs10q6 -= fixup;
 
+    return vofs10q6;
+}
+
+/* Fuel pressure over manifold pressure, in mbar */
+s16 fp_get_relative_mbar()
+{
+    return fp_get_mbar() - boost_get_mbar();
+}
+
+u8 fp_display_func(ui_mode_t mode, ui_display_event_t event)
+{
+    u16 vofs10q6 = fp_get_mbar();
+    u8 is_metric = 0;
+    center_letter_t cflags = CENTER_NONE;
+    number_display_flags_t dflags = DFLAGS_NONE;
+
+    if (event >= IN_CONFIG)
+        return fp_config_func(mode, event);
+
+    if (((mode == MODE_FP_RELATIVE) && fp_display_mode.metric.relative) ||
+        (mode == MODE_FP_ABSOLUTE && fp_display_mode.metric.absolute) ||
+        (mode == MODE_FP_RELATIVE_TROUGH && fp_display_mode.metric.trough))
+    {
+        is_metric = 1;
+    }
+
     if (mode == MODE_FP_RELATIVE || mode == MODE_FP_RELATIVE_TROUGH)
     {
         vofs10q6 -= boost_get_mbar();
@@ -26,6 +26,7 @@
 #define FUELPRESSURE5V_H
 
 void fp_init(adc_context_t *adc_context);
+s16 fp_get_relative_mbar();
 
 
 #endif /* !FUELPRESSURE5V_H */
@@ -0,0 +1,540 @@
+/******************************************************************************
+* File:              loganalyze.c
+* Author:            Kevin Day
+* Date:              November, 2005
+* Description:       Offline queries over binary sample dumps (psamp ... bin)
+*
+*
+* Copyright (c) 2005 Kevin Day
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "datalogger.h"
+#include "logdecode.h"
+
+/* The index keeps, for every second that has samples of a given type,
+ * where the first of them is and the min/max of their values.  Range
+ * queries jump straight to the first bucket; per-second queries never
+ * touch the dump at all.
+ *
+ * It is cached next to the dump as <file>.idx in host byte order and is
+ * rebuilt whenever the dump's size or mtime no longer match. */
+#define IDX_MAGIC       "TDSI"
+#define IDX_VERSION     2
+#define BUCKET_USEC     1000000ULL
+
+typedef struct {
+    u32     sec;
+    u32     offset;         /* resume point for the first sample of this */
+    unsigned long long resume_t;    /* type in this second; see log_reader_t */
+    u32     count;
+    u32     min;
+    u32     max;
+} idx_bucket_t;
+
+typedef struct {
+    u8      type;
+    u8      width;
+    u16     reserved;
+    u32     samples;
+    u32     first_bucket;
+    u32     nbuckets;
+} idx_type_t;
+
+typedef struct {
+    char    magic[4];
+    u16     version;
+    u16     ntypes;
+    u32     nbuckets;
+    u32     reserved;
+    unsigned long long file_size;
+    long long file_mtime;
+} idx_header_t;
+
+typedef struct {
+    const char      *name;
+    const u8        *data;
+    u32             length;
+    int             version;
+    idx_header_t    hdr;
+    idx_type_t      *types;
+    idx_bucket_t    *buckets;
+} log_file_t;
+
+/* Per type bucket lists while building. */
+typedef struct {
+    idx_type_t      t;
+    idx_bucket_t    *b;
+    u32             alloc;
+} build_type_t;
+
+static int build_index(log_file_t *lf)
+{
+    build_type_t *bt[256];
+    u8 order[256];
+    unsigned ntypes = 0;
+    log_reader_t r;
+    log_sample_t smp;
+    u32 total = 0;
+    unsigned i;
+    int ret = 0;
+
+    memset(bt, 0, sizeof(bt));
+    log_reader_init(&r, lf->version, lf->data, lf->length);
+
+    while (log_reader_next(&r, &smp))
+    {
+        u32 sec = smp.t_usec / BUCKET_USEC;
+        u32 v = log_sample_value(smp.value, smp.width);
+        build_type_t *b = bt[smp.type];
+        idx_bucket_t *bk;
+
+        if (!b)
+        {
+            b = calloc(1, sizeof(*b));
+            if (!b)
+            {
+                ret = -1;
+                break;
+            }
+            b->t.type  = smp.type;
+            b->t.width = smp.width;
+            bt[smp.type] = b;
+            order[ntypes++] = smp.type;
+        }
+        ++b->t.samples;
+
+        bk = b->t.nbuckets ? &b->b[b->t.nbuckets-1] : NULL;
+        if (!bk || bk->sec != sec)
+        {
+            if (b->t.nbuckets == b->alloc)
+            {
+                u32 n = b->alloc ? b->alloc*2 : 256;
+                idx_bucket_t *nb = realloc(b->b, n * sizeof(*nb));
+                if (!nb)
+                {
+                    ret = -1;
+                    break;
+                }
+                b->b = nb;
+                b->alloc = n;
+            }
+            bk = &b->b[b->t.nbuckets++];
+            bk->sec    = sec;
+            bk->offset   = r.resume;
+            bk->resume_t = r.resume_t;
+            bk->count  = 0;
+            bk->min    = v;
+            bk->max    = v;
+            ++total;
+        }
+        ++bk->count;
+        if (v < bk->min)
+        {
+            bk->min = v;
+        }
+        if (v > bk->max)
+        {
+            bk->max = v;
+        }
+    }
+
+    if (!ret)
+    {
+        lf->types   = malloc(ntypes * sizeof(idx_type_t) + 1);
+        lf->buckets = malloc(total * sizeof(idx_bucket_t) + 1);
+        if (!lf->types || !lf->buckets)
+        {
+            ret = -1;
+        }
+    }
+    if (!ret)
+    {
+        u32 nb = 0;
+        for(i=0; i<ntypes; i++)
+        {
+            build_type_t *b = bt[order[i]];
+            b->t.first_bucket = nb;
+            lf->types[i] = b->t;
+            memcpy(&lf->buckets[nb], b->b, b->t.nbuckets * sizeof(idx_bucket_t));
+            nb += b->t.nbuckets;
+        }
+        lf->hdr.ntypes   = ntypes;
+        lf->hdr.nbuckets = total;
+    }
+
+    for(i=0; i<ntypes; i++)
+    {
+        free(bt[order[i]]->b);
+        free(bt[order[i]]);
+    }
+    return ret;
+}
+
+static int load_index(log_file_t *lf, const char *idxname)
+{
+    FILE *f = fopen(idxname, "rb");
+    idx_header_t h;
+    int ret = -1;
+
+    if (!f)
+    {
+        return -1;
+    }
+    if (fread(&h, sizeof(h), 1, f) == 1 &&
+        !memcmp(h.magic, IDX_MAGIC, 4) && h.version == IDX_VERSION &&
+        h.file_size == lf->hdr.file_size && h.file_mtime == lf->hdr.file_mtime)
+    {
+        lf->types   = malloc(h.ntypes * sizeof(idx_type_t) + 1);
+        lf->buckets = malloc(h.nbuckets * sizeof(idx_bucket_t) + 1);
+        if (lf->types && lf->buckets &&
+            fread(lf->types, sizeof(idx_type_t), h.ntypes, f) == h.ntypes &&
+            fread(lf->buckets, sizeof(idx_bucket_t), h.nbuckets, f) == h.nbuckets)
+        {
+            lf->hdr = h;
+            ret = 0;
+        }
+        else
+        {
+            free(lf->types);
+            free(lf->buckets);
+            lf->types = NULL;
+            lf->buckets = NULL;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+/* A read-only archive just means the index isn't cached. */
+static void save_index(log_file_t *lf, const char *idxname)
+{
+    FILE *f = fopen(idxname, "wb");
+
+    if (!f)
+    {
+        return;
+    }
+    if (fwrite(&lf->hdr, sizeof(lf->hdr), 1, f) != 1 ||
+        fwrite(lf->types, sizeof(idx_type_t), lf->hdr.ntypes, f) != lf->hdr.ntypes ||
+        fwrite(lf->buckets, sizeof(idx_bucket_t), lf->hdr.nbuckets, f) != lf->hdr.nbuckets)
+    {
+        fclose(f);
+        unlink(idxname);
+        return;
+    }
+    fclose(f);
+}
+
+static int open_log(log_file_t *lf, const char *name, int rebuild)
+{
+    struct stat st;
+    char idxname[1024];
+    int fd;
+
+    memset(lf, 0, sizeof(*lf));
+    lf->name = name;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    lf->length = st.st_size;
+    if (lf->length)
+    {
+        lf->data = mmap(NULL, lf->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (lf->data == MAP_FAILED)
+        {
+            fprintf(stderr, "%s: mmap: %s\n", name, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    lf->version = log_detect_version(lf->data, lf->length);
+
+    memcpy(lf->hdr.magic, IDX_MAGIC, 4);
+    lf->hdr.version    = IDX_VERSION;
+    lf->hdr.file_size  = st.st_size;
+    lf->hdr.file_mtime = st.st_mtime;
+
+    snprintf(idxname, sizeof(idxname), "%s.idx", name);
+    if (rebuild || load_index(lf, idxname))
+    {
+        if (build_index(lf))
+        {
+            fprintf(stderr, "%s: out of memory building index\n", name);
+            return -1;
+        }
+        save_index(lf, idxname);
+    }
+    return 0;
+}
+
+static void close_log(log_file_t *lf)
+{
+    if (lf->data)
+    {
+        munmap((void *)lf->data, lf->length);
+    }
+    free(lf->types);
+    free(lf->buckets);
+}
+
+static idx_type_t *find_type(log_file_t *lf, u8 type)
+{
+    unsigned i;
+
+    for(i=0; i<lf->hdr.ntypes; i++)
+    {
+        if (lf->types[i].type == type)
+        {
+            return &lf->types[i];
+        }
+    }
+    return NULL;
+}
+
+static void print_time(unsigned long long t)
+{
+    printf("%llu.%06llu", t/1000000, t%1000000);
+}
+
+static void query_types(log_file_t *lf, const char *prefix)
+{
+    unsigned i;
+
+    for(i=0; i<lf->hdr.ntypes; i++)
+    {
+        idx_type_t *t = &lf->types[i];
+        idx_bucket_t *first = &lf->buckets[t->first_bucket];
+        idx_bucket_t *last  = &lf->buckets[t->first_bucket + t->nbuckets - 1];
+
+        printf("%stype %3d width %2d samples %8lu seconds %6lu..%lu\n", prefix,
+               t->type, t->width, t->samples, first->sec, last->sec);
+    }
+}
+
+static void query_persec(log_file_t *lf, const char *prefix, u8 type)
+{
+    idx_type_t *t = find_type(lf, type);
+    u32 i;
+
+    if (!t)
+    {
+        return;
+    }
+    for(i=0; i<t->nbuckets; i++)
+    {
+        idx_bucket_t *b = &lf->buckets[t->first_bucket + i];
+        printf("%s%6lu %5lu min %10lu max %10lu\n", prefix, b->sec, b->count,
+               b->min, b->max);
+    }
+}
+
+/* Binary search for the first bucket that can hold t1, then walk the
+ * dump from there until past t2. */
+static void query_range(log_file_t *lf, const char *prefix, u8 type,
+                        unsigned long long t1, unsigned long long t2)
+{
+    idx_type_t *t = find_type(lf, type);
+    idx_bucket_t *bk;
+    log_reader_t r;
+    log_sample_t smp;
+    u32 lo, hi, sec = t1 / BUCKET_USEC;
+
+    if (!t || !t->nbuckets)
+    {
+        return;
+    }
+    bk = &lf->buckets[t->first_bucket];
+    lo = 0;
+    hi = t->nbuckets;
+    while (lo < hi)
+    {
+        u32 mid = (lo + hi) / 2;
+        if (bk[mid].sec < sec)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo == t->nbuckets)
+    {
+        return;
+    }
+
+    log_reader_init(&r, lf->version, lf->data, lf->length);
+    log_reader_seek(&r, bk[lo].offset, bk[lo].resume_t);
+
+    while (log_reader_next(&r, &smp))
+    {
+        /* v1 interleaved samples may step back slightly, so only stop
+         * once well past the window. */
+        if (smp.t_usec > t2 + BUCKET_USEC)
+        {
+            break;
+        }
+        if (smp.type != type || smp.t_usec < t1 || smp.t_usec > t2)
+        {
+            continue;
+        }
+        printf("%s", prefix);
+        print_time(smp.t_usec);
+        if (smp.width <= 4)
+        {
+            printf(" %lu\n", log_sample_value(smp.value, smp.width));
+        }
+        else
+        {
+            int i;
+            for(i=0; i<smp.width; i++)
+            {
+                printf(" %02X", smp.value[i]);
+            }
+            printf("\n");
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r] <query> <file.psamp> [...]\n"
+            "  -r                     rebuild the index even if cached\n"
+            "queries:\n"
+            "  types                  types present, sample counts and spans\n"
+            "  persec <type>          per second sample count, min and max\n"
+            "  range <type> <t1> <t2> samples of type from t1 to t2 seconds\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int rebuild = 0;
+    int c, i, nargs;
+    const char *query;
+    u8 type = 0;
+    unsigned long long t1 = 0, t2 = 0;
+
+    while ((c = getopt(argc, argv, "rh")) != -1)
+    {
+        switch (c)
+        {
+            case 'r':
+                rebuild = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    query = argv[optind++];
+
+    if (!strcmp(query, "types"))
+    {
+        nargs = 0;
+    }
+    else if (!strcmp(query, "persec"))
+    {
+        nargs = 1;
+    }
+    else if (!strcmp(query, "range"))
+    {
+        nargs = 3;
+    }
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (argc - optind < nargs + 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (nargs >= 1)
+    {
+        type = strtoul(argv[optind], NULL, 0);
+    }
+    if (nargs == 3)
+    {
+        t1 = strtod(argv[optind+1], NULL) * 1e6;
+        t2 = strtod(argv[optind+2], NULL) * 1e6;
+    }
+    optind += nargs;
+
+    for(i=optind; i<argc; i++)
+    {
+        log_file_t lf;
+        char prefix[1024];
+
+        if (open_log(&lf, argv[i], rebuild))
+        {
+            continue;
+        }
+
+        /* Tag lines with the file name when querying several. */
+        if (argc - optind > 1)
+        {
+            snprintf(prefix, sizeof(prefix), "%s: ", argv[i]);
+        }
+        else
+        {
+            prefix[0] = '\0';
+        }
+
+        if (!strcmp(query, "types"))
+        {
+            query_types(&lf, prefix);
+        }
+        else if (!strcmp(query, "persec"))
+        {
+            query_persec(&lf, prefix, type);
+        }
+        else
+        {
+            query_range(&lf, prefix, type, t1, t2);
+        }
+        close_log(&lf);
+    }
+    return 0;
+}
@@ -0,0 +1,1028 @@
+/******************************************************************************
+* File:              logdecode.c
+* Author:            Kevin Day
+* Date:              November, 2005
+* Description:       Host side decoding and export of downloaded log samples
+*
+*
+* Copyright (c) 2005 Kevin Day
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "types.h"
+#include "datalogger.h"
+#include "logdecode.h"
+
+#define COLUMN_INITIAL_ALLOC    1024
+
+static log_column_t *column_get(log_columns_t *cols, u8 type, u8 width)
+{
+    log_column_t *c = cols->column[type];
+
+    if (!c)
+    {
+        c = calloc(1, sizeof(*c));
+        if (!c)
+        {
+            return NULL;
+        }
+        c->type  = type;
+        c->width = width;
+        cols->column[type] = c;
+        cols->order[cols->ncolumns++] = type;
+    }
+    return c;
+}
+
+static int column_append(log_column_t *c, unsigned long long t, const u8 *val)
+{
+    if (c->count == c->alloc)
+    {
+        u32 n = c->alloc ? c->alloc*2 : COLUMN_INITIAL_ALLOC;
+        unsigned long long *tp;
+        u8 *vp;
+
+        tp = realloc(c->time_usec, n * sizeof(*tp));
+        if (!tp)
+        {
+            return -1;
+        }
+        c->time_usec = tp;
+        vp = realloc(c->values, n * c->width);
+        if (!vp && c->width)
+        {
+            return -1;
+        }
+        c->values = vp;
+        c->alloc = n;
+    }
+    c->time_usec[c->count] = t;
+    memcpy(c->values + c->count*c->width, val, c->width);
+    ++c->count;
+    return 0;
+}
+
+/******************************************************************************
+* log_next_sample
+*        Return the sample at or after *si and advance *si past it, or NULL
+*        at the end of the buffer.  Octets that can't start a sample (erased
+*        flash, corruption) are stepped over one at a time and counted.
+*******************************************************************************/
+const u8 *log_next_sample(const u8 *buf, u32 length, u32 *si, u32 *garbage)
+{
+    while (*si + SAMPLE_HDR_SIZE <= length)
+    {
+        const u8 *sp = &buf[*si];
+        u8 len = sp[0]>>4;
+
+        if ((sp[0]&0xF) != 0xA)
+        {
+            if (garbage)
+            {
+                ++*garbage;
+            }
+            ++*si;
+            continue;
+        }
+        if (*si + SAMPLE_HDR_SIZE + len > length)
+        {
+            break;
+        }
+        *si += SAMPLE_HDR_SIZE + len;
+        return sp;
+    }
+    return NULL;
+}
+
+/******************************************************************************
+* log_reader
+*******************************************************************************/
+void log_reader_init(log_reader_t *r, int version, const u8 *buf, u32 length)
+{
+    memset(r, 0, sizeof(*r));
+    r->version = version;
+    r->buf     = buf;
+    r->length  = length;
+}
+
+/* v1 and v2 count in microseconds; v3 in LOG_TIME_HZ, wrapping at 32 bits. */
+static unsigned long long time_wrap(const log_reader_t *r)
+{
+    return r->version == 3 ? LOG_TIME_WRAP : SAMPLE_TIME_WRAP_USEC;
+}
+
+static unsigned long long time_usec(const log_reader_t *r, unsigned long long t)
+{
+    return r->version == 3 ? t * 1000000 / LOG_TIME_HZ : t;
+}
+
+void log_reader_seek(log_reader_t *r, u32 resume, unsigned long long resume_t)
+{
+    unsigned long long base = resume_t - resume_t % time_wrap(r);
+
+    r->pos  = resume;
+    r->mask = 0;
+    memset(&r->tu, 0, sizeof(r->tu));
+    r->tu.base   = base;
+    r->t         = base;
+    r->have_time = 1;
+}
+
+static int log_reader_next_v1(log_reader_t *r, log_sample_t *s)
+{
+    const u8 *sp = log_next_sample(r->buf, r->length, &r->pos, &r->garbage);
+
+    if (!sp)
+    {
+        return 0;
+    }
+    s->type   = sp[1];
+    s->width  = sp[0]>>4;
+    s->value  = sp + SAMPLE_HDR_SIZE;
+    s->t_usec = log_unwrap_time(&r->tu, log_sample_time(sp));
+    r->resume   = sp - r->buf;
+    r->resume_t = s->t_usec;
+    return 1;
+}
+
+static int get_varint(const u8 *p, const u8 *end, u32 *v, const u8 **next)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (p < end && shift < 32)
+    {
+        *v |= (u32)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80))
+        {
+            *next = p;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+typedef struct {
+    const u8    *p;
+    const u8    *end;
+    u8          bits;                   /* used of *p */
+} bit_reader_t;
+
+static int get_bits(bit_reader_t *br, int n, u32 *v)
+{
+    *v = 0;
+    while (n--)
+    {
+        if (br->p >= br->end)
+        {
+            return -1;
+        }
+        *v = *v << 1 | ((*br->p >> (7 - br->bits)) & 1);
+        if (++br->bits == 8)
+        {
+            br->p++;
+            br->bits = 0;
+        }
+    }
+    return 0;
+}
+
+static int get_rice(bit_reader_t *br, u16 *acc, int width, u32 *z)
+{
+    u32 bit, low;
+    int k = log_v3_k(*acc);
+    int q = 0;
+
+    do {
+        if (get_bits(br, 1, &bit))
+        {
+            return -1;
+        }
+    } while (bit && ++q < LOG_V3_ESCAPE);
+
+    if (q == LOG_V3_ESCAPE)
+    {
+        if (get_bits(br, width, z))
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if (get_bits(br, k, &low))
+        {
+            return -1;
+        }
+        *z = (u32)q << k | low;
+    }
+    *acc = log_v3_adapt(*acc, *z);
+    return 0;
+}
+
+static void reset_v3(log_reader_t *r)
+{
+    memset(r->v3_last, 0, sizeof(r->v3_last));
+    memset(r->v3_acc, 0, sizeof(r->v3_acc));
+    r->v3_delta = 0;
+    r->v3_mask = 0;
+}
+
+/* The bit stream of a v3 record into r->vals, laid out as a v2 record's
+ * values.  *p moves past it. */
+static int decode_v3(log_reader_t *r, u32 mask, const u8 **p, const u8 *end, u32 *delta)
+{
+    bit_reader_t br;
+    u32 z;
+    u8 *vp = r->vals;
+    int i, j, size;
+
+    br.p    = *p;
+    br.end  = end;
+    br.bits = 0;
+
+    if (get_rice(&br, &r->v3_acc[LOG_MAX_CHANNELS], 32, &z))
+    {
+        return -1;
+    }
+    r->v3_delta += (z >> 1) ^ -(z & 1);
+    *delta = r->v3_delta;
+
+    for(i=0; i<LOG_MAX_CHANNELS; i++)
+    {
+        if (!(mask & (1<<i)))
+        {
+            continue;
+        }
+        size = log_type_size(i+1);
+        if (size == 2)
+        {
+            if (get_rice(&br, &r->v3_acc[i], 16, &z))
+            {
+                return -1;
+            }
+            r->v3_last[i] += (z >> 1) ^ -(z & 1);
+            *vp++ = r->v3_last[i];
+            *vp++ = r->v3_last[i] >> 8;
+            continue;
+        }
+        if (!size)
+        {
+            if (get_bits(&br, 8, &z) || z > LOG_USER_MAX)
+            {
+                return -1;
+            }
+            *vp++ = z;
+            size = z;
+        }
+        for(j=0; j<size; j++)
+        {
+            if (get_bits(&br, 8, &z))
+            {
+                return -1;
+            }
+            *vp++ = z;
+        }
+    }
+    *p = br.p + (br.bits != 0);
+    return 0;
+}
+
+/* Anything that doesn't parse costs the rest of its page; the next page
+ * starts with a keyframe. */
+static void skip_page_v2(log_reader_t *r, u32 page_end)
+{
+    r->garbage += page_end - r->pos;
+    r->pos  = page_end;
+    r->mask = 0;
+}
+
+static int log_reader_next_v2(log_reader_t *r, log_sample_t *s)
+{
+    for(;;)
+    {
+        u32 page_end, mask, delta, i;
+        const u8 *p, *end;
+
+        if (r->mask)
+        {
+            /* hand out the current record a channel at a time */
+            for(i=0; !(r->mask & (1<<i)); i++)
+                ;
+            r->mask &= ~(1<<i);
+            s->type  = i+1;
+            s->width = log_type_size(s->type);
+            if (!s->width)
+            {
+                s->width = *r->vp++;
+            }
+            s->value  = r->vp;
+            s->t_usec = time_usec(r, r->t);
+            r->vp += s->width;
+            return 1;
+        }
+
+        if (r->pos >= r->length)
+        {
+            return 0;
+        }
+
+        page_end = (r->pos | (FLASH_PAGE_SIZE-1)) + 1;
+        if (page_end > r->length)
+        {
+            page_end = r->length;
+        }
+        p   = &r->buf[r->pos];
+        end = &r->buf[page_end];
+
+        /* 0xFF also starts a mask with bits 0-6 set and more; its next
+         * octet can't be 0xFF */
+        if (*p == LOG_V2_PAD && (p + 1 == end || p[1] == LOG_V2_PAD))
+        {
+            r->pos = page_end;
+            continue;
+        }
+        if (!(r->pos & (FLASH_PAGE_SIZE-1)))
+        {
+            if (r->version == 3 ? 
+                    (end - p < 2 || p[0] != LOG_V3_KEYFRAME || p[1] != 0x00) : 
+                    *p != LOG_V2_KEYFRAME)
+            {
+                skip_page_v2(r, page_end);
+                continue;
+            }
+            r->resume = r->pos;
+        }
+
+        if (r->version == 3 && *p == LOG_V3_SAME_MASK)
+        {
+            if (!r->v3_mask)
+            {
+                skip_page_v2(r, page_end);
+                continue;
+            }
+            mask = r->v3_mask;
+            p++;
+        }
+        else if (get_varint(p, end, &mask, &p))
+        {
+            skip_page_v2(r, page_end);
+            continue;
+        }
+
+        if (mask == 0)
+        {
+            u32 raw;
+
+            if (end - p < 4)
+            {
+                skip_page_v2(r, page_end);
+                continue;
+            }
+            raw = (u32)p[3]<<24 | (u32)p[2]<<16 | (u32)p[1]<<8 | p[0];
+            if (!r->have_time)
+            {
+                r->t = raw;
+                r->have_time = 1;
+            }
+            else
+            {
+                /* v2 and v3 times only move forward */
+                unsigned long long wrap = time_wrap(r);
+                unsigned long long cur = r->t % wrap;
+
+                r->t += (raw + wrap - cur) % wrap;
+            }
+            r->resume_t = r->t;
+            r->pos = p + 4 - r->buf;
+            reset_v3(r);
+            continue;
+        }
+
+        if (!r->have_time || mask >> LOG_MAX_CHANNELS)
+        {
+            skip_page_v2(r, page_end);
+            continue;
+        }
+        if (r->version == 3)
+        {
+            r->v3_mask = mask;
+            if (decode_v3(r, mask, &p, end, &delta))
+            {
+                skip_page_v2(r, page_end);
+                continue;
+            }
+            r->t   += delta;
+            r->mask = mask;
+            r->vp   = r->vals;
+            r->pos  = p - r->buf;
+            continue;
+        }
+        if (get_varint(p, end, &delta, &p))
+        {
+            skip_page_v2(r, page_end);
+            continue;
+        }
+
+        /* Size the record before handing any of it out. */
+        r->vp = p;
+        for(i=0; i<LOG_MAX_CHANNELS && p <= end; i++)
+        {
+            if (mask & (1<<i))
+            {
+                u8 size = log_type_size(i+1);
+                p += size ? size : (p < end ? *p + 1 : 1);
+            }
+        }
+        if (p > end)
+        {
+            skip_page_v2(r, page_end);
+            continue;
+        }
+
+        r->t   += delta;
+        r->mask = mask;
+        r->pos  = p - r->buf;
+    }
+}
+
+int log_reader_next(log_reader_t *r, log_sample_t *s)
+{
+    if (r->version >= 2)
+    {
+        return log_reader_next_v2(r, s);
+    }
+    return log_reader_next_v1(r, s);
+}
+
+long log_session_end(int version, u32 off, const u8 *buf, u32 length)
+{
+    u32 i;
+
+    if (version >= 2)
+    {
+        for(i=(FLASH_PAGE_SIZE - off%FLASH_PAGE_SIZE)%FLASH_PAGE_SIZE; i<length; i+=FLASH_PAGE_SIZE)
+        {
+            if (buf[i] == 0xFF)
+            {
+                return off + i;
+            }
+        }
+        return -1;
+    }
+
+    for(i=0; i<length && buf[i] == 0xFF; i++)
+        ;
+    return (length && i == length) ? (long)off : -1;
+}
+
+void log_desc_from_buf(const u8 *buf, logged_data_descriptor_t *desc)
+{
+    desc->flags = buf[0];
+    log_desc_set_seq(desc, buf[1] | (buf[4]>>3)<<8);
+    desc->data_start = ((buf[4]&7)<<16 | buf[3]<<8 | buf[2]);
+    desc->data_length = (buf[7]<<16 | buf[6]<<8 | buf[5]);
+}
+
+int log_stats_from_buf(const u8 *buf, u32 length, log_channel_stats_t *st)
+{
+    u32 size = length >= 2 ? log_stats_size(buf) : 0;
+    int i;
+
+    if (!size || size > length)
+    {
+        return -1;
+    }
+    for(i=0; i<buf[1]; i++)
+    {
+        const u8 *e = &buf[2 + i*LOG_STATS_ENTRY];
+
+        st[i].type  = e[0];
+        st[i].min   = e[2]<<8 | e[1];
+        st[i].max   = e[4]<<8 | e[3];
+        st[i].count = (u32)e[8]<<24 | (u32)e[7]<<16 | (u32)e[6]<<8 | e[5];
+        st[i].sum   = (unsigned long long)e[13]<<32 | (u32)e[12]<<24 | 
+                      (u32)e[11]<<16 | (u32)e[10]<<8 | e[9];
+    }
+    return buf[1];
+}
+
+u32 log_preview_from_buf(const u8 *buf, u32 length, log_preview_t *pv)
+{
+    u32 n = LOG_PREVIEW_HDR;
+    int c;
+
+    if (length < LOG_PREVIEW_HDR || (buf[0] & ~1) != LOG_PREVIEW_TAG)
+    {
+        return 0;
+    }
+    pv->level  = buf[0] & 1;
+    pv->seq    = buf[2]<<8 | buf[1];
+    pv->bucket = buf[4]<<8 | buf[3];
+    pv->offset = (u32)buf[7]<<16 | buf[6]<<8 | buf[5];
+    pv->mask   = buf[9]<<8 | buf[8];
+    if (pv->mask >> LOG_MAX_CHANNELS)
+    {
+        return 0;
+    }
+    for(c=0; c<LOG_MAX_CHANNELS; c++)
+    {
+        if (!(pv->mask & 1<<c))
+        {
+            continue;
+        }
+        if (n + 4 > length)
+        {
+            return 0;
+        }
+        pv->min[c] = buf[n+1]<<8 | buf[n];
+        pv->max[c] = buf[n+3]<<8 | buf[n+2];
+        n += 4;
+    }
+    return n;
+}
+
+long log_rle_expand(const u8 *code, u32 length, u8 *out, u32 room)
+{
+    u32 i = 0, n = 0, run;
+
+    while (i < length)
+    {
+        if (code[i] & 0x80)
+        {
+            if (i + 3 > length)
+            {
+                return -1;
+            }
+            run = ((code[i]&0x7F)<<8 | code[i+1]) + 1;
+            if (n + run > room)
+            {
+                return -1;
+            }
+            memset(out + n, code[i+2], run);
+            i += 3;
+        }
+        else
+        {
+            run = code[i] + 1;
+            if (i + 1 + run > length || n + run > room)
+            {
+                return -1;
+            }
+            memcpy(out + n, code + i + 1, run);
+            i += 1 + run;
+        }
+        n += run;
+    }
+    return n;
+}
+
+void log_print_stats(FILE *f, const log_channel_stats_t *st, int n)
+{
+    int i;
+
+    for(i=0; i<n; i++)
+    {
+        fprintf(f, "       type %2d  min %5u  max %5u  avg %8.1f  count %lu\n",
+                st[i].type, st[i].min, st[i].max, 
+                st[i].count ? (double)st[i].sum / st[i].count : 0.0, st[i].count);
+    }
+}
+
+int log_order_descriptors(logged_data_descriptor_t *desc, int count)
+{
+    int i, j, n = 0;
+    log_index_t newest = 0;
+
+    for(i=0; i<count; i++)
+    {
+        if (log_desc_valid(desc[i].flags))
+        {
+            if (!n || log_seq_cmp(log_desc_seq(&desc[i]), newest) > 0)
+            {
+                newest = log_desc_seq(&desc[i]);
+            }
+            desc[n++] = desc[i];
+        }
+    }
+
+    /* insertion sort on age */
+    for(i=1; i<n; i++)
+    {
+        logged_data_descriptor_t d = desc[i];
+        log_index_t age = (newest - log_desc_seq(&d)) & LOG_SEQ_MASK;
+
+        for(j=i; j>0 && ((newest - log_desc_seq(&desc[j-1])) & LOG_SEQ_MASK) < age; j--)
+        {
+            desc[j] = desc[j-1];
+        }
+        desc[j] = d;
+    }
+    return n;
+}
+
+/******************************************************************************
+* log_stream
+*******************************************************************************/
+void log_stream_init(log_stream_t *ls, int version, log_sample_fn_t fn, void *ctx)
+{
+    memset(ls, 0, sizeof(*ls));
+    ls->fn  = fn;
+    ls->ctx = ctx;
+    log_reader_init(&ls->r, version, NULL, 0);
+}
+
+void log_stream_start_near(log_stream_t *ls, unsigned long long t)
+{
+    ls->r.t         = t;
+    ls->r.have_time = 1;
+}
+
+static void log_stream_run(log_stream_t *ls, const u8 *buf, u32 length)
+{
+    log_sample_t s;
+
+    ls->r.buf     = buf;
+    ls->r.length  = length;
+    ls->r.pos     = 0;
+    ls->r.garbage = 0;
+    while (log_reader_next(&ls->r, &s))
+    {
+        ++ls->samples;
+        ls->fn(ls->ctx, &s);
+    }
+    ls->garbage += ls->r.garbage;
+}
+
+static void log_stream_feed_v1(log_stream_t *ls, const u8 *buf, u32 length)
+{
+    u32 si = 0;
+
+    /* Finish the sample split over the last chunk.  carry[0] has already
+     * been checked to be a sample header. */
+    while (ls->ncarry && si < length)
+    {
+        ls->carry[ls->ncarry++] = buf[si++];
+        if (ls->ncarry == SAMPLE_HDR_SIZE + (ls->carry[0]>>4))
+        {
+            log_stream_run(ls, ls->carry, ls->ncarry);
+            ls->ncarry = 0;
+        }
+    }
+
+    log_stream_run(ls, buf + si, length - si);
+    si += ls->r.pos;
+
+    /* The tail is either too short for a header or holds a partial
+     * sample; resync over it and keep what's left for next time. */
+    while (si < length && (buf[si]&0xF) != 0xA)
+    {
+        ++ls->garbage;
+        ++si;
+    }
+    if (si < length)
+    {
+        memcpy(ls->carry, &buf[si], length - si);
+        ls->ncarry = length - si;
+    }
+}
+
+void log_stream_feed(log_stream_t *ls, const u8 *buf, u32 length)
+{
+    if (ls->r.version == 1)
+    {
+        log_stream_feed_v1(ls, buf, length);
+        return;
+    }
+
+    /* Pages decode on their own; whole ones go straight from buf. */
+    while (length)
+    {
+        u32 n;
+
+        if (!ls->ncarry && length >= FLASH_PAGE_SIZE)
+        {
+            log_stream_run(ls, buf, FLASH_PAGE_SIZE);
+            buf += FLASH_PAGE_SIZE;
+            length -= FLASH_PAGE_SIZE;
+            continue;
+        }
+        n = FLASH_PAGE_SIZE - ls->ncarry;
+        if (n > length)
+        {
+            n = length;
+        }
+        memcpy(&ls->carry[ls->ncarry], buf, n);
+        ls->ncarry += n;
+        buf += n;
+        length -= n;
+        if (ls->ncarry == FLASH_PAGE_SIZE)
+        {
+            log_stream_run(ls, ls->carry, FLASH_PAGE_SIZE);
+            ls->ncarry = 0;
+        }
+    }
+}
+
+void log_stream_finish(log_stream_t *ls)
+{
+    if (ls->r.version >= 2 && ls->ncarry)
+    {
+        log_stream_run(ls, ls->carry, ls->ncarry);
+    }
+    else
+    {
+        ls->garbage += ls->ncarry;
+    }
+    ls->ncarry = 0;
+}
+
+/******************************************************************************
+* log_decode_columns
+*        Split one downloaded session into a column per sample type, with
+*        timestamps unwrapped into a 64 bit count.
+*******************************************************************************/
+int log_decode_columns(const u8 *buf, u32 length, int version, log_columns_t *cols)
+{
+    log_reader_t r;
+    log_sample_t smp;
+
+    memset(cols, 0, sizeof(*cols));
+    log_reader_init(&r, version, buf, length);
+
+    while (log_reader_next(&r, &smp))
+    {
+        log_column_t *c;
+
+        ++cols->samples;
+
+        c = column_get(cols, smp.type, smp.width);
+        if (!c)
+        {
+            return -1;
+        }
+        if (c->width != smp.width)
+        {
+            ++cols->skipped;
+        }
+        else if (column_append(c, smp.t_usec, smp.value))
+        {
+            return -1;
+        }
+    }
+    cols->garbage = r.garbage;
+    return 0;
+}
+
+void log_columns_free(log_columns_t *cols)
+{
+    unsigned i;
+
+    for(i=0; i<cols->ncolumns; i++)
+    {
+        log_column_t *c = cols->column[cols->order[i]];
+        free(c->time_usec);
+        free(c->values);
+        free(c);
+    }
+    memset(cols, 0, sizeof(*cols));
+}
+
+static void put_le16(u8 *p, u16 v)
+{
+    p[0] = v;
+    p[1] = v>>8;
+}
+
+static void put_le32(u8 *p, u32 v)
+{
+    p[0] = v;
+    p[1] = v>>8;
+    p[2] = v>>16;
+    p[3] = v>>24;
+}
+
+/******************************************************************************
+* log_write_columnar
+*        The arrays are written as they sit in memory, which matches the
+*        file format on a little endian host.
+*******************************************************************************/
+int log_write_columnar(const log_columns_t *cols, const char *filename)
+{
+    FILE *file;
+    u8 hdr[8];
+    unsigned i;
+    int ret = 0;
+
+    file = fopen(filename, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening \"%s\" for writing: %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+
+    memcpy(hdr, LOG_COL_MAGIC, 4);
+    put_le16(&hdr[4], LOG_COL_VERSION);
+    put_le16(&hdr[6], cols->ncolumns);
+    if (fwrite(hdr, 8, 1, file) != 1)
+    {
+        ret = -1;
+    }
+
+    for(i=0; i<cols->ncolumns && !ret; i++)
+    {
+        const log_column_t *c = cols->column[cols->order[i]];
+        hdr[0] = c->type;
+        hdr[1] = c->width;
+        put_le16(&hdr[2], 0);
+        put_le32(&hdr[4], c->count);
+        if (fwrite(hdr, 8, 1, file) != 1)
+        {
+            ret = -1;
+        }
+    }
+
+    for(i=0; i<cols->ncolumns && !ret; i++)
+    {
+        const log_column_t *c = cols->column[cols->order[i]];
+        if (!c->count)
+        {
+            continue;
+        }
+        if (fwrite(c->time_usec, sizeof(*c->time_usec), c->count, file) != c->count)
+        {
+            ret = -1;
+        }
+        else if (c->width &&
+                 fwrite(c->values, c->width, c->count, file) != c->count)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret)
+    {
+        fprintf(stderr, "fwrite failed: %s\n", strerror(errno));
+    }
+    fclose(file);
+    return ret;
+}
+
+/* Output is formatted straight into a large buffer and written out in
+ * blocks; no stdio formatting per field. */
+#define CSV_BUF_SIZE    65536
+#define CSV_ROW_MAX     (20 + 1 + 3 + 1 + 2*LOG_MAX_WIDTH + 1)
+
+typedef struct {
+    FILE    *file;
+    char    *p;
+    int     err;
+    char    buf[CSV_BUF_SIZE];
+} csv_out_t;
+
+static void csv_flush(csv_out_t *o)
+{
+    size_t n = o->p - o->buf;
+
+    if (n && fwrite(o->buf, 1, n, o->file) != n)
+    {
+        o->err = 1;
+    }
+    o->p = o->buf;
+}
+
+static void csv_put_dec(csv_out_t *o, unsigned long long v)
+{
+    char tmp[20];
+    int n = 0;
+
+    do
+    {
+        tmp[n++] = '0' + v%10;
+        v /= 10;
+    } while (v);
+
+    while (n)
+    {
+        *o->p++ = tmp[--n];
+    }
+}
+
+static void csv_put_hex(csv_out_t *o, const u8 *val, u8 width)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    int i;
+
+    /* most significant octet first */
+    for(i=width-1; i>=0; i--)
+    {
+        *o->p++ = hex[val[i]>>4];
+        *o->p++ = hex[val[i]&0xF];
+    }
+}
+
+static void csv_put_row(csv_out_t *o, const log_column_t *c, u32 i)
+{
+    const u8 *val = c->values + i*c->width;
+
+    if (o->p + CSV_ROW_MAX > o->buf + CSV_BUF_SIZE)
+    {
+        csv_flush(o);
+    }
+
+    csv_put_dec(o, c->time_usec[i]);
+    *o->p++ = ',';
+    csv_put_dec(o, c->type);
+    *o->p++ = ',';
+    if (c->width <= 4)
+    {
+        csv_put_dec(o, log_sample_value(val, c->width));
+    }
+    else
+    {
+        csv_put_hex(o, val, c->width);
+    }
+    *o->p++ = '\n';
+}
+
+/******************************************************************************
+* log_write_csv
+*        Each column is already in time order, so rows are produced by
+*        merging the column heads.  There are only a handful of columns.
+*******************************************************************************/
+int log_write_csv(const log_columns_t *cols, const char *filename)
+{
+    static const char header[] = "time_usec,type,value\n";
+    u32 pos[LOG_MAX_COLUMNS];
+    csv_out_t *o;
+    int ret;
+
+    o = malloc(sizeof(*o));
+    if (!o)
+    {
+        return -1;
+    }
+    o->file = fopen(filename, "w");
+    if (!o->file)
+    {
+        fprintf(stderr, "Error opening \"%s\" for writing: %s\n",
+                filename, strerror(errno));
+        free(o);
+        return -1;
+    }
+    o->err = 0;
+    memcpy(o->buf, header, sizeof(header)-1);
+    o->p = o->buf + sizeof(header)-1;
+
+    memset(pos, 0, sizeof(pos));
+    for(;;)
+    {
+        const log_column_t *best = NULL;
+        unsigned bi = 0;
+        unsigned i;
+
+        for(i=0; i<cols->ncolumns; i++)
+        {
+            const log_column_t *c = cols->column[cols->order[i]];
+            if (pos[i] < c->count &&
+                (!best || c->time_usec[pos[i]] < best->time_usec[pos[bi]]))
+            {
+                best = c;
+                bi = i;
+            }
+        }
+        if (!best)
+        {
+            break;
+        }
+        csv_put_row(o, best, pos[bi]++);
+    }
+
+    csv_flush(o);
+    if (o->err)
+    {
+        fprintf(stderr, "fwrite failed: %s\n", strerror(errno));
+    }
+    ret = o->err ? -1 : 0;
+    fclose(o->file);
+    free(o);
+    return ret;
+}
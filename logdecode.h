@@ -0,0 +1,273 @@
+/******************************************************************************
+* File:              logdecode.h
+* Author:            Kevin Day
+* Date:              November, 2005
+* Description:       Host side decoding and export of downloaded log samples
+*
+*
+* Copyright (c) 2005 Kevin Day
+*
+*     This program is free software: you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation, either version 3 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*******************************************************************************/
+
+#ifndef LOGDECODE_H
+#define LOGDECODE_H
+
+#include <stdio.h>
+#include "types.h"
+#include "datalogger.h"
+
+#define LOG_MAX_COLUMNS     256         /* one per data_type octet */
+#define LOG_MAX_WIDTH       16
+
+/* One column per logged_data_type_t.  The width is taken from the first
+ * sample of that type; later samples of a different length are counted
+ * in skipped instead of being stored. */
+typedef struct {
+    u8              type;
+    u8              width;              /* value octets per sample */
+    u32             count;
+    u32             alloc;
+    unsigned long long *time_usec;      /* unwrapped, from start of log */
+    u8              *values;            /* count * width, as logged (LE) */
+} log_column_t;
+
+typedef struct {
+    unsigned        ncolumns;
+    log_column_t    *column[LOG_MAX_COLUMNS];   /* indexed by data_type */
+    u8              order[LOG_MAX_COLUMNS];     /* types in first-seen order */
+    u32             samples;
+    u32             skipped;            /* samples with a width mismatch */
+    u32             garbage;            /* octets skipped to resync */
+} log_columns_t;
+
+/* Carries the tick wrap across a walk through a session.  A backward
+ * step of less than half the wrap period is an interleaved sample (ISR
+ * logging while a task sample is in flight), not a wrap. */
+typedef struct {
+    unsigned long long  base;
+    u32                 last;
+    int                 started;
+} log_time_unwrap_t;
+
+static inline unsigned long long log_unwrap_time(log_time_unwrap_t *u, u32 t)
+{
+    if (u->started && t < u->last && u->last - t > SAMPLE_TIME_WRAP_USEC/2)
+    {
+        u->base += SAMPLE_TIME_WRAP_USEC;
+    }
+    u->started = 1;
+    u->last = t;
+    return u->base + t;
+}
+
+static inline u32 log_sample_time(const u8 *sp)
+{
+    return (u32)sp[5]<<24 | (u32)sp[4]<<16 | (u32)sp[3]<<8 | sp[2];
+}
+
+/* Little endian value of up to four octets. */
+static inline u32 log_sample_value(const u8 *val, u8 width)
+{
+    u32 v = 0;
+    int b;
+
+    for(b=(width>4?4:width)-1; b>=0; b--)
+    {
+        v = v<<8 | val[b];
+    }
+    return v;
+}
+
+const u8 *log_next_sample(const u8 *buf, u32 length, u32 *si, u32 *garbage);
+
+/* One decoded sample, whichever format it came from. */
+typedef struct {
+    u8                  type;
+    u8                  width;
+    const u8            *value;
+    unsigned long long  t_usec;
+} log_sample_t;
+
+/* Walks a session in any format one sample at a time.  resume and
+ * resume_t give a point log_reader_seek() can restart from that still
+ * returns the current sample: the sample itself in v1, the start of its
+ * page (and the keyframe time) in v2 and v3.  resume_t is in the
+ * format's own units, LOG_TIME_HZ counts for v3. */
+typedef struct {
+    int                 version;
+    const u8            *buf;
+    u32                 length;
+    u32                 pos;
+    u32                 garbage;
+    u32                 resume;
+    unsigned long long  resume_t;
+    log_time_unwrap_t   tu;             /* v1 */
+    unsigned long long  t;              /* v2: time of the current record,
+                                           as resume_t */
+    int                 have_time;
+    u32                 mask;           /* v2: channels still to return */
+    const u8            *vp;
+    u8                  vals[LOG_V2_MAX_VALUES];    /* v3: decoded record */
+    u16                 v3_last[LOG_MAX_CHANNELS];
+    u16                 v3_acc[LOG_V3_STREAMS];
+    u32                 v3_delta;
+    u32                 v3_mask;
+} log_reader_t;
+
+void log_reader_init(log_reader_t *r, int version, const u8 *buf, u32 length);
+void log_reader_seek(log_reader_t *r, u32 resume, unsigned long long resume_t);
+int  log_reader_next(log_reader_t *r, log_sample_t *s);
+
+/* A raw session dump doesn't say which format it is; v2 and v3 always
+ * start with a keyframe, written differently. */
+static inline int log_detect_version(const u8 *buf, u32 length)
+{
+    if (length > 1 && buf[0] == LOG_V3_KEYFRAME && buf[1] == 0x00)
+    {
+        return 3;
+    }
+    return (length && buf[0] == LOG_V2_KEYFRAME) ? 2 : 1;
+}
+
+/* For a session with no recorded length: offset in the session where
+ * erased flash starts within buf (which sits at session offset off), or
+ * -1.  v2 and v3 pages can end in a run of 0xFF, so only an erased page
+ * start counts there. */
+long log_session_end(int version, u32 off, const u8 *buf, u32 length);
+
+/* A descriptor as it sits on flash (LOG_DESC_SIZE octets). */
+void log_desc_from_buf(const u8 *buf, logged_data_descriptor_t *desc);
+
+/* One channel of a session's statistics (LOG_STATS_MAGIC). */
+typedef struct {
+    u8                  type;
+    u16                 min;
+    u16                 max;
+    u32                 count;
+    unsigned long long  sum;
+} log_channel_stats_t;
+
+/* Octets of statistics that start with buf[0..1]; 0 if they don't. */
+static inline u32 log_stats_size(const u8 *buf)
+{
+    if (buf[0] != LOG_STATS_MAGIC || buf[1] > LOG_MAX_CHANNELS)
+    {
+        return 0;
+    }
+    return 2 + buf[1] * LOG_STATS_ENTRY;
+}
+
+/* Channels read into st (LOG_MAX_CHANNELS of room), or -1. */
+int  log_stats_from_buf(const u8 *buf, u32 length, log_channel_stats_t *st);
+void log_print_stats(FILE *f, const log_channel_stats_t *st, int n);
+
+/* One preview record (LOG_PREVIEW_TAG); min and max by channel, data
+ * type - 1, for the channels in mask. */
+typedef struct {
+    u8                  level;
+    u16                 seq;
+    u16                 bucket;
+    u32                 offset;         /* data reached by the bucket's end */
+    u16                 mask;
+    u16                 min[LOG_MAX_CHANNELS];
+    u16                 max[LOG_MAX_CHANNELS];
+} log_preview_t;
+
+/* Octets of the record at buf, or 0 if none starts there (the rest of
+ * the page is unused). */
+u32  log_preview_from_buf(const u8 *buf, u32 length, log_preview_t *pv);
+
+/* Expands a FLASH_CMD_READ_RLE reply (see dataflash_read_rle()) into
+ * out; returns the octets of flash it stands for, or -1 if the code is
+ * cut short or won't fit in room. */
+long log_rle_expand(const u8 *code, u32 length, u8 *out, u32 room);
+
+/* READ_RLE only pays over erased flash; literal data comes 13 octets a
+ * reply to READ_RANGE's 15.  So a reader uses READ_RANGE until a full
+ * reply of it is all 0xFF, then READ_RLE until a reply (expanded) is no
+ * more than READ_RANGE would have brought.  Given the last reply and
+ * which it was, whether to ask with READ_RLE next. */
+static inline int log_read_rle_next(int rle, const u8 *data, u32 length)
+{
+    u32 i;
+
+    if (rle)
+    {
+        return length > FLASH_RANGE_MAX;
+    }
+    if (length < FLASH_RANGE_MAX)
+    {
+        return 0;
+    }
+    for(i=0; i<length; i++)
+    {
+        if (data[i] != 0xFF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The firmware reuses descriptor slots round the ring.  Drops retired
+ * entries and puts the rest oldest first; returns how many are left. */
+int  log_order_descriptors(logged_data_descriptor_t *desc, int count);
+
+/* Incremental decoder for sessions that arrive in pieces.  v1 samples cut
+ * by a chunk boundary are carried over; v2 and v3 are gathered a page at
+ * a time.
+ * Call log_stream_finish() after the last chunk. */
+typedef void (*log_sample_fn_t)(void *ctx, const log_sample_t *s);
+
+typedef struct {
+    log_sample_fn_t     fn;
+    void                *ctx;
+    log_reader_t        r;
+    u8                  carry[FLASH_PAGE_SIZE];
+    u32                 ncarry;
+    u32                 samples;
+    u32                 garbage;
+} log_stream_t;
+
+void log_stream_init(log_stream_t *ls, int version, log_sample_fn_t fn, void *ctx);
+void log_stream_feed(log_stream_t *ls, const u8 *buf, u32 length);
+
+/* For a v2 or v3 stream fed from a page part way into a session: times
+ * then come out as they would reading from the start, given t (as
+ * resume_t) no later than the first keyframe fed and less than a wrap
+ * before it. */
+void log_stream_start_near(log_stream_t *ls, unsigned long long t);
+void log_stream_finish(log_stream_t *ls);
+
+int  log_decode_columns(const u8 *buf, u32 length, int version, log_columns_t *cols);
+void log_columns_free(log_columns_t *cols);
+
+/* Columnar file, all fields little endian:
+ *   "TDSC", u16 version, u16 ncolumns
+ *   ncolumns * { u8 type, u8 width, u16 reserved, u32 count }
+ *   then for each column in header order:
+ *     count * u64 time_usec, count * width value octets
+ */
+#define LOG_COL_MAGIC       "TDSC"
+#define LOG_COL_VERSION     1
+
+int  log_write_columnar(const log_columns_t *cols, const char *filename);
+
+/* time_usec,type,value rows merged in time order.  Values up to four
+ * octets are printed as unsigned decimal, wider ones as hex. */
+int  log_write_csv(const log_columns_t *cols, const char *filename);
+
+#endif /* !LOGDECODE_H */
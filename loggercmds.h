@@ -32,14 +32,33 @@ typedef enum {
     FLASH_CMD_LOG_SAMPLE        = 5,
     FLASH_CMD_READ_PAGE         = 6,
     FLASH_CMD_READ_BYTE         = 7,
+    FLASH_CMD_OP_DONE           = 8,        /* internal: queued flash op finished */
+    FLASH_CMD_SET_TRIGGER       = 9,        /* source, op, s16 level */
+    FLASH_CMD_SET_POLICY        = 10,       /* type, log_policy_t */
+    FLASH_CMD_GET_INFO          = 11,       /* reply: density code, log2 page
+                                             * data size, log2 flash size */
+    FLASH_CMD_GET_STATS         = 12,       /* reply: u16 samples dropped from
+                                             * interrupts, from tasks, records
+                                             * lost to a busy flash */
+    FLASH_CMD_HASH_RANGE        = 13,       /* u24 address, count, log2 unit;
+                                             * reply: count dataflash_hash()
+                                             * sums, FLASH_HASH_MAX at most */
+    FLASH_CMD_READ_RLE          = 14,       /* u24 address, u16 length; reply:
+                                             * dataflash_read_rle() code for as
+                                             * much as fits, FLASH_RLE_MAX */
     FLASH_CMD_ERROR             = 0xF
 } flash_cmd_t;
 
+#define FLASH_HASH_MAX  3               /* sums in a FLASH_CMD_HASH_RANGE reply */
+#define FLASH_RLE_MAX   14              /* code octets in a FLASH_CMD_READ_RLE reply */
+#define FLASH_RANGE_MAX 15              /* octets in a FLASH_CMD_READ_RANGE reply */
+
 typedef enum {
     FLASH_ERR_BAD_PARAMS = 1,
     FLASH_ERR_TOO_LARGE  = 2,
     FLASH_ERR_BAD_ADDR   = 3,
     FLASH_ERR_BAD_CMD    = 4,
+    FLASH_ERR_BUSY       = 5,
 } flash_err_t;
 
         
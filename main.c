@@ -175,7 +175,7 @@ int main()
     init_button(); 
 #endif
     
-//    send_msg(BROADCAST_NODE_ID, 0x11, 0, 0);
+//    send_msg(&uart_link, BROADCAST_NODE_ID, 0x11, 0, 0);
     
     /* non-preemptive static priority scheduler */    
     while(1)
@@ -359,7 +359,7 @@ void button_adc_callback(adc_context_t *ctx)
         static u16 msgctr;
         if (++msgctr >= 750)
         {
-            send_msg(BROADCAST_NODE_ID, 0xDE 2, &adc, 0);
+            send_msg(&uart_link, BROADCAST_NODE_ID, 0xDE 2, &adc, 0);
             msgctr = 0;
         }
     }
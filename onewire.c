@@ -73,7 +73,7 @@ void ow_restore_flags(u8 f)
 
     if (missed)
     {
-        send_msg(BROADCAST_NODE_ID, 0x7A, 0, NULL);
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0x7A, 0, NULL);
     }
 }
 #else
@@ -117,7 +117,10 @@ done:
 #define smart_delay_us(x) smart_delay_xx(4.6*x)
 
 #else
-#define smart_delay_us(x) _delay_loop_2( 4.6*x )
+/* By the timebase, so an interrupt can't stretch it.  Inside a time slot,
+ * up to the 15us read point, the cycle counted loop is closer. */
+#define smart_delay_us(x) timebase_delay(USEC_TO_TIMEBASE(x))
+#define slot_delay_us(x) _delay_loop_2( 4.6*x )
 #endif
 
                 
@@ -192,14 +195,14 @@ u8 ow_bit_io(u8 b)
     
     ow_assert_low();
 
-    smart_delay_us(1);
+    slot_delay_us(1);
 
     if (b)
     {
         ow_bus_float();
     }
 
-    smart_delay_us(14);
+    slot_delay_us(14);
 
     b = ow_read();
 
@@ -265,7 +268,7 @@ u8 ow_2760_write_reg(u8 reg, u8 val)
 #if 0
     {
         u8 msg[] = {reg, val, ret};
-        send_msg(BROADCAST_NODE_ID, 0xCA, 3, &msg);
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xCA, 3, &msg);
     }
 #endif
 
@@ -361,12 +364,12 @@ u8 ow_task()
                     }
                     if (result)
                     {
-                        send_msg(BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_CMD_RESET, 
+                        send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_CMD_RESET, 
                             1, &result);
                     }
                     else
                     {
-                        send_msg(BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_CMD_RESET, 
+                        send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_CMD_RESET, 
                             8, rombuf);
                     }
                 }
@@ -389,12 +392,12 @@ u8 ow_task()
                     
                     if (result)
                     {
-                        send_msg(BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_READ_2760, 
+                        send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_READ_2760, 
                             1, &result);
                     }
                     else
                     {
-                        send_msg(BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_READ_2760, 
+                        send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_READ_2760, 
                             buflen, buf);
                     }
                 }
@@ -420,7 +423,7 @@ u8 ow_task()
                         result = 0xEE;
                     }
                     
-                    send_msg(BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_WRITE_2760, 
+                    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_WRITE_2760, 
                         1, &result);
                 }
                 break;
@@ -438,7 +441,7 @@ u8 ow_task()
                         result = 0xEE;
                     }
                     
-                    send_msg(BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_RECALL_2760, 
+                    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_RECALL_2760, 
                         1, &result);
                 }
                 break;
@@ -456,7 +459,7 @@ u8 ow_task()
                         result = 0xEE;
                     }
                     
-                    send_msg(BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_COPY_2760, 
+                    send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_ONEWIRE<<4|ONEWIRE_COPY_2760, 
                         1, &result);
                 }
                 break;
@@ -49,6 +49,15 @@ typedef enum {
     PDATA_CONFIG_WORD_2H,
     PDATA_OILPRES_UNITS,
     PDATA_FUELPRESSURE_UNITS,
+    PDATA_TRIG_OPS,             /* log_trig_op_t, two bits per source */
+    PDATA_TRIG_LEVEL_BOOST_L,   /* then a 16 bit level per source */
+    PDATA_TRIG_LEVEL_BOOST_H,
+    PDATA_TRIG_LEVEL_EGT_L,
+    PDATA_TRIG_LEVEL_EGT_H,
+    PDATA_TRIG_LEVEL_FP_L,
+    PDATA_TRIG_LEVEL_FP_H,
+    PDATA_LOG_POLICY,           /* a log_policy_t per data type */
+    PDATA_LOG_POLICY_END = PDATA_LOG_POLICY + 11*4 - 1,
     PDATA_CHECKSUM              /* this must be the last entry */
 } persist_data_key_t;
 
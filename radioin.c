@@ -122,7 +122,7 @@ u8 radio_in_task()
     static u8 prev_next;
     if (prev_next != next_bit)
     {
-        send_msg(BROADCAST_NODE_ID, 0xdd, 7,
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xdd, 7,
                 received_bits);
         prev_next = next_bit;
     }
@@ -157,7 +157,7 @@ u8 rdo_screen_counter;
 u8 radioin_display_func(ui_mode_t mode, ui_display_event_t event)
 {
 //    u8 dbg[] = {rdo_screen_counter, no_signal_counter, is_valid};
-//    send_msg(BROADCAST_NODE_ID, 0x87, sizeof(dbg), dbg);
+//    send_msg(&uart_link, BROADCAST_NODE_ID, 0x87, sizeof(dbg), dbg);
 
     if (event >= IN_CONFIG)
         return 0;
@@ -360,8 +360,8 @@ done:
 #ifdef RDO_DBG
     if (invalidate)
     {
-        send_msg(BROADCAST_NODE_ID, 0xE8, 14, received_bits);
-        send_msg(BROADCAST_NODE_ID, 0xE9, 7, last_valid_msg);
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xE8, 14, received_bits);
+        send_msg(&uart_link, BROADCAST_NODE_ID, 0xE9, 7, last_valid_msg);
     }
 #endif
     return;
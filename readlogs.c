@@ -2,11 +2,12 @@
 * File:              readlogs.c
 * Author:            Kevin Day
 * Date:              March, 2007
-* Description:       
-*                    
-*                    
+* Description:       Standalone log reader.  Pulls the descriptors and
+*                    sessions out of the logger's dataflash, from the device
+*                    or from a raw image, and streams the decoded samples.
+*
 * Copyright (c) 2007 Kevin Day
-* 
+*
 *     This program is free software: you can redistribute it and/or modify
 *     it under the terms of the GNU General Public License as published by
 *     the Free Software Foundation, either version 3 of the License, or
@@ -24,37 +25,51 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <poll.h>
 
 #include "comms_generic.h"
+#include "tasks.h"
+#include "datalogger.h"
+#include "logdecode.h"
+
+#define FLASH_SIZE_DEFAULT  (512*1024L)  /* AT45DB041, or firmware without GET_INFO */
+#define DEVICE_CHUNK        1024        /* as READ_RLE replies, mostly */
+#define IMAGE_CHUNK         4096
+#define REPLY_TIMEOUT_MS    250
+#define REPLY_RETRIES       8
 
 char *serial_device = "/dev/ttyUSB0";
 int port_speed = B115200;
 
-int serial_fd = -1;
+comms_link_t serial_link;
+
 int open_serial()
 {
-    serial_fd = open(serial_device, O_RDWR|O_NOCTTY|O_NDELAY);
-    if (serial_fd == -1)
+    serial_link.fd = open(serial_device, O_RDWR|O_NOCTTY|O_NDELAY);
+    if (serial_link.fd == -1)
     {
-        perror("open_serial(): failed to open -");
+        fprintf(stderr, "open_serial(%s): failed to open - %s\n",
+                serial_device, strerror(errno));
     }
-    else
-    {
-//        fcntl(serial_fd, F_SETFL, FNDELAY);
-    }
-    return serial_fd;
+    return serial_link.fd;
 }
-    
+
 void config_port()
 {
+    int serial_fd = serial_link.fd;
     struct termios options;
     tcgetattr(serial_fd, &options);
     cfsetispeed(&options, port_speed);
     cfsetospeed(&options, port_speed);
-    
+
     options.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
     options.c_cflag |= (CLOCAL|CREAD | CS8);
 
@@ -63,13 +78,13 @@ void config_port()
     options.c_iflag &= ~(IXON|IXOFF|IXANY);
 
     options.c_oflag &= ~(OPOST);
-    
+
     /* block for up to 1/10 sec on read */
     options.c_cc[VMIN] = 1;
     options.c_cc[VTIME] = 1;
-    
+
     tcsetattr(serial_fd, TCSANOW, &options);
-    
+
 }
 
 u8 node_id = 0;
@@ -79,12 +94,12 @@ u8 get_node_id()
     return node_id;
 }
 
-void tx_enqueue(u8 data)
+void tx_enqueue(comms_link_t *link, u8 data)
 {
     int ret;
   again:
-    ret = write(serial_fd, &data, 1);
-    
+    ret = write(link->fd, &data, 1);
+
     if (ret == 0)
     {
         fprintf(stderr, "TX overflow\n");
@@ -92,103 +107,879 @@ void tx_enqueue(u8 data)
     }
     else if (ret == -1)
     {
+        if (errno == EAGAIN)
+        {
+            goto again;
+        }
         perror("tx_enqueue: ");
     }
 }
 
-int main(int argc, char *argv[])
+static inline void addr_to_buf(u32 addr, u8 *buf)
 {
-    char ch;
-    testmode_t mode = CONSOLE;
-    FILE *fp;
+    buf[0] = addr>>16;
+    buf[1] = addr>>8;
+    buf[2] = addr;
+}
+
+/* Sessions are read through one of these so the device and an image
+ * look the same to the decoder. */
+typedef struct log_source {
+    int         (*read)(struct log_source *src, u32 addr, u8 *buf, unsigned len);
+    unsigned    chunk;
+    int         fd;
+    int         dump_fd;        /* -1, or an image to copy everything into */
+    u32         size;           /* of the flash */
+    u8          page_shift;     /* log2 of the chip's page data */
+} log_source_t;
 
-    while ((ch=getopt(argc, argv, "p:r:t:b:v")) != -1)
+/* One READ_RANGE outstanding at a time; the reply carries no address,
+ * so a lost request would shift every reply after it. */
+typedef enum {
+    REPLY_WAIT,
+    REPLY_OK,
+    REPLY_ERROR,
+} reply_state_t;
+
+reply_state_t reply_state;
+u8 reply_code;
+u8 *reply_buf;
+unsigned reply_len;             /* READ_RLE: room, then octets expanded */
+u8 reply_err;
+int rle_unsupported;            /* firmware older than READ_RLE */
+int rle_next;                   /* see log_read_rle_next() */
+
+void packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload)
+{
+    if (code == reply_code && reply_state == REPLY_WAIT &&
+        code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RLE))
     {
-        switch(ch)
+        long n = log_rle_expand(payload, length, reply_buf, reply_len);
+
+        if (n > 0)
         {
-            case 'p':
-                serial_device = strdup(optarg);
-                break;
-            case 'b':
-                if (!strcmp(optarg, "115200"))
-                {
-                    port_speed = B115200;
-                }
-                else if (!strcmp(optarg, "38400"))
-                {
-                    port_speed = B38400;
-                }
-                fprintf(stderr, "Using %s bps\n", optarg);
-                break;
-            default:
-                fprintf(stderr, "Unknown option %c\n", ch);
-                return -1;
+            reply_len = n;
+            reply_state = REPLY_OK;
         }
+        else
+        {
+            reply_state = REPLY_ERROR;
+        }
+    }
+    else if (code == reply_code && reply_state == REPLY_WAIT)
+    {
+        if (length == reply_len)
+        {
+            memcpy(reply_buf, payload, length);
+            reply_state = REPLY_OK;
+        }
+        else
+        {
+            reply_state = REPLY_ERROR;
+        }
+    }
+    else if (code == (TASK_ID_COMMS<<4|COMMS_MSG_NAK) && length == 1)
+    {
+        /* our request was corrupted on the way; retried at once.  A NAK
+         * for anything else (noise) leaves the request to be answered. */
+        if (reply_state == REPLY_WAIT && payload[0] == reply_code)
+        {
+            reply_state = REPLY_ERROR;
+        }
+    }
+    else if (code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_ERROR))
+    {
+        reply_err = length ? payload[0] : 0;
+        fprintf(stderr, "device error %d\n", reply_err);
+        reply_state = REPLY_ERROR;
     }
+    rx_payload_release(link, payload);
+}
 
-    open_serial();
-    config_port();
+void bad_packet_received(comms_link_t *link, msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload)
+{
+    if (reply_state == REPLY_WAIT)
+    {
+        reply_state = REPLY_ERROR;
+    }
+}
 
+static int wait_reply()
+{
+    struct pollfd pfd;
+    u8 in[256];
+    int i, n;
 
+    pfd.fd = serial_link.fd;
+    pfd.events = POLLIN;
+
+    while (reply_state == REPLY_WAIT)
+    {
+        if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0)
+        {
+            return -1;
+        }
+        n = read(serial_link.fd, in, sizeof(in));
+        if (n < 0 && errno != EAGAIN)
+        {
+            perror("read");
+            return -1;
+        }
+        for(i=0; i<n; i++)
+        {
+            rx_notify(&serial_link, in[i], 0);
+        }
+    }
+    return reply_state == REPLY_OK ? 0 : -1;
 }
 
-static inline void addr_to_buf(u32 addr, u8 *buf)
+/* After a failed try the device may still answer it.  Read until the line
+ * goes quiet; packet_received drops whatever comes while not waiting, so
+ * a late reply isn't taken for the answer to the retry. */
+static void discard_late_replies()
 {
-    buf[0] = addr>>16;
-    buf[1] = addr>>8;
-    buf[2] = addr;
+    struct pollfd pfd;
+    u8 in[256];
+    int i, n;
+
+    pfd.fd = serial_link.fd;
+    pfd.events = POLLIN;
+
+    if (reply_state == REPLY_WAIT)
+    {
+        reply_state = REPLY_ERROR;
+    }
+    while (poll(&pfd, 1, REPLY_TIMEOUT_MS) > 0)
+    {
+        n = read(serial_link.fd, in, sizeof(in));
+        if (n <= 0)
+        {
+            break;
+        }
+        for(i=0; i<n; i++)
+        {
+            rx_notify(&serial_link, in[i], 0);
+        }
+    }
 }
 
+/* Up to len octets (FLASH_RANGE_MAX at most but over erased flash); how
+ * many, or -1 on no reply. */
+static long device_read_part(u32 addr, u8 *buf, unsigned len)
+{
+    int tries;
 
-    
-typedef enum {
-    READ_DESCRIPTORS,
-    READ_SAMPLES,
-} state_t;
+    for(tries=0; tries<REPLY_RETRIES; tries++)
+    {
+        u8 req[5];
 
-u32 waitaddr;
-u32 descriptor;
-state_t state;
+        if (tries)
+        {
+            discard_late_replies();
+        }
+        addr_to_buf(addr, req);
+        reply_state = REPLY_WAIT;
+        reply_err = 0;
+        reply_buf = buf;
+        if (rle_unsupported || !rle_next)
+        {
+            req[3] = len < FLASH_RANGE_MAX ? len : FLASH_RANGE_MAX;
+            reply_code = TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RANGE;
+            reply_len = req[3];
+            send_msg(&serial_link, 0xF, reply_code, 4, req);
+        }
+        else
+        {
+            if (len > 0xFFFF)
+            {
+                len = 0xFFFF;
+            }
+            req[3] = len>>8;
+            req[4] = len;
+            reply_code = TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RLE;
+            reply_len = len;
+            send_msg(&serial_link, 0xF, reply_code, 5, req);
+        }
+
+        if (!wait_reply())
+        {
+            rle_next = log_read_rle_next(reply_code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RLE),
+                                         buf, reply_len);
+            return reply_len;
+        }
+        if (reply_err == FLASH_ERR_BAD_CMD && !rle_unsupported &&
+            reply_code == (TASK_ID_DATALOGGER<<4|FLASH_CMD_READ_RLE))
+        {
+            rle_unsupported = 1;
+            tries--;
+        }
+    }
+    fprintf(stderr, "no reply reading %05lX\n", addr);
+    return -1;
+}
 
-void read_page(u32 pagestart)
+static int device_read(log_source_t *src, u32 addr, u8 *buf, unsigned len)
 {
-    u8 buf[3];
-    addr_to_buf(pagestart, buf);
-    waitaddr = pagestart;
-    send_msg(0xF, 0x50|FLASH_CMD_READ_PAGE, 3, buf);
+    while (len)
+    {
+        long n = device_read_part(addr, buf, len);
+
+        if (n < 0)
+        {
+            return -1;
+        }
+        addr += n;
+        buf  += n;
+        len  -= n;
+    }
+    return 0;
 }
 
-void process_descriptors(u32 addr, u16 length, u8 *buf)
+/* The chip's size and page size, from GET_INFO. */
+static u32 device_size(u8 *page_shift)
 {
+    u8 info[3];
+    int tries;
+
+    for(tries=0; tries<REPLY_RETRIES; tries++)
+    {
+        if (tries)
+        {
+            discard_late_replies();
+        }
+        reply_state = REPLY_WAIT;
+        reply_err = 0;
+        reply_code = TASK_ID_DATALOGGER<<4|FLASH_CMD_GET_INFO;
+        reply_buf = info;
+        reply_len = sizeof(info);
+        send_msg(&serial_link, 0xF, reply_code, 0, NULL);
+
+        if (!wait_reply())
+        {
+            *page_shift = info[1];
+            return 1UL << info[2];
+        }
+        if (reply_err)
+        {
+            /* no GET_INFO here */
+            break;
+        }
+    }
+    fprintf(stderr, "no flash info; assuming %ld KB\n", FLASH_SIZE_DEFAULT/1024);
+    *page_shift = 8;
+    return FLASH_SIZE_DEFAULT;
 }
 
+static int image_read(log_source_t *src, u32 addr, u8 *buf, unsigned len)
+{
+    ssize_t n = pread(src->fd, buf, len, addr);
+
+    if (n < 0)
+    {
+        perror("pread");
+        return -1;
+    }
+    /* Past the end of a short image reads as erased flash. */
+    memset(buf + n, 0xFF, len - n);
+    return 0;
+}
 
-void process_page(unsigned length, u8 *buf)
+static int source_read(log_source_t *src, u32 addr, u8 *buf, unsigned len)
 {
-    switch(state)
+    if (src->read(src, addr, buf, len))
     {
-        case READ_DESCRIPTORS
-            process_descriptors(waitaddr, length, buf);
-            break;
-        case READ_SAMPLES:
-            process_samples(waitaddr, length, buf);
+        return -1;
+    }
+    if (src->dump_fd >= 0 && pwrite(src->dump_fd, buf, len, addr) != len)
+    {
+        perror("image write");
+        src->dump_fd = -1;
+    }
+    return 0;
+}
+
+static int read_descriptors(log_source_t *src, logged_data_descriptor_t *desc)
+{
+    int count;
+
+    /* Retired slots are skipped; one never written ends the table. */
+    for(count=0; count<MAX_DESCRIPTORS; count++)
+    {
+        u8 buf[LOG_DESC_SIZE];
+        if (source_read(src, count * sizeof(buf), buf, sizeof(buf)))
+        {
+            return -1;
+        }
+        log_desc_from_buf(buf, &desc[count]);
+        if (desc[count].flags == LOG_DESC_FLAGS_ERASED)
+        {
             break;
-        default:
-            fprintf(stderr, "bad state %d\n", state);
+        }
     }
+    return log_order_descriptors(desc, count);
 }
 
+typedef struct {
+    FILE        *out;
+    int         session;        /* -1 when writing a per session file */
+} sample_out_t;
 
-void packet_received(msgaddr_t addr, u8 code, u16 length, u8 flags, u8 *payload)
+static void print_sample(void *ctx, const log_sample_t *smp)
 {
-    if (code == 0x50|FLASH_CMD_READ_PAGE)
+    sample_out_t *so = ctx;
+
+    if (so->session >= 0)
+    {
+        fprintf(so->out, "%d,", so->session);
+    }
+    if (smp->width <= 4)
     {
-        process_page(length, payload);
+        fprintf(so->out, "%llu,%d,%lu\n", smp->t_usec, smp->type,
+                log_sample_value(smp->value, smp->width));
     }
     else
     {
-        fprintf(stderr, "** Packet code %02X not expected\n", code);
+        int i;
+        fprintf(so->out, "%llu,%d,", smp->t_usec, smp->type);
+        for(i=smp->width-1; i>=0; i--)
+        {
+            fprintf(so->out, "%02X", smp->value[i]);
+        }
+        fputc('\n', so->out);
+    }
+}
+
+/******************************************************************************
+* read_session
+*        Stream one session through the decoder a chunk at a time.  A session
+*        that was never closed has no length; read it until erased flash.
+*******************************************************************************/
+/* Part of a session, for -z: from a page, to an offset, and a time for
+ * log_stream_start_near(). */
+typedef struct {
+    u32                 from;
+    u32                 to;
+    unsigned long long  near;
+} session_span_t;
+
+static int read_session(log_source_t *src, logged_data_descriptor_t *desc,
+                        const session_span_t *span, sample_out_t *so, FILE *raw)
+{
+    log_stream_t ls;
+    int version = log_desc_version(desc->flags);
+    u32 start = log_desc_start(desc);
+    u32 addr = start;
+    u32 end  = desc->data_length ? addr + desc->data_length : src->size;
+    u8 buf[IMAGE_CHUNK];
+
+    if (end > src->size)
+    {
+        end = src->size;
+    }
+
+    log_stream_init(&ls, version, print_sample, so);
+    if (span)
+    {
+        addr = span->from;
+        if (span->to < end)
+        {
+            end = span->to;
+        }
+        log_stream_start_near(&ls, span->near);
+    }
+
+    while (addr < end)
+    {
+        unsigned len = end - addr < src->chunk ? end - addr : src->chunk;
+
+        if (source_read(src, addr, buf, len))
+        {
+            return -1;
+        }
+        if (!desc->data_length)
+        {
+            long stop = log_session_end(version, addr - start, buf, len);
+            if (stop >= 0)
+            {
+                len = start + stop - addr;
+                end = addr + len;
+            }
+        }
+        log_stream_feed(&ls, buf, len);
+        if (raw && len && fwrite(buf, len, 1, raw) != 1)
+        {
+            perror("fwrite");
+            raw = NULL;
+        }
+        addr += len;
+        if (src->read == device_read)
+        {
+            fprintf(stderr, "%05lX\r", addr);
+        }
     }
+    log_stream_finish(&ls);
+
+    fprintf(stderr, "session %d: %lu bytes, %lu samples, %lu bad octets\n",
+            log_desc_seq(desc), addr - (span ? span->from : start),
+            ls.samples, ls.garbage);
+    return 0;
 }
 
+/* log2 of a size, rounded up */
+static u8 size_shift_of(u32 size)
+{
+    u8 shift = 0;
 
+    while ((1UL << shift) < size)
+    {
+        shift++;
+    }
+    return shift;
+}
+
+/******************************************************************************
+* read_preview
+*        Every written page of a preview level starts with a record, so a
+*        look at the start of each page says which to read whole: all of
+*        them, or for one session (seq >= 0) its own and the one before,
+*        where it may have started.  Records come back by session and
+*        bucket; free() them.
+*******************************************************************************/
+static int preview_cmp(const void *a, const void *b)
+{
+    const log_preview_t *pa = a, *pb = b;
+
+    if (pa->seq != pb->seq)
+    {
+        return pa->seq < pb->seq ? -1 : 1;
+    }
+    return pa->bucket < pb->bucket ? -1 : pa->bucket > pb->bucket;
+}
+
+static int read_preview(log_source_t *src, int level, int seq, log_preview_t **out)
+{
+    u8 size_shift = size_shift_of(src->size), block_shift = src->page_shift + 3;
+    u32 page = 1UL << src->page_shift, first, npages, p, pos, n;
+    log_preview_t *pv = NULL, *np;
+    int *pseq, count = 0, alloc = 0;
+    u8 buf[IMAGE_CHUNK];
+
+    first  = (u32)log_preview_first(size_shift, block_shift, level) << block_shift;
+    npages = (u32)log_preview_blocks(size_shift, block_shift, level) << 3;
+
+    /* session of each page's first record, -1 if unwritten */
+    pseq = malloc(npages * sizeof(*pseq));
+    if (!pseq)
+    {
+        return -1;
+    }
+    for(p=0; p<npages; p++)
+    {
+        if (source_read(src, first + (p << src->page_shift), buf, 5))
+        {
+            free(pseq);
+            return -1;
+        }
+        pseq[p] = buf[0] == (LOG_PREVIEW_TAG|level) ? buf[2]<<8 | buf[1] : -1;
+    }
+
+    for(p=0; p<npages; p++)
+    {
+        int next = pseq[(p+1) % npages];
+
+        if (pseq[p] < 0 || 
+            (seq >= 0 && pseq[p] != seq && 
+             (log_seq_cmp(pseq[p], seq) > 0 || (next >= 0 && log_seq_cmp(next, seq) < 0))))
+        {
+            continue;
+        }
+
+        for(pos=0; pos<page; pos+=n)
+        {
+            n = page - pos < src->chunk ? page - pos : src->chunk;
+            if (source_read(src, first + (p << src->page_shift) + pos, buf + pos, n))
+            {
+                free(pseq);
+                free(pv);
+                return -1;
+            }
+        }
+        for(pos=0; pos<page; pos+=n)
+        {
+            if (count == alloc)
+            {
+                alloc = alloc ? 2*alloc : 256;
+                np = realloc(pv, alloc * sizeof(*pv));
+                if (!np)
+                {
+                    free(pseq);
+                    free(pv);
+                    return -1;
+                }
+                pv = np;
+            }
+            n = log_preview_from_buf(buf + pos, page - pos, &pv[count]);
+            if (!n)
+            {
+                break;
+            }
+            if (pv[count].level == level && (seq < 0 || pv[count].seq == seq))
+            {
+                count++;
+            }
+        }
+    }
+    free(pseq);
+
+    qsort(pv, count, sizeof(*pv), preview_cmp);
+    *out = pv;
+    return count;
+}
+
+/* session,second,type,min,max rows for one session's records */
+static void print_preview(const log_preview_t *pv, int count, log_index_t seq, 
+                          int session, int level)
+{
+    u32 scale = level ? LOG_PREVIEW_FANOUT : 1;
+    int i, c;
+
+    for(i=0; i<count; i++)
+    {
+        for(c=0; c<LOG_MAX_CHANNELS; c++)
+        {
+            if (pv[i].seq == seq && (pv[i].mask & 1<<c))
+            {
+                printf("%d,%lu,%d,%u,%u\n", session, pv[i].bucket * scale, c+1, 
+                       pv[i].min[c], pv[i].max[c]);
+            }
+        }
+    }
+}
+
+/* Where to read a session between two level 0 buckets, from its preview:
+ * whole pages, from the one the data had reached by the end of the
+ * bucket before from to the one it had by the end of the bucket to. */
+static int zoom_span(log_source_t *src, logged_data_descriptor_t *desc,
+                     u32 from, u32 to, session_span_t *span)
+{
+    log_preview_t *pv = NULL;
+    u32 page = 1UL << src->page_shift;
+    u32 start = log_desc_start(desc);
+    u32 end = desc->data_length ? start + desc->data_length : src->size;
+    int count, i, bs = 0, bp = 0;
+    u8 key[6];
+
+    count = read_preview(src, 0, log_desc_seq(desc), &pv);
+    if (count < 0 || log_desc_version(desc->flags) != 3)
+    {
+        free(pv);
+        return -1;
+    }
+
+    span->from = start;
+    span->to   = end;
+    for(i=0; i<count; i++)
+    {
+        if (pv[i].offset <= start)
+        {
+            bs = pv[i].bucket + 1;
+        }
+        if (pv[i].bucket < from && pv[i].offset > span->from)
+        {
+            span->from = pv[i].offset & ~(page-1);
+            if (span->from < start)
+            {
+                span->from = start;
+            }
+        }
+        if (pv[i].bucket >= to && span->to == end)
+        {
+            span->to = (pv[i].offset + page-1) & ~(page-1);
+        }
+    }
+    for(i=0; i<count; i++)
+    {
+        if (pv[i].offset <= span->from)
+        {
+            bp = pv[i].bucket + 1;
+        }
+    }
+    free(pv);
+
+    /* The first sample at span->from is in bucket bp or later; the
+     * session's first keyframe is before the end of bucket bs. */
+    if (source_read(src, start, key, sizeof(key)) || key[0] != LOG_V3_KEYFRAME)
+    {
+        return -1;
+    }
+    span->near = (u32)key[5]<<24 | (u32)key[4]<<16 | (u32)key[3]<<8 | key[2];
+    if (bp > bs + 1)
+    {
+        span->near += (unsigned long long)(bp - bs - 1) * LOG_TIME_HZ;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -p <device>  serial port (default %s)\n"
+            "  -b <bps>     115200 or 38400\n"
+            "  -f <image>   read a raw flash image instead of the device\n"
+            "  -d <image>   save everything read into a raw image\n"
+            "  -s <n>       only session n\n"
+            "  -l           list the descriptors, and statistics where kept\n"
+            "  -v <level>   the preview instead: min and max per second (level\n"
+            "               0) or per %d seconds (1)\n"
+            "  -z <s>:<s>   with -s, only that part of the session, in seconds\n"
+            "               as the preview counts them, to whole pages\n"
+            "  -o <prefix>  write <prefix>-<n>.csv per session instead of stdout\n"
+            "  -B           with -o, also write the raw <prefix>-<n>.psamp\n",
+            prog, serial_device, LOG_PREVIEW_FANOUT);
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    char *image = NULL, *dump = NULL, *prefix = NULL;
+    int only = -1, list = 0, raw = 0, level = -1;
+    unsigned long zfrom = 0, zto = 0;
+    int zoom = 0;
+    session_span_t span;
+    log_source_t src;
+    struct stat st;
+    logged_data_descriptor_t desc[MAX_DESCRIPTORS];
+    int count, i;
+    static char outbuf[65536];
+
+    while ((ch=getopt(argc, argv, "p:b:f:d:s:lv:z:o:Bh")) != -1)
+    {
+        switch(ch)
+        {
+            case 'p':
+                serial_device = strdup(optarg);
+                break;
+            case 'b':
+                if (!strcmp(optarg, "115200"))
+                {
+                    port_speed = B115200;
+                }
+                else if (!strcmp(optarg, "38400"))
+                {
+                    port_speed = B38400;
+                }
+                fprintf(stderr, "Using %s bps\n", optarg);
+                break;
+            case 'f':
+                image = optarg;
+                break;
+            case 'd':
+                dump = optarg;
+                break;
+            case 's':
+                only = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                list = 1;
+                break;
+            case 'v':
+                level = strtoul(optarg, NULL, 0);
+                if (level >= LOG_PREVIEW_LEVELS)
+                {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'z':
+                if (sscanf(optarg, "%lu:%lu", &zfrom, &zto) != 2 || zto <= zfrom)
+                {
+                    usage(argv[0]);
+                    return -1;
+                }
+                zoom = 1;
+                break;
+            case 'o':
+                prefix = optarg;
+                break;
+            case 'B':
+                raw = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if ((raw && !prefix) || (zoom && only < 0))
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    memset(&src, 0, sizeof(src));
+    src.dump_fd = -1;
+    if (image)
+    {
+        src.fd = open(image, O_RDONLY);
+        if (src.fd < 0)
+        {
+            fprintf(stderr, "%s: %s\n", image, strerror(errno));
+            return -1;
+        }
+        src.read  = image_read;
+        src.chunk = IMAGE_CHUNK;
+        /* A chip's worth, as -d leaves it */
+        src.size  = FLASH_SIZE_DEFAULT;
+        if (!fstat(src.fd, &st) && st.st_size > 0)
+        {
+            src.size = 1UL << size_shift_of(st.st_size);
+        }
+        src.page_shift = log_page_shift(size_shift_of(src.size));
+    }
+    else
+    {
+        if (open_serial() == -1)
+        {
+            return -1;
+        }
+        config_port();
+        src.read  = device_read;
+        src.chunk = DEVICE_CHUNK;
+        src.size  = device_size(&src.page_shift);
+    }
+    if (dump)
+    {
+        src.dump_fd = open(dump, O_WRONLY|O_CREAT, 0644);
+        if (src.dump_fd < 0)
+        {
+            fprintf(stderr, "%s: %s\n", dump, strerror(errno));
+            return -1;
+        }
+        if (ftruncate(src.dump_fd, src.size))
+        {
+            perror("ftruncate");
+        }
+    }
+
+    count = read_descriptors(&src, desc);
+    if (count < 0)
+    {
+        return -1;
+    }
+
+    if (list)
+    {
+        for(i=0; i<count; i++)
+        {
+            printf("%3d: v%d seq %4d start %05X length %05X\n", i,
+                   log_desc_version(desc[i].flags), log_desc_seq(&desc[i]),
+                   (unsigned)log_desc_start(&desc[i]), (unsigned)desc[i].data_length);
+            if (desc[i].flags == LOG_DESC_FLAGS_V3S)
+            {
+                u8 buf[LOG_STATS_MAX];
+                log_channel_stats_t st[LOG_MAX_CHANNELS];
+                int n;
+
+                if (source_read(&src, log_desc_stats(&desc[i]), buf, sizeof(buf)))
+                {
+                    return -1;
+                }
+                n = log_stats_from_buf(buf, sizeof(buf), st);
+                if (n >= 0)
+                {
+                    log_print_stats(stdout, st, n);
+                }
+            }
+        }
+        return 0;
+    }
+
+    if (level >= 0)
+    {
+        log_preview_t *pv;
+        int n = read_preview(&src, level, only >= 0 && only < count ? 
+                             log_desc_seq(&desc[only]) : -1, &pv);
+
+        if (n < 0)
+        {
+            return -1;
+        }
+        printf("session,second,type,min,max\n");
+        for(i=0; i<count; i++)
+        {
+            if (only < 0 || i == only)
+            {
+                print_preview(pv, n, log_desc_seq(&desc[i]), i, level);
+            }
+        }
+        free(pv);
+        return 0;
+    }
+
+    if (zoom && (only >= count || zoom_span(&src, &desc[only], zfrom, zto, &span)))
+    {
+        fprintf(stderr, "no preview to zoom with\n");
+        return -1;
+    }
+
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+    if (!prefix)
+    {
+        printf("session,time_usec,type,value\n");
+    }
+
+    for(i=0; i<count; i++)
+    {
+        sample_out_t so;
+        FILE *rawf = NULL;
+        char name[1024];
+
+        if (only >= 0 && i != only)
+        {
+            continue;
+        }
+
+        if (prefix)
+        {
+            snprintf(name, sizeof(name), "%s-%d.csv", prefix, i);
+            so.out = fopen(name, "w");
+            if (!so.out)
+            {
+                fprintf(stderr, "%s: %s\n", name, strerror(errno));
+                return -1;
+            }
+            fprintf(so.out, "time_usec,type,value\n");
+            so.session = -1;
+            if (raw)
+            {
+                snprintf(name, sizeof(name), "%s-%d.psamp", prefix, i);
+                rawf = fopen(name, "wb");
+                if (!rawf)
+                {
+                    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+                }
+            }
+        }
+        else
+        {
+            so.out = stdout;
+            so.session = i;
+        }
+
+        if (read_session(&src, &desc[i], zoom ? &span : NULL, &so, rawf))
+        {
+            return -1;
+        }
+
+        if (prefix)
+        {
+            fclose(so.out);
+        }
+        if (rawf)
+        {
+            fclose(rawf);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
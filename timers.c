@@ -36,16 +36,29 @@
  * Every 1ms, the timer 1 count is reset in hardware.
  * This allows more resolution for timing events, even
  * though events can't be scheduled at that resolution.
- * If this timing resolution is necessary any systemic
- * errors will have to be measured for compensation.
+ * The timebase carries the timer 1 count on from tick to
+ * tick for that.
  */
 
 timerinterval_t systemTick;
 timersubtick_t  systemSubTick;
+static timebase_t tickTimebase;     /* at the start of this tick */
 
-timerinterval_t readsubtick()
+timebase_t read_timebase()
 {
-    return TCNT1 / ((CPU_FREQ/TICKS_PER_SEC)/SUBTICKS_PER_TICK);
+    u8 flags = disable_interrupts();
+    timebase_t t = tickTimebase;
+    u16 count = TCNT1;
+
+    if (TIFR1 & (1<<OCF1A))
+    {
+        /* The count cleared and the interrupt hasn't run yet; the count
+         * read before the flag may be from either side of that. */
+        count = TCNT1 + TIMEBASE_PER_TICK;
+    }
+    restore_flags(flags);
+
+    return t + count;
 }
     
 
@@ -63,15 +76,15 @@ void systimer_init()
      *          6:6 ICES1     0   // n/a
      *          5:5           0   // reserved
      *          4:3 WGM1 3:2  01  // CTC (mode 4 >> 2)
-     *          2:0 CS1       001 // CLKio/1 -- no prescaling
+     *          2:0 CS1       010 // CLKio/8
      */
     TCCR1A = 0;
-    TCCR1B = 9;
+    TCCR1B = 0x0A;
     
     /* Set count to zero */
     TCNT1 = 0;
-    /* Set output compare to every 1ms */
-    OCR1A = CPU_FREQ/TICKS_PER_SEC;
+    /* Set output compare to every 1ms; the count runs 0..OCR1A */
+    OCR1A = TIMEBASE_PER_TICK - 1;
 
     /* 
      *          5: TCIE1     0  // input capture
@@ -87,6 +100,7 @@ timerentry_t *timerChainHead;
 SIGNAL(SIG_OUTPUT_COMPARE1A)
 {
     ++systemTick;
+    tickTimebase += TIMEBASE_PER_TICK;
     timerentry_t **tpp;
     
     for(tpp=&timerChainHead; *tpp; )
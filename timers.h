@@ -26,13 +26,21 @@
 #define TIMERS_H
 
 #include "types.h"
+#include "platform.h"
 
 #define TICKS_PER_SEC 1000L
-#define SUBTICKS_PER_TICK 1000L 
 #define MS_TO_TICK(x) ((x)*(TICKS_PER_SEC/1000L))
-#define SUBTICK_TO_USEC(x) ((x)*(1000000L/(TICKS_PER_SEC*SUBTICKS_PER_TICK)))
 #define TICK_TO_MSEC(x) ((x)*(TICKS_PER_SEC/1000L))
 
+/* Timer 1 counts at CPU_FREQ/8 and clears every tick.  The timebase is
+ * its count since power up, 32 bits wide, so it wraps after about 31
+ * minutes.  Differences are all anything should take of it. */
+#define TIMEBASE_HZ         (CPU_FREQ/8)
+#define TIMEBASE_PER_TICK   (TIMEBASE_HZ/TICKS_PER_SEC)
+#define USEC_TO_TIMEBASE(x) ((x)*(TIMEBASE_HZ/1000L)/1000L)
+
+typedef u32 timebase_t;
+
 void systimer_init();
 
 typedef u16 timerinterval_t;   /* in milliseconds */
@@ -75,7 +83,18 @@ static inline timerinterval_t readtime()
     return systemTick;
 }
 
-timerinterval_t readsubtick();
+timebase_t read_timebase();
+
+/* Busy wait.  With interrupts off it only holds under one 1 ms tick
+ * (the one-wire delays): past a second compare match the count steps
+ * back and the wait ends early. */
+static inline void timebase_delay(timebase_t count)
+{
+    timebase_t start = read_timebase();
+
+    while (read_timebase() - start < count)
+        ;
+}
 
 void delta_usec(timerinterval_t tick1, timersubtick_t subtick1,
                 timerinterval_t tick2, timersubtick_t subtick2,
@@ -274,7 +274,7 @@ u8 ui_task()
         {
             current.stop_updates = 1;
 
-            send_msg(BROADCAST_NODE_ID,
+            send_msg(&uart_link, BROADCAST_NODE_ID,
                     TASK_ID_UI<<4|UI_MSG_STOP_UPDATES, 0, 0);
 			
         }
@@ -290,7 +290,7 @@ u8 ui_task()
         else if (code == UI_MSG_READ_ADC)
         {
             u16 adc = boost_read_raw_adc();
-            send_msg(BROADCAST_NODE_ID, TASK_ID_UI<<4|UI_MSG_READ_ADC, 2, 
+            send_msg(&uart_link, BROADCAST_NODE_ID, TASK_ID_UI<<4|UI_MSG_READ_ADC, 2, 
                     (u8*)&adc);
         }
 #endif